@@ -0,0 +1,248 @@
+/**
+ * Serve byte ranges of a static file, from a `Range` request header.
+ *
+ * A single range is sent as a 206 response with `sendfile` from the
+ * offset of the range. Several ranges are sent as a multipart/byteranges
+ * body, each part with its own headers. With `If-Range` the ranges are
+ * only sent if the file hasn't changed, otherwise the whole file is.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "serverlist.h"
+#include "server.h"
+
+// more ranges than this in one request are ignored, and the whole file
+// is sent, as protection against requests for many tiny ranges
+#define MAX_RANGES 16
+
+typedef struct {
+	off_t start;
+	off_t end;		// inclusive
+} _range;
+
+// the largest off_t
+#define OFF_MAX ((off_t)(((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/**
+ * Parse a number in a range spec. A number too big for an off_t is taken
+ * as the largest one, past the end of any file: as a first byte it isn't
+ * satisfiable, as a last byte or a suffix length it means the whole rest
+ * of the file.
+ * Returns: pointer past the number, NULL if there are no digits
+ */
+static const char *
+parseOffset(const char *p, const char *end, off_t *n)
+{
+	if ((p == end) || !isdigit(*p)) {
+		return NULL;
+	}
+	*n = 0;
+	while ((p < end) && isdigit(*p)) {
+		int digit = *p++ - '0';
+		if (*n > (OFF_MAX - digit) / 10) {
+			*n = OFF_MAX;
+		} else {
+			*n = *n * 10 + digit;
+		}
+	}
+	return p;
+}
+
+/**
+ * Parse a Range header such as `bytes=0-499, 1000-, -500`
+ * Returns: the number of satisfiable ranges, 0 if none of them is,
+ * -1 if the header is invalid or has too many ranges and is ignored
+ */
+static int
+parseRanges(const char *v, int len, off_t size, _range *ranges)
+{
+	const char *end = v + len;
+	if ((len < 6) || (strncmp(v, "bytes=", 6) != 0)) {
+		return -1;
+	}
+	const char *p = v + 6;
+	int count = 0;
+	while (p < end) {
+		while ((p < end) && (*p == ' ')) {
+			p++;
+		}
+		off_t start;
+		off_t last;
+		if ((p < end) && (*p == '-')) {
+			// the last n bytes
+			off_t n;
+			p = parseOffset(p + 1, end, &n);
+			if (p == NULL) {
+				return -1;
+			}
+			start = (n < size) ? size - n : 0;
+			last = size - 1;
+			if (n == 0) {
+				start = size;	// not satisfiable
+			}
+		} else {
+			p = parseOffset(p, end, &start);
+			if ((p == NULL) || (p == end) || (*p != '-')) {
+				return -1;
+			}
+			p++;
+			if ((p < end) && isdigit(*p)) {
+				p = parseOffset(p, end, &last);
+				if (last < start) {
+					return -1;
+				}
+				if (last >= size) {
+					last = size - 1;
+				}
+			} else {
+				last = size - 1;
+			}
+		}
+		while ((p < end) && (*p == ' ')) {
+			p++;
+		}
+		if ((p < end) && (*p++ != ',')) {
+			return -1;
+		}
+		if (start >= size) {
+			continue;
+		}
+		if (count == MAX_RANGES) {
+			return -1;
+		}
+		ranges[count].start = start;
+		ranges[count].end = last;
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Check `If-Range`, which is either the entity tag or the modification
+ * date of the file. Only an exact, strong, match counts.
+ * Returns: true if the ranges can be sent
+ */
+static bool
+ifRangeMatches(_request *req)
+{
+	int len;
+	const char *v = getRequestHeader(req, "If-Range", strlen("If-Range"), &len);
+	if (v == NULL) {
+		return true;
+	}
+	if (*v == '"') {
+		char etag[64];
+		formatETag(&req->st, etag, sizeof(etag));
+		return ((size_t)len == strlen(etag)) && (strncmp(v, etag, len) == 0);
+	}
+	const char *date = getHttpDate(req->st.st_mtime);
+	return ((size_t)len == strlen(date)) && (strncmp(v, date, len) == 0);
+}
+
+/**
+ * Send the parts of a multipart/byteranges response
+ */
+static size_t
+sendParts(_request *req, _response *r, _range *ranges, int count, bool body)
+{
+	static __thread unsigned long boundaryCount = 0;
+	char boundary[24];
+	snprintf(boundary, sizeof(boundary), "%010lu", ((unsigned long)getpid() << 16) + ++boundaryCount);
+	int typeLen;
+	const char *contentType = getContentTypeHeader(req->fullPath, &typeLen);
+
+	char *parts[MAX_RANGES];
+	int partLen[MAX_RANGES];
+	size_t size = 0;
+	for (int i = 0; i < count; i++) {
+		partLen[i] = asprintf(&parts[i], "\r\n--%s\r\n%.*sContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			boundary, typeLen, contentType, (long)ranges[i].start, (long)ranges[i].end,
+			(long)req->st.st_size);
+		size += partLen[i] + (ranges[i].end - ranges[i].start + 1);
+	}
+	char trailer[48];
+	int trailerLen = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+	size += trailerLen;
+
+	addHeader(r, "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %zu\r\n", boundary, size);
+	if (sendResponse(req, r, body) < 0) {
+		body = false;
+	}
+	for (int i = 0; i < count; i++) {
+		if (body) {
+			sendToClient(req, parts[i], partLen[i]);
+			sendFile(req, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+		}
+		free(parts[i]);
+	}
+	if (body) {
+		sendToClient(req, trailer, trailerLen);
+	}
+	return size;
+}
+
+/**
+ * Send the ranges of the file the request asks for
+ * Returns: true if a response was sent, false if the whole file should be
+ */
+bool
+sendRanges(_request *req)
+{
+	int len;
+	const char *v = getRequestHeader(req, "Range", strlen("Range"), &len);
+	if ((v == NULL) || !ifRangeMatches(req)) {
+		return false;
+	}
+	_range ranges[MAX_RANGES];
+	int count = parseRanges(v, len, req->st.st_size, ranges);
+	if (count < 0) {
+		return false;
+	}
+
+	_response r;
+	if (count == 0) {
+		startResponse(&r, 416, "Requested Range Not Satisfiable");
+		addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+		addHeader(&r, "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n", (long)req->st.st_size);
+		sendResponse(req, &r, false);
+		accessLog(req, 416, 0);
+		return true;
+	}
+
+	startResponse(&r, 206, "Partial Content");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	addValidators(&r, &req->st);
+	addContentEncoding(&r, req);
+	addExpires(&r, req->loc, req->st.st_mtime);
+	bool body = (strcmp(req->verb, "GET") == 0);
+	size_t size;
+	corkClient(req, true);
+	if (count == 1) {
+		int typeLen;
+		const char *contentType = getContentTypeHeader(req->fullPath, &typeLen);
+		addHeaderBlock(&r, contentType, typeLen);
+		size = ranges[0].end - ranges[0].start + 1;
+		addHeader(&r, "Content-Range: bytes %ld-%ld/%ld\r\nContent-Length: %zu\r\n",
+			(long)ranges[0].start, (long)ranges[0].end, (long)req->st.st_size, size);
+		if (sendResponse(req, &r, body) < 0) {
+			body = false;
+		}
+		if (body) {
+			sendFile(req, ranges[0].start, size);
+		}
+	} else {
+		size = sendParts(req, &r, ranges, count, body);
+	}
+	corkClient(req, false);
+	accessLog(req, 206, size);
+	return true;
+}
@@ -10,5 +10,6 @@ typedef struct _clientConnection {
 	_server *server;
 	char ip[INET_ADDRSTRLEN];
 	SSL_CTX *ctx;
+	_conn_hold *holds;	// `limit_conn` counts
 	struct _clientConnection *next;
 }_clientConnection;
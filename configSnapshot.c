@@ -0,0 +1,267 @@
+/**
+ * Pack the parsed configuration into one read-only block.
+ *
+ * The config parser builds linked lists of small objects: the servers,
+ * their names, ports, locations and index files. When the config file
+ * has been checked, the parts a request looks up are copied into a
+ * single block of memory, as arrays with the strings interned:
+ * - the server names with their ports, sorted, so the server for a Host
+ *   header is found with a binary search
+ * - the locations of each server, in the order they are matched, with
+ *   the regexes compiled
+ * - the index files of each server
+ *
+ * The block is made read-only once it is filled. The workers are forked
+ * with it and never write to it, so its pages stay shared with the
+ * master. On a reload the master builds a new snapshot and drops the old
+ * one, the draining workers have their own copy.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <regex.h>
+#include <sys/mman.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+typedef struct {
+	char *base;
+	size_t used;
+	size_t size;
+} _arena;
+
+// the strings already in the arena, while it is filled
+typedef struct {
+	const char **slots;
+	size_t size;
+} _interned;
+
+static void *
+arenaAlloc(_arena *a, size_t n)
+{
+	n = (n + 7) & ~(size_t)7;
+	if (a->used + n > a->size) {
+		errorExit("config snapshot overflow\n");
+	}
+	void *p = a->base + a->used;
+	a->used += n;
+	return p;
+}
+
+/**
+ * Copy a string into the arena, once
+ */
+static const char *
+intern(_arena *a, _interned *strings, const char *s, size_t len)
+{
+	unsigned long h = 5381;
+	for (size_t i = 0; i < len; i++) {
+		h = h * 33 + (unsigned char)s[i];
+	}
+	size_t i = h % strings->size;
+	while (strings->slots[i]) {
+		const char *t = strings->slots[i];
+		if ((strlen(t) == len) && (memcmp(t, s, len) == 0)) {
+			return t;
+		}
+		i = (i + 1) % strings->size;
+	}
+	char *copy = arenaAlloc(a, len + 1);
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	strings->slots[i] = copy;
+	return copy;
+}
+
+static int
+compareNames(const _host_entry *a, const _host_entry *b)
+{
+	if (a->port != b->port) {
+		return (a->port < b->port) ? -1 : 1;
+	}
+	if (a->nameLen != b->nameLen) {
+		return (a->nameLen < b->nameLen) ? -1 : 1;
+	}
+	return memcmp(a->name, b->name, a->nameLen);
+}
+
+static int
+compareHosts(const void *x, const void *y)
+{
+	const _host_entry *a = x;
+	const _host_entry *b = y;
+	int cmp = compareNames(a, b);
+	if (cmp != 0) {
+		return cmp;
+	}
+	// the first server with a name gets its requests, the indexes
+	// are in the order of the servers
+	return (a->server->index < b->server->index) ? -1 : (a->server->index > b->server->index);
+}
+
+/**
+ * Release a snapshot that is no longer used
+ */
+static void
+freeSnapshot(_config_snapshot *config)
+{
+	for (int s = 0; s < config->serverCount; s++) {
+		const _server_index *si = &config->servers[s];
+		for (int i = 0; i < si->locationCount; i++) {
+			if (si->locations[i].regex) {
+				regfree(si->locations[i].regex);
+				free(si->locations[i].regex);
+			}
+		}
+	}
+	munmap(config->arena, config->size);
+	free(config);
+}
+
+/**
+ * Build the snapshot of the servers. Called when the config file has been
+ * checked, and before anything looks up a location.
+ */
+void
+buildConfigSnapshot()
+{
+	// the size of the block, the strings are counted as if none were shared
+	int serverCount = 0;
+	int hostCount = 0;
+	int locationCount = 0;
+	int indexFileCount = 0;
+	size_t stringBytes = 0;
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		serverCount++;
+		int ports = 0;
+		for (_port *p = s->ports; p != NULL; p = p->next) {
+			ports++;
+		}
+		for (_server_name *sn = s->serverNames; sn != NULL; sn = sn->next) {
+			hostCount += ports;
+			stringBytes += strlen(sn->serverName) + 8;
+		}
+		for (_location *loc = s->locations; loc != NULL; loc = loc->next) {
+			locationCount++;
+			stringBytes += (loc->match ? strlen(loc->match) : 0) + 8;
+		}
+		for (_index_file *f = s->indexFiles; f != NULL; f = f->next) {
+			indexFileCount++;
+			stringBytes += strlen(f->indexFile) + 8;
+		}
+	}
+	_config_snapshot *config = (_config_snapshot *)calloc(1, sizeof(_config_snapshot));
+	config->size = hostCount * sizeof(_host_entry)
+		+ serverCount * sizeof(_server_index)
+		+ locationCount * sizeof(_location_entry)
+		+ indexFileCount * sizeof(_index_entry)
+		+ stringBytes + 32;
+	config->arena = mmap(NULL, config->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (config->arena == MAP_FAILED) {
+		errorExit("can't allocate the config snapshot\n");
+	}
+	_arena a = {config->arena, 0, config->size};
+	_interned strings;
+	strings.size = 2 * (hostCount + locationCount + indexFileCount) + 1;
+	strings.slots = (const char **)calloc(strings.size, sizeof(char *));
+
+	_host_entry *hosts = arenaAlloc(&a, hostCount * sizeof(_host_entry));
+	_server_index *servers = arenaAlloc(&a, serverCount * sizeof(_server_index));
+	_location_entry *locations = arenaAlloc(&a, locationCount * sizeof(_location_entry));
+	_index_entry *indexFiles = arenaAlloc(&a, indexFileCount * sizeof(_index_entry));
+	int h = 0;
+	_server_index *si = servers;
+	for (_server *s = getServerList(); s != NULL; s = s->next, si++) {
+		s->index = si;
+		si->locations = locations;
+		for (_location *loc = s->locations; loc != NULL; loc = loc->next) {
+			_location_entry *e = &locations[si->locationCount++];
+			e->matchType = loc->matchType;
+			e->loc = loc;
+			if (loc->match) {
+				e->matchLen = strlen(loc->match);
+				e->match = intern(&a, &strings, loc->match, e->matchLen);
+			}
+			if (loc->matchType == REGEX_MATCH) {
+				e->regex = (regex_t *)malloc(sizeof(regex_t));
+				if (regcomp(e->regex, loc->match, 0) != 0) {
+					fprintf(stderr, "%s: ", loc->match);
+					errorExit("invalid location regex\n");
+				}
+			}
+		}
+		locations += si->locationCount;
+
+		si->indexFiles = indexFiles;
+		for (_index_file *f = s->indexFiles; f != NULL; f = f->next) {
+			const char *name = f->indexFile;
+			while (*name == '/') {
+				name++;
+			}
+			_index_entry *e = &indexFiles[si->indexFileCount++];
+			e->len = strlen(name);
+			e->name = intern(&a, &strings, name, e->len);
+		}
+		indexFiles += si->indexFileCount;
+
+		for (_server_name *sn = s->serverNames; sn != NULL; sn = sn->next) {
+			int len = strlen(sn->serverName);
+			const char *name = intern(&a, &strings, sn->serverName, len);
+			for (_port *p = s->ports; p != NULL; p = p->next) {
+				hosts[h].port = p->portNum;
+				hosts[h].nameLen = len;
+				hosts[h].name = name;
+				hosts[h].server = s;
+				h++;
+			}
+		}
+	}
+	qsort(hosts, hostCount, sizeof(_host_entry), compareHosts);
+	free(strings.slots);
+	config->hosts = hosts;
+	config->hostCount = hostCount;
+	config->servers = servers;
+	config->serverCount = serverCount;
+	mprotect(config->arena, config->size, PROT_READ);
+
+	_config_snapshot *old = getConfigSnapshot();
+	setConfigSnapshot(config);
+	if (old) {
+		freeSnapshot(old);
+	}
+	if (isDebug()) {
+		fprintf(stderr, "Config snapshot: %d servers, %d hosts, %d locations, %zu bytes\n",
+			serverCount, hostCount, locationCount, a.used);
+	}
+}
+
+/**
+ * Find the first server with a name on a port
+ * Returns: the server, NULL if there is none
+ */
+_server *
+lookupServer(int port, const char *name, size_t len)
+{
+	const _config_snapshot *config = getConfigSnapshot();
+	_host_entry key = {port, len, name, NULL};
+	int lo = 0;
+	int hi = config->hostCount;
+	// the first of the entries with the name
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (compareNames(&config->hosts[mid], &key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo < config->hostCount) && (compareNames(&config->hosts[lo], &key) == 0)) {
+		return config->hosts[lo].server;
+	}
+	return NULL;
+}
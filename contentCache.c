@@ -0,0 +1,528 @@
+/**
+ * Keep small, frequently requested files in memory, the `content_cache`
+ * directive.
+ *
+ * An entry holds the response headers that don't change, and the body.
+ * A small file is read into the same buffer right after its headers, a
+ * bigger one is mapped with `mmap`. A hit is served without touching the
+ * file system, with one `sendmsg` for the status line, headers and body.
+ *
+ * The entries are looked up by the path the request maps to, and are
+ * dropped when anything changes in their directory, which is watched with
+ * inotify by a thread of the worker. A directory is watched while it has
+ * entries, so the watches don't run out. The memory used is kept under the
+ * configured size by the CLOCK algorithm: a hit marks the entry, and the
+ * hand sweeping for room spares a marked entry once.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include "serverlist.h"
+#include "server.h"
+
+#define CONTENT_CACHE_BUCKETS 1024
+#define WATCH_BUCKETS 256
+// files at least this big are mapped rather than read into the entry
+#define CONTENT_CACHE_MMAP_MIN (16*1024)
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct _content_entry {
+	struct _content_entry *next;	// in the hash chain
+	struct _content_entry *clockNext;
+	struct _content_entry *clockPrev;
+	char *key;			// the path the request maps to
+	_location *loc;		// the headers are those of this location
+	int wd;				// inotify watch of the file's directory
+	struct stat st;
+	char *buf;			// the headers, followed by a small file
+	int headersLen;
+	char *body;
+	bool mapped;
+	size_t cost;
+	bool referenced;	// hit since the clock hand last passed
+	int refs;			// requests sending the entry
+	bool evicted;		// freed when the last request is done with it
+} _content_entry;
+
+// the entries of a watched directory
+typedef struct _watch {
+	struct _watch *next;
+	int wd;
+	int entries;
+	bool gone;		// removed by the kernel, its directory is gone
+} _watch;
+
+// shared by the TLS server's threads and the watcher thread
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static _content_entry *buckets[CONTENT_CACHE_BUCKETS];
+static _content_entry *hand = NULL;
+static size_t cached = 0;
+static _watch *watches[WATCH_BUCKETS];
+static int inotifyFd = -1;
+static pthread_once_t watcherOnce = PTHREAD_ONCE_INIT;
+// set when changes can't be watched, nothing is cached from then on
+static atomic_bool cacheOff = false;
+
+static unsigned
+bucketFor(const char *key)
+{
+	unsigned long h = 5381;
+	while (*key) {
+		h = h * 33 + (unsigned char)*key++;
+	}
+	return h % CONTENT_CACHE_BUCKETS;
+}
+
+static void
+freeEntry(_content_entry *e)
+{
+	if (e->mapped) {
+		munmap(e->body, e->st.st_size);
+	}
+	free(e->buf);
+	free(e->key);
+	free(e);
+}
+
+static _watch *
+findWatch(int wd)
+{
+	_watch *w = watches[wd % WATCH_BUCKETS];
+	while ((w != NULL) && (w->wd != wd)) {
+		w = w->next;
+	}
+	return w;
+}
+
+/**
+ * Count an entry, or one being built, for a watch. Called with the lock
+ * held.
+ */
+static void
+holdWatch(int wd)
+{
+	_watch *w = findWatch(wd);
+	if (w == NULL) {
+		w = (_watch *)calloc(1, sizeof(_watch));
+		w->wd = wd;
+		w->next = watches[wd % WATCH_BUCKETS];
+		watches[wd % WATCH_BUCKETS] = w;
+	}
+	w->entries++;
+}
+
+/**
+ * Uncount an entry for a watch, and remove the watch with its last entry.
+ * Called with the lock held.
+ */
+static void
+releaseWatch(int wd)
+{
+	_watch **p = &watches[wd % WATCH_BUCKETS];
+	while ((*p != NULL) && ((*p)->wd != wd)) {
+		p = &(*p)->next;
+	}
+	_watch *w = *p;
+	if ((w == NULL) || (--w->entries > 0)) {
+		return;
+	}
+	*p = w->next;
+	if (!w->gone) {
+		inotify_rm_watch(inotifyFd, wd);
+	}
+	free(w);
+}
+
+/**
+ * Take an entry out of the cache. It is freed now, or when the last
+ * request using it releases it. Called with the lock held.
+ */
+static void
+evictEntry(_content_entry *e)
+{
+	_content_entry **p = &buckets[bucketFor(e->key)];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	if (e->clockNext == e) {
+		hand = NULL;
+	} else {
+		e->clockPrev->clockNext = e->clockNext;
+		e->clockNext->clockPrev = e->clockPrev;
+		if (hand == e) {
+			hand = e->clockNext;
+		}
+	}
+	cached -= e->cost;
+	releaseWatch(e->wd);
+	if (e->refs == 0) {
+		freeEntry(e);
+	} else {
+		e->evicted = true;
+	}
+}
+
+static void
+releaseEntry(_content_entry *e)
+{
+	pthread_mutex_lock(&cacheLock);
+	if ((--e->refs == 0) && e->evicted) {
+		freeEntry(e);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * Drop the entries of a watched directory, or all of them when the
+ * watch is -1. Called with the lock held.
+ */
+static void
+invalidate(int wd)
+{
+	for (int i = 0; i < CONTENT_CACHE_BUCKETS; i++) {
+		_content_entry *e = buckets[i];
+		while (e != NULL) {
+			_content_entry *next = e->next;
+			if ((wd == -1) || (e->wd == wd)) {
+				evictEntry(e);
+			}
+			e = next;
+		}
+	}
+}
+
+/**
+ * Thread which reads the inotify events for the watched directories
+ */
+static void *
+contentWatcher(void *param)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t n = read(inotifyFd, events, sizeof(events));
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			break;
+		}
+		pthread_mutex_lock(&cacheLock);
+		for (char *p = events; p < events + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->mask & IN_IGNORED) {
+				// an entry being built for it mustn't be added
+				_watch *w = findWatch(ev->wd);
+				if (w) {
+					w->gone = true;
+				}
+			}
+			invalidate((ev->mask & IN_Q_OVERFLOW) ? -1 : ev->wd);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+		pthread_mutex_unlock(&cacheLock);
+	}
+	// without events the entries can't be trusted
+	pthread_mutex_lock(&cacheLock);
+	atomic_store(&cacheOff, true);
+	invalidate(-1);
+	pthread_mutex_unlock(&cacheLock);
+	return param;
+}
+
+/**
+ * Start the watcher thread, once, by the first TLS thread or request to
+ * insert a file
+ */
+static void
+initWatcher()
+{
+	inotifyFd = inotify_init1(IN_CLOEXEC);
+	if (inotifyFd < 0) {
+		fprintf(stderr, "inotify_init1 failed, content cache disabled: %m\n");
+		atomic_store(&cacheOff, true);
+		return;
+	}
+	// the signals are for the server's main thread
+	sigset_t set, oldSet;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+	pthread_t watcher;
+	if (pthread_create(&watcher, NULL, contentWatcher, NULL) == 0) {
+		pthread_detach(watcher);
+	} else {
+		close(inotifyFd);
+		inotifyFd = -1;
+		atomic_store(&cacheOff, true);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+}
+
+/**
+ * Start watching for changes, in the worker process on the first insert
+ * Returns: false if inotify can't be used, and nothing is cached
+ */
+static bool
+startWatcher()
+{
+	pthread_once(&watcherOnce, initWatcher);
+	return !atomic_load(&cacheOff);
+}
+
+/**
+ * The cache key, the path a request maps to before an index file is
+ * looked for
+ */
+static bool
+cacheKey(_request *req, char *key, int size)
+{
+	const char *root = req->loc->root;
+	int len = snprintf(key, size, "%s%s%s", root, (req->path[0] != '/') ? "/" : "", req->path);
+	return len < size;
+}
+
+/**
+ * Check if the response to a request may come from the cache. Ranges and
+ * responses that depend on Accept-Encoding are served the usual way.
+ */
+static bool
+cacheUsable(_request *req)
+{
+	int len;
+	if ((getContentCacheSize() == 0) || atomic_load(&cacheOff) || (req->loc == NULL) || (req->loc->root == NULL)
+		|| getRequestHeader(req, "Range", strlen("Range"), &len)) {
+		return false;
+	}
+	if ((isGzip() || isGzipStatic() || isBrotliStatic())
+		&& getRequestHeader(req, "Accept-Encoding", strlen("Accept-Encoding"), &len)) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Send a response from a cache entry
+ */
+static void
+sendEntry(_request *req, _content_entry *e)
+{
+	req->st = e->st;
+	if (notModified(req)) {
+		sendNotModified(req);
+		return;
+	}
+	_response r;
+	startResponse(&r, 200, "OK");
+	addHeaderBlock(&r, e->buf, e->headersLen);
+	addExpires(&r, req->loc, e->st.st_mtime);
+	if (strcmp(req->verb, "GET") == 0) {
+		setResponseBody(&r, e->body, e->st.st_size);
+	}
+	sendResponse(req, &r, false);
+	accessLog(req, 200, e->st.st_size);
+}
+
+/**
+ * Serve a request from the cache
+ * Returns: true if a response was sent, otherwise the request is marked
+ * so the file it is answered with may be added to the cache
+ */
+bool
+sendCachedFile(_request *req)
+{
+	char key[BUFF_SIZE];
+	if (!cacheUsable(req) || !cacheKey(req, key, BUFF_SIZE)) {
+		return false;
+	}
+	pthread_mutex_lock(&cacheLock);
+	_content_entry *e = buckets[bucketFor(key)];
+	while ((e != NULL) && ((strcmp(e->key, key) != 0) || (e->loc != req->loc))) {
+		e = e->next;
+	}
+	if (e) {
+		e->referenced = true;
+		e->refs++;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	if (e == NULL) {
+		req->cacheable = true;
+		return false;
+	}
+	sendEntry(req, e);
+	releaseEntry(e);
+	return true;
+}
+
+/**
+ * Make room for an entry with the clock hand. Called with the lock held.
+ */
+static void
+makeRoom(size_t cost, size_t limit)
+{
+	while (hand && (cached + cost > limit)) {
+		if (hand->referenced) {
+			hand->referenced = false;
+			hand = hand->clockNext;
+		} else {
+			evictEntry(hand);
+		}
+	}
+}
+
+/**
+ * Build an entry for the open file of a request: the headers of its
+ * 200 response, which are the same for every request, and its content
+ */
+static _content_entry *
+buildEntry(_request *req, const char *key, int wd)
+{
+	size_t size = req->st.st_size;
+	char headers[BUFF_SIZE];
+	int typeLen;
+	const char *contentType = getContentTypeHeader(req->fullPath, &typeLen);
+	char etag[64];
+	formatETag(&req->st, etag, sizeof(etag));
+	int len = snprintf(headers, BUFF_SIZE, "%.*s%.*sAccept-Ranges: bytes\r\nContent-Length: %zu\r\n"
+		"ETag: %s\r\nLast-Modified: %s\r\n%s",
+		req->loc->headersLen, req->loc->headers, typeLen, contentType, size,
+		etag, getHttpDate(req->st.st_mtime),
+		(isGzip() || isGzipStatic() || isBrotliStatic()) ? "Vary: Accept-Encoding\r\n" : "");
+	if (len >= BUFF_SIZE) {
+		return NULL;
+	}
+
+	_content_entry *e = (_content_entry *)calloc(1, sizeof(_content_entry));
+	e->mapped = (size >= CONTENT_CACHE_MMAP_MIN);
+	e->buf = malloc(len + (e->mapped ? 0 : size));
+	memcpy(e->buf, headers, len);
+	e->headersLen = len;
+	if (e->mapped) {
+		e->body = mmap(NULL, size, PROT_READ, MAP_SHARED, req->localFd, 0);
+		if (e->body == MAP_FAILED) {
+			e->mapped = false;
+			freeEntry(e);
+			return NULL;
+		}
+	} else {
+		e->body = e->buf + len;
+		size_t got = 0;
+		while (got < size) {
+			ssize_t n = pread(req->localFd, e->body + got, size - got, got);
+			if (n <= 0) {
+				freeEntry(e);
+				return NULL;
+			}
+			got += n;
+		}
+	}
+	// changed while it was read
+	struct stat st;
+	if ((fstat(req->localFd, &st) < 0) || (st.st_mtime != req->st.st_mtime) || (st.st_size != req->st.st_size)) {
+		freeEntry(e);
+		return NULL;
+	}
+	e->key = strdup(key);
+	e->loc = req->loc;
+	e->wd = wd;
+	e->st = req->st;
+	e->cost = len + size;
+	return e;
+}
+
+/**
+ * Add the file being served to the cache, if it is small enough, and
+ * send it from there
+ * Returns: true if a response was sent
+ */
+bool
+cacheAndSendFile(_request *req)
+{
+	size_t limit = getContentCacheSize();
+	if (!req->cacheable || (limit == 0) || !S_ISREG(req->st.st_mode)
+		|| (req->st.st_size > getContentCacheMaxFile()) || ((size_t)req->st.st_size > limit / 2)) {
+		return false;
+	}
+	char key[BUFF_SIZE];
+	if (!cacheKey(req, key, BUFF_SIZE) || !startWatcher()) {
+		return false;
+	}
+	// the watch is added before the file is read, so no change is missed,
+	// and held, so it isn't removed with the other entries of the directory
+	char dir[BUFF_SIZE];
+	snprintf(dir, BUFF_SIZE, "%s", req->fullPath);
+	char *slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		return false;
+	}
+	*slash = '\0';
+	pthread_mutex_lock(&cacheLock);
+	int wd = inotify_add_watch(inotifyFd, (dir[0] != '\0') ? dir : "/", WATCH_EVENTS);
+	if (wd >= 0) {
+		holdWatch(wd);
+	}
+	pthread_mutex_unlock(&cacheLock);
+	if (wd < 0) {
+		if (isDebug()) {
+			fprintf(stderr, "%s: inotify_add_watch failed: %m\n", dir);
+		}
+		return false;
+	}
+	_content_entry *e = buildEntry(req, key, wd);
+
+	pthread_mutex_lock(&cacheLock);
+	_watch *w = findWatch(wd);
+	if ((e == NULL) || atomic_load(&cacheOff) || w->gone) {
+		// or the watcher or the watch stopped since the file was read
+		releaseWatch(wd);
+		pthread_mutex_unlock(&cacheLock);
+		if (e) {
+			freeEntry(e);
+		}
+		return false;
+	}
+	// another thread may have added it meanwhile
+	_content_entry *other = buckets[bucketFor(key)];
+	while ((other != NULL) && ((strcmp(other->key, key) != 0) || (other->loc != req->loc))) {
+		other = other->next;
+	}
+	if (other) {
+		evictEntry(other);
+	}
+	makeRoom(e->cost, limit);
+	unsigned b = bucketFor(key);
+	e->next = buckets[b];
+	buckets[b] = e;
+	if (hand) {
+		// just behind the hand, the last to be looked at
+		e->clockNext = hand;
+		e->clockPrev = hand->clockPrev;
+		hand->clockPrev->clockNext = e;
+		hand->clockPrev = e;
+	} else {
+		e->clockNext = e;
+		e->clockPrev = e;
+		hand = e;
+	}
+	cached += e->cost;
+	e->refs++;
+	pthread_mutex_unlock(&cacheLock);
+
+	sendEntry(req, e);
+	releaseEntry(e);
+	return true;
+}
@@ -0,0 +1,173 @@
+/**
+ * Bind worker processes to CPUs, and steer each new connection to the
+ * worker that runs on the CPU which received it.
+ *
+ * The `worker_cpu_affinity` directive either lists one binary mask per
+ * worker, or says `auto` (optionally followed by a mask limiting which
+ * CPUs may be used), in which case worker N is bound to the Nth CPU.
+ *
+ * All the listening sockets for a port belong to one SO_REUSEPORT group.
+ * They are created in worker order before the workers are forked, so
+ * socket N of the group belongs to worker N. A small classic BPF program
+ * attached to the group looks at the CPU handling the incoming packet and
+ * picks the socket of the worker bound to that CPU. The interrupt, the
+ * socket and the request handler then share one core and its caches.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include "serverlist.h"
+#include "server.h"
+
+/**
+ * Convert a mask such as "0101" into a CPU set.
+ * The rightmost character is CPU 0.
+ */
+static void
+maskToCpuSet(const char *mask, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	int len = strlen(mask);
+	for (int i = 0; (i < len) && (i < CPU_SETSIZE); i++) {
+		if (mask[len-1-i] == '1') {
+			CPU_SET(i, set);
+		}
+	}
+}
+
+/**
+ * Find the CPUs a worker should run on.
+ * Returns: 1 if the worker should be bound, 0 if there is no affinity
+ */
+static int
+getWorkerCpus(int worker, cpu_set_t *set)
+{
+	_cpu_mask *m = getCpuMaskList();
+	if (isCpuAffinityAuto()) {
+		cpu_set_t avail;
+		if (m) {
+			maskToCpuSet(m->mask, &avail);
+		} else if (sched_getaffinity(0, sizeof(avail), &avail) == -1) {
+			return 0;
+		}
+		int count = CPU_COUNT(&avail);
+		if (count == 0) {
+			return 0;
+		}
+		int n = worker % count;
+		CPU_ZERO(set);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &avail) && (n-- == 0)) {
+				CPU_SET(cpu, set);
+				return 1;
+			}
+		}
+		return 0;
+	}
+	if (!m) {
+		return 0;
+	}
+	// with fewer masks than workers the last mask is reused
+	for (int i = 0; (i < worker) && m->next; i++) {
+		m = m->next;
+	}
+	maskToCpuSet(m->mask, set);
+	return (CPU_COUNT(set) > 0) ? 1 : 0;
+}
+
+/**
+ * Bind the calling worker process to its CPU(s).
+ */
+void
+setWorkerCpuAffinity(int worker)
+{
+	cpu_set_t set;
+	if (!getWorkerCpus(worker, &set)) {
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		fprintf(stderr, "Can't set the CPU affinity of worker %d: %m\n", worker);
+		return;
+	}
+	if (isDebug()) {
+		fprintf(stderr, "Worker %d bound to %d CPU(s)\n", worker, CPU_COUNT(&set));
+	}
+}
+
+/**
+ * Attach a program to the SO_REUSEPORT group of a listening socket which
+ * maps the CPU receiving a connection to the index of the worker bound
+ * to that CPU. The program is a list of compare-and-return instructions,
+ * one pair per CPU that has a worker. CPUs without a worker fall through
+ * to a modulo which spreads them evenly.
+ *
+ * Attaching again replaces the program, which is done on a reload.
+ */
+void
+steerConnectionsToWorkerCpus(int sockFd, int workers)
+{
+	if ((workers < 2) || (!isCpuAffinityAuto() && !getCpuMaskList())) {
+#ifdef SO_DETACH_REUSEPORT_BPF
+		// a reload may have turned the affinity off
+		setsockopt(sockFd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, NULL, 0);
+#endif
+		return;
+	}
+	int cpus = sysconf(_SC_NPROCESSORS_CONF);
+	if ((cpus < 1) || (cpus > CPU_SETSIZE)) {
+		cpus = CPU_SETSIZE;
+	}
+	cpu_set_t *sets = (cpu_set_t *)calloc(workers, sizeof(cpu_set_t));
+	for (int w = 0; w < workers; w++) {
+		if (!getWorkerCpus(w, &sets[w])) {
+			CPU_ZERO(&sets[w]);
+		}
+	}
+	struct sock_filter *code = (struct sock_filter *)calloc(2*cpus + 3, sizeof(struct sock_filter));
+	int n = 0;
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (int cpu = 0; cpu < cpus; cpu++) {
+		// if several workers share this CPU, spread by CPU number
+		int matches = 0;
+		for (int w = 0; w < workers; w++) {
+			if (CPU_ISSET(cpu, &sets[w])) {
+				matches++;
+			}
+		}
+		if (matches == 0) {
+			continue;
+		}
+		int pick = cpu % matches;
+		int target = 0;
+		for (int w = 0; w < workers; w++) {
+			if (CPU_ISSET(cpu, &sets[w]) && (pick-- == 0)) {
+				target = w;
+				break;
+			}
+		}
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, target);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	struct sock_fprog prog;
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(sockFd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog))) {
+		fprintf(stderr, "Could not attach the CPU steering program to socket %d: %m\n", sockFd);
+	} else if (isDebug()) {
+		fprintf(stderr, "Steering connections on socket %d to %d workers by CPU\n", sockFd, workers);
+	}
+	free(code);
+	free(sets);
+}
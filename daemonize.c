@@ -28,7 +28,8 @@ daemonize()
 {
 	// TODO: implement new-style Linux daemon that works with systemd.
 	// This implementation is old-style SystemV/BSD.
-	if (!isForeground()) {
+	// A new master started by a binary upgrade already runs as a daemon.
+	if (!isForeground() && (getenv(LISTEN_FDS_ENV) == NULL)) {
 		// create background process
 		pid_t pid = fork();
 		if (pid == -1) {
@@ -88,6 +89,14 @@ daemonize()
 	fprintf(fp, "%d\n", getpid() );
 	fclose(fp);
 
-	// close stdin
-	close(0);
+	// Point stdin at /dev/null rather than closing it, otherwise the
+	// next socket gets descriptor 0. A new master from an upgrade has
+	// this done already, and may have inherited a socket as descriptor 0.
+	if (getenv(LISTEN_FDS_ENV) == NULL) {
+		int fd = open("/dev/null", O_RDONLY);
+		if (fd > 0) {
+			dup2(fd, 0);
+			close(fd);
+		}
+	}
 }
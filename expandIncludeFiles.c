@@ -1,5 +1,16 @@
 /**
- * Recursively expand any `include` files in the config file.
+ * Expand the `include` directives of the config file.
+ *
+ * The scanner reads the included files in place: for each `include` it
+ * pushes a buffer for the file on flex's buffer stack, and goes back to
+ * the including file at the end of it. Nothing is copied, the files are
+ * only read by the scanner.
+ *
+ * The file may be a glob pattern, such as all the `.conf` files of a
+ * directory. The matching files are included in alphabetical order, and
+ * opened one at a time, so including thousands of them doesn't need as
+ * many descriptors.
+ * A relative path is relative to the directory of the main config file.
  *
  * (c) Tom Lang 8/2023
  */
@@ -9,85 +20,33 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <netdb.h>
+#include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "serverlist.h"
 #include "server.h"
 
-void
-expandFile(FILE *in, FILE *out) {
-	char str[] = "include";
-	char *s = (char *)&str;
-	int slen = strlen(s);
-	int read;
-	size_t len = 0;
-	char *line;
-	// Copy the config to a temp file, checking each line
-	// for an `include` directive.
-	while ((read = (int)getline(&line, &len, in)) != -1) {
-		char *p = line;
-		while((*p == ' ') || (*p == '\t')) {
-			p++;
-		}
-		if (strncmp(p, s, slen) == 0) {
-			char *file = p+slen;
-			while((*file == ' ') || (*file == '\t')) {
-				file++;
-			}
-			p = strchr(file, ';');
-			char *path;
-			if (p == NULL) {
-				fprintf(stderr, "Invalid 'include' directive, missing semicolon, ignored.\n");
-			} else {
-				*p = '\0';
-				// if the file an absolute path?
-				if (file[0] == '/') {
-					path = (char *)malloc(strlen(file)+1);
-					strcpy(path, file);
-				} else {
-					const char *dir = getConfigDir();
-					path = (char *)malloc(strlen(dir)+strlen(file)+1);
-					strcpy(path, dir);
-					strcat(path, file);
-				}
-				FILE *fd = fopen(path, "r");
-				if (fd != NULL) {
-					if (isDebug()) {
-						fprintf(stderr, "Including file %s\n", path);
-					}
-					expandFile(fd, out);
-					fclose(fd);
-				} else {
-					fprintf(stderr, "Invalid include file path %s, ignored\n", path);
-				}
-				free(path);
-			}
-		} else {
-			fputs(line, out);
-		}
-	}
-	if (line) {
-		free(line);
-	}
-}
+extern int yylineno;
+
+// an `include` being read, the innermost one is at the top
+typedef struct _include {
+	struct _include *prev;
+	glob_t files;
+	size_t next;		// the file after the one being read
+	FILE *in;
+	int lineno;			// of the `include` in the including file
+} _include;
+
+static _include *includes = NULL;
+static int fileCount = 0;
 
 /**
- * Recursively expand include files. Returns the file descriptor
- * of the original conf file if no includes are found, or returns
- * the file descriptor of temp file containing all the expanded
- * content.
+ * Open the main config file
+ * Returns: the open file, the process exits on error
  */
-
 FILE *
-expandIncludeFiles(char *tempFile) {
-	FILE *tempFd = fopen(tempFile, "w");
-	if (tempFd == NULL) {
-		int e = errno;
-		fprintf(stderr, "Cannot create temporary file.\n%s: file open failed: %s\nExiting.\n", tempFile, strerror(e));
-		exit(1);
-	}
+openConfigFile()
+{
 	const char *file = getConfigFile();
 	FILE *fd = fopen(file, "r");
 	if (fd == NULL) {
@@ -95,8 +54,106 @@ expandIncludeFiles(char *tempFile) {
 		fprintf(stderr, "Cannot process the configuration.\n%s: file open failed: %s\nExiting.\n", file, strerror(e));
 		exit(1);
 	}
-	expandFile(fd, tempFd);
-	fclose(fd);
-	fclose(tempFd);
-	return fopen(tempFile, "r");
+	includes = NULL;
+	fileCount = 1;
+	return fd;
+}
+
+/**
+ * Start reading the next file of an `include`
+ * Returns: false if there are no more
+ */
+static bool
+openNextFile(_include *inc)
+{
+	while (inc->next < inc->files.gl_pathc) {
+		const char *path = inc->files.gl_pathv[inc->next++];
+		inc->in = fopen(path, "r");
+		if (inc->in != NULL) {
+			if (isDebug()) {
+				fprintf(stderr, "Including file %s\n", path);
+			}
+			fileCount++;
+			pushConfigBuffer(inc->in);
+			yylineno = 1;
+			return true;
+		}
+		fprintf(stderr, "Invalid include file path %s, ignored\n", path);
+	}
+	return false;
+}
+
+/**
+ * Include the files matching a path or pattern. Called by the scanner.
+ */
+void
+includeFiles(const char *pattern)
+{
+	char *path;
+	if (pattern[0] == '/') {
+		path = strdup(pattern);
+	} else {
+		const char *dir = getConfigDir();
+		path = (char *)malloc(strlen(dir)+strlen(pattern)+1);
+		strcpy(path, dir);
+		strcat(path, pattern);
+	}
+	_include *inc = (_include *)calloc(1, sizeof(_include));
+	int ret = glob(path, 0, NULL, &inc->files);
+	if ((ret == GLOB_NOMATCH) && !strpbrk(path, "*?[")) {
+		fprintf(stderr, "Invalid include file path %s, ignored\n", path);
+	} else if ((ret != 0) && (ret != GLOB_NOMATCH)) {
+		fprintf(stderr, "%s: include failed, ignored\n", path);
+	}
+	free(path);
+	inc->lineno = yylineno;
+	inc->prev = includes;
+	includes = inc;
+	if (!openNextFile(inc)) {
+		includes = inc->prev;
+		globfree(&inc->files);
+		free(inc);
+	}
+}
+
+/**
+ * Called by the scanner at the end of a file. The next file of the same
+ * `include` is read, or the scanner goes back to the including file.
+ * Returns: false at the end of the main config file
+ */
+bool
+endOfConfigFile()
+{
+	_include *inc = includes;
+	if (inc == NULL) {
+		return false;
+	}
+	fclose(inc->in);
+	popConfigBuffer();
+	if (openNextFile(inc)) {
+		return true;
+	}
+	yylineno = inc->lineno;
+	includes = inc->prev;
+	globfree(&inc->files);
+	free(inc);
+	return true;
+}
+
+/**
+ * The name of the file being read, for error messages
+ */
+const char *
+currentConfigFile()
+{
+	return includes ? includes->files.gl_pathv[includes->next-1] : getConfigFile();
+}
+
+/**
+ * Returns: the number of files read, the main config file included
+ */
+int
+getConfigFileCount()
+{
+	return fileCount;
 }
@@ -5,6 +5,9 @@
  * - If no match, use the default doc root for the `server` block.
  * - If no default for the server, use the fallback default.
  *
+ * The locations are the server's index in the config snapshot, with the
+ * regexes already compiled (see configSnapshot.c).
+ *
  * (c) 2023 Tom Lang
  */
 #include <stdlib.h>
@@ -18,62 +21,25 @@
 #include "serverlist.h"
 #include "server.h"
 
-int regexMatch(char *, char *);
-
 _location *
 getDocRoot(_server *server, char *path)
 {
-	_location *loc = server->locations;
-	while (loc != NULL) {
-		if ((loc->matchType == REGEX_MATCH)
-				&& (regexMatch(loc->match, path))) {
-			return loc;
-		} else if ((loc->matchType == PREFIX_MATCH)
-				&& (strncmp(path, loc->match, strlen(loc->match)) == 0)) {
-			return loc;
-		} else if ((loc->matchType == EQUAL_MATCH)
-				&& (strlen(path) == strlen(loc->match))
-				&& (strcmp(path, loc->match) == 0)) {
-			return loc;
+	const _server_index *si = server->index;
+	size_t pathLen = strlen(path);
+	for (int i = 0; i < si->locationCount; i++) {
+		const _location_entry *e = &si->locations[i];
+		if ((e->matchType == REGEX_MATCH)
+				&& (regexec(e->regex, path, 0, NULL, 0) == 0)) {
+			return e->loc;
+		} else if ((e->matchType == PREFIX_MATCH)
+				&& (pathLen >= (size_t)e->matchLen)
+				&& (memcmp(path, e->match, e->matchLen) == 0)) {
+			return e->loc;
+		} else if ((e->matchType == EQUAL_MATCH)
+				&& (pathLen == (size_t)e->matchLen)
+				&& (memcmp(path, e->match, pathLen) == 0)) {
+			return e->loc;
 		}
-		loc = loc->next;
 	}
 	return NULL;
 }
-
-/**
- * regular expression matching
- */
-int
-regexMatch(char *pattern, char *location)
-{
-	regex_t regex;
-	int ret;
-	char msgbuf[100];
-
-	/* Compile regular expression */
-	ret = regcomp(&regex, pattern, 0);
-	if (ret) {
-		doDebug("Could not compile regex\n");
-		return 0;
-	}
-
-	/* Execute regular expression */
-	ret = regexec(&regex, location, 0, NULL, 0);
-	if (!ret) {
-		regfree(&regex);
-		return 1;
-	}
-	else if (ret == REG_NOMATCH) {
-		regfree(&regex);
-		return 0;
-	}
-	else {
-		if (isDebug()) {
-			regerror(ret, &regex, msgbuf, sizeof(msgbuf));
-			fprintf(stderr, "Regex match failed: %s\n", msgbuf);
-		}
-		regfree(&regex);
-	}
-	return 0;
-}
@@ -3,6 +3,8 @@
  * Option: RESPONSE_FORMAT = response header format
  *         LOG_FILE_FORMAT = log file name format
  *         LOG_RECORD_FORMAT = log file record format
+ *         LOG_LOCAL_FORMAT = $time_local
+ *         LOG_ISO8601_FORMAT = $time_iso8601
  *
  * (c) Tom Lang 2/2023
  */
@@ -12,32 +14,85 @@
 #include "serverlist.h"
 #include "server.h"
 
-void
-getTimestamp(char *buf, int opt)
+#define TIMESTAMP_FORMATS 5
+
+/*
+ * The formatted timestamps are cached per thread and only formatted again
+ * when the second changes, so localtime() and strftime() run once a second
+ * instead of for every response and log record.
+ */
+static __thread time_t cachedSecond = -1;
+static __thread char cached[TIMESTAMP_FORMATS][TIME_BUF];
+
+static void
+updateTimestamps(time_t now)
 {
-	time_t rawtime = time(NULL);
-	if (rawtime == -1) {
-		doDebug("The time() function failed\n");
-		return;
-	}
-	struct tm *ptm = localtime(&rawtime);
-	if (ptm == NULL) {
+	struct tm local;
+	struct tm gmt;
+	if ((localtime_r(&now, &local) == NULL) || (gmtime_r(&now, &gmt) == NULL)) {
 		doDebug("The localtime() function failed\n");
 		return;
 	}
-	memset(buf, 0, TIME_BUF);
-	if (opt == RESPONSE_FORMAT) {
-		strftime(buf, TIME_BUF, "%a, %d %b %Y %T %Z", ptm);
-	}
-	else if (opt == LOG_FILE_FORMAT) {
-		strftime(buf, TIME_BUF, "%Y%m%d", ptm);
-	}
-	else if (opt == LOG_RECORD_FORMAT) {
-		strftime(buf, TIME_BUF, "%Y%m%d %H:%M:%S ", ptm);
-	}
-	else {
+	// RFC 7231 wants the Date header in GMT
+	strftime(cached[RESPONSE_FORMAT], TIME_BUF, "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+	strftime(cached[LOG_FILE_FORMAT], TIME_BUF, "%Y%m%d", &local);
+	strftime(cached[LOG_RECORD_FORMAT], TIME_BUF, "%Y%m%d %H:%M:%S ", &local);
+	strftime(cached[LOG_LOCAL_FORMAT], TIME_BUF, "%d/%b/%Y:%H:%M:%S %z", &local);
+	strftime(cached[LOG_ISO8601_FORMAT], TIME_BUF, "%Y-%m-%dT%H:%M:%S%z", &local);
+	cachedSecond = now;
+}
+
+const char *
+getTimestamp(int opt)
+{
+	if ((opt < 0) || (opt >= TIMESTAMP_FORMATS)) {
 		doDebug("Unrecognized log record format");
 		exit(1);
 	}
-	return;
+	time_t now = time(NULL);
+	if (now == -1) {
+		doDebug("The time() function failed\n");
+	} else if (now != cachedSecond) {
+		updateTimestamps(now);
+	}
+	return cached[opt];
+}
+
+/*
+ * Dates for the Expires and Last-Modified headers. A few recent ones are
+ * kept per thread, most responses use the same handful of dates.
+ */
+#define HTTP_DATES 16
+static __thread struct {
+	time_t t;
+	char date[32];
+} httpDates[HTTP_DATES];
+
+/**
+ * Format a time as an HTTP date, which is always GMT
+ * Returns: the date, valid until the next call
+ */
+const char *
+getHttpDate(time_t t)
+{
+	int slot = (unsigned long)t % HTTP_DATES;
+	if ((httpDates[slot].t != t) || (httpDates[slot].date[0] == '\0')) {
+		struct tm tm;
+		gmtime_r(&t, &tm);
+		strftime(httpDates[slot].date, sizeof(httpDates[slot].date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		httpDates[slot].t = t;
+	}
+	return httpDates[slot].date;
+}
+
+/**
+ * Elapsed time on the monotonic clock
+ * Returns: microseconds since the given time
+ */
+long
+microsSince(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000;
 }
@@ -0,0 +1,531 @@
+/**
+ * Compress responses with gzip while they are sent, the `gzip` directive.
+ *
+ * Static files of the types in `gzip_types` are compressed once and the
+ * result kept in memory, keyed by the file's inode, size and modification
+ * time, so a popular file costs no compression after the first request.
+ * Files too big for the cache, directory listings and the responses from
+ * upstream servers are compressed as a stream, a buffer at a time. A
+ * streamed response has no Content-Length and ends when the connection is
+ * closed, or with the last chunk when it is sent with chunked encoding.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "serverlist.h"
+#include "server.h"
+
+#define GZIP_CACHE_BUCKETS 256
+// bigger files are compressed for each request, without being cached
+#define GZIP_CACHE_MAX_FILE (1024*1024)
+// size of the buffer compressed output is sent from
+#define GZIP_CHUNK (16*1024)
+// windowBits for a gzip header and trailer rather than zlib's
+#define GZIP_WINDOW (15 + 16)
+
+struct _gzip_stream {
+	z_stream zs;
+	_request *req;
+	size_t out;		// compressed bytes sent
+	bool chunked;	// sent with chunked transfer encoding
+	bool failed;
+	unsigned char buf[GZIP_CHUNK];
+};
+
+typedef struct _gzip_entry {
+	struct _gzip_entry *next;	// in the hash chain
+	struct _gzip_entry *newer;	// least recently used order
+	struct _gzip_entry *older;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	char *body;
+	size_t len;
+	int refs;			// requests sending the body
+	bool evicted;		// freed when the last request is done with it
+} _gzip_entry;
+
+// the TLS server runs a thread for each connection, they share the cache
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static _gzip_entry *buckets[GZIP_CACHE_BUCKETS];
+static _gzip_entry *newest = NULL;
+static _gzip_entry *oldest = NULL;
+static size_t cached = 0;
+
+/**
+ * Check if the client accepts a gzip response, and `gzip` is on
+ */
+bool
+acceptsGzip(_request *req)
+{
+	return isGzip() && acceptsEncoding(req, "gzip");
+}
+
+/**
+ * Check a mime type against `gzip_types`. text/html is always compressed.
+ * Parameters such as `; charset=utf-8` are ignored.
+ */
+bool
+isGzipType(const char *type, int len)
+{
+	if (type == NULL) {
+		return false;
+	}
+	const char *end = memchr(type, ';', len);
+	if (end) {
+		len = end - type;
+	}
+	while ((len > 0) && (type[len-1] == ' ')) {
+		len--;
+	}
+	if ((len == 9) && (strncasecmp(type, "text/html", 9) == 0)) {
+		return true;
+	}
+	for (_gzip_type *t = getGzipTypeList(); t != NULL; t = t->next) {
+		if ((strcmp(t->type, "*") == 0)
+			|| (((int)strlen(t->type) == len) && (strncasecmp(t->type, type, len) == 0))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Check if a file is compressed, by the mime type of its extension
+ */
+static bool
+isGzipFile(const char *name)
+{
+	_mimeTypes *mt = getMimeTypeEntry(name);
+	if (mt) {
+		return mt->gzip;
+	}
+	const char *type = getDefaultType();
+	return type && isGzipType(type, strlen(type));
+}
+
+/**
+ * Compress a buffer in one go
+ * Returns: the compressed data, which the caller frees, NULL on failure
+ */
+char *
+gzipBuffer(const char *data, size_t len, size_t *outLen)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, getGzipCompLevel(), Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	size_t bound = deflateBound(&zs, len);
+	char *out = malloc(bound);
+	zs.next_in = (unsigned char *)data;
+	zs.avail_in = len;
+	zs.next_out = (unsigned char *)out;
+	zs.avail_out = bound;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+	*outLen = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+/**
+ * Start compressing a response body to the client. The headers have
+ * been sent, with `Transfer-Encoding: chunked` when chunked is true.
+ */
+_gzip_stream *
+startGzipStream(_request *req, bool chunked)
+{
+	_gzip_stream *gz = (_gzip_stream *)calloc(1, sizeof(_gzip_stream));
+	gz->req = req;
+	gz->chunked = chunked;
+	if (deflateInit2(&gz->zs, getGzipCompLevel(), Z_DEFLATED, GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		gz->failed = true;
+	}
+	return gz;
+}
+
+static void
+deflateToClient(_gzip_stream *gz, int flush)
+{
+	int rc;
+	do {
+		gz->zs.next_out = gz->buf;
+		gz->zs.avail_out = GZIP_CHUNK;
+		rc = deflate(&gz->zs, flush);
+		size_t n = GZIP_CHUNK - gz->zs.avail_out;
+		if (n > 0) {
+			if (sendChunk(gz->req, (char *)gz->buf, n, gz->chunked) < 0) {
+				gz->failed = true;
+				return;
+			}
+			gz->out += n;
+		}
+	} while ((gz->zs.avail_out == 0) && (rc == Z_OK));
+}
+
+/**
+ * Compress part of the body and send what is ready
+ */
+void
+gzipStreamWrite(_gzip_stream *gz, const char *data, size_t len)
+{
+	if (gz->failed || (len == 0)) {
+		return;
+	}
+	gz->zs.next_in = (unsigned char *)data;
+	gz->zs.avail_in = len;
+	deflateToClient(gz, Z_NO_FLUSH);
+}
+
+/**
+ * Send the end of the compressed body
+ * Returns: the number of compressed bytes sent
+ */
+size_t
+finishGzipStream(_gzip_stream *gz)
+{
+	if (!gz->failed) {
+		gz->zs.next_in = NULL;
+		gz->zs.avail_in = 0;
+		deflateToClient(gz, Z_FINISH);
+		if (gz->chunked) {
+			sendChunk(gz->req, NULL, 0, true);
+		}
+	}
+	deflateEnd(&gz->zs);
+	size_t out = gz->out;
+	free(gz);
+	return out;
+}
+
+////////////////////////////////////////
+// The cache of compressed static files
+
+static unsigned
+bucketFor(dev_t dev, ino_t ino)
+{
+	return ((unsigned long)ino * 31 + (unsigned long)dev) % GZIP_CACHE_BUCKETS;
+}
+
+/**
+ * Take an entry out of the cache. It is freed now, or when the last
+ * request using it releases it. Called with the lock held.
+ */
+static void
+evictEntry(_gzip_entry *e)
+{
+	_gzip_entry **p = &buckets[bucketFor(e->dev, e->ino)];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+	if (e->newer) {
+		e->newer->older = e->older;
+	} else {
+		newest = e->older;
+	}
+	if (e->older) {
+		e->older->newer = e->newer;
+	} else {
+		oldest = e->newer;
+	}
+	cached -= e->len;
+	if (e->refs == 0) {
+		free(e->body);
+		free(e);
+	} else {
+		e->evicted = true;
+	}
+}
+
+static void
+releaseEntry(_gzip_entry *e)
+{
+	pthread_mutex_lock(&cacheLock);
+	if ((--e->refs == 0) && e->evicted) {
+		free(e->body);
+		free(e);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+/**
+ * Find the compressed copy of the file being served. A stale copy, of
+ * an older version of the file, is dropped. Called with the lock held.
+ */
+static _gzip_entry *
+findEntry(const struct stat *st)
+{
+	for (_gzip_entry *e = buckets[bucketFor(st->st_dev, st->st_ino)]; e != NULL; e = e->next) {
+		if ((e->dev != st->st_dev) || (e->ino != st->st_ino)) {
+			continue;
+		}
+		if ((e->size != st->st_size) || (e->mtime != st->st_mtime)) {
+			evictEntry(e);
+			return NULL;
+		}
+		// move to the front
+		if (e != newest) {
+			e->newer->older = e->older;
+			if (e->older) {
+				e->older->newer = e->newer;
+			} else {
+				oldest = e->newer;
+			}
+			e->older = newest;
+			e->newer = NULL;
+			newest->newer = e;
+			newest = e;
+		}
+		e->refs++;
+		return e;
+	}
+	return NULL;
+}
+
+/**
+ * Read and compress the file being served
+ */
+static _gzip_entry *
+compressFile(_request *req)
+{
+	size_t size = req->st.st_size;
+	char *data = malloc(size ? size : 1);
+	size_t got = 0;
+	while (got < size) {
+		ssize_t n = pread(req->localFd, data + got, size - got, got);
+		if (n <= 0) {
+			free(data);
+			return NULL;
+		}
+		got += n;
+	}
+	_gzip_entry *e = (_gzip_entry *)calloc(1, sizeof(_gzip_entry));
+	e->body = gzipBuffer(data, size, &e->len);
+	free(data);
+	if (e->body == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->dev = req->st.st_dev;
+	e->ino = req->st.st_ino;
+	e->size = req->st.st_size;
+	e->mtime = req->st.st_mtime;
+	e->refs = 1;
+	return e;
+}
+
+/**
+ * Get the compressed copy of the file being served, compressing it if
+ * it isn't cached yet. The caller releases the entry.
+ * Returns: the entry, NULL if the file is too big to cache
+ */
+static _gzip_entry *
+cachedGzip(_request *req)
+{
+	size_t limit = getGzipCacheSize();
+	if ((req->st.st_size > GZIP_CACHE_MAX_FILE) || ((size_t)req->st.st_size > limit)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&cacheLock);
+	_gzip_entry *e = findEntry(&req->st);
+	pthread_mutex_unlock(&cacheLock);
+	if (e) {
+		return e;
+	}
+
+	// compressed without the lock, another thread may do the same file
+	e = compressFile(req);
+	if ((e == NULL) || (e->len > limit)) {
+		if (e) {
+			free(e->body);
+			free(e);
+		}
+		return NULL;
+	}
+	pthread_mutex_lock(&cacheLock);
+	_gzip_entry *other = findEntry(&req->st);
+	if (other) {
+		pthread_mutex_unlock(&cacheLock);
+		free(e->body);
+		free(e);
+		return other;
+	}
+	while (oldest && (cached + e->len > limit)) {
+		evictEntry(oldest);
+	}
+	unsigned b = bucketFor(e->dev, e->ino);
+	e->next = buckets[b];
+	buckets[b] = e;
+	e->older = newest;
+	if (newest) {
+		newest->newer = e;
+	} else {
+		oldest = e;
+	}
+	newest = e;
+	cached += e->len;
+	pthread_mutex_unlock(&cacheLock);
+	return e;
+}
+
+/**
+ * Send the file being served compressed, if the client accepts gzip and
+ * its type is in `gzip_types`. Ranges aren't supported for a compressed
+ * response, the whole file is sent.
+ * Returns: true if a response was sent
+ */
+bool
+sendGzippedFile(_request *req)
+{
+	if ((req->encoding != NULL) || (req->st.st_size < getGzipMinLength())
+			|| !acceptsGzip(req) || !isGzipFile(req->fullPath)) {
+		return false;
+	}
+	req->encoding = "gzip";
+	_response r;
+	startResponse(&r, 200, "OK");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	int len;
+	const char *contentType = getContentTypeHeader(req->fullPath, &len);
+	addHeaderBlock(&r, contentType, len);
+	// the compressed bytes may differ from one compression to the next
+	char etag[64];
+	formatETag(&req->st, etag, sizeof(etag));
+	addHeader(&r, "ETag: W/%s\r\nLast-Modified: %s\r\n", etag, getHttpDate(req->st.st_mtime));
+	addContentEncoding(&r, req);
+	addExpires(&r, req->loc, req->st.st_mtime);
+	bool body = (strcmp(req->verb, "GET") == 0);
+
+	size_t size = 0;
+	_gzip_entry *e = cachedGzip(req);
+	if (e) {
+		addHeader(&r, "Content-Length: %zu\r\n", e->len);
+		if (body) {
+			setResponseBody(&r, e->body, e->len);
+		}
+		sendResponse(req, &r, false);
+		size = e->len;
+		releaseEntry(e);
+	} else {
+		addHeader(&r, "Connection: close\r\n");
+		if ((sendResponse(req, &r, body) >= 0) && body) {
+			_gzip_stream *gz = startGzipStream(req, false);
+			char *buf = malloc(GZIP_CHUNK * 4);
+			off_t offset = 0;
+			ssize_t n;
+			while ((n = pread(req->localFd, buf, GZIP_CHUNK * 4, offset)) > 0) {
+				gzipStreamWrite(gz, buf, n);
+				offset += n;
+			}
+			free(buf);
+			size = finishGzipStream(gz);
+		}
+	}
+	accessLog(req, 200, size);
+	return true;
+}
+
+/**
+ * Check if a header line has the given name
+ */
+static bool
+headerIs(const char *line, const char *eol, const char *name, const char **value, int *len)
+{
+	int nameLen = strlen(name);
+	if ((eol - line <= nameLen) || (line[nameLen] != ':') || (strncasecmp(line, name, nameLen) != 0)) {
+		return false;
+	}
+	const char *v = line + nameLen + 1;
+	while ((v < eol) && (*v == ' ')) {
+		v++;
+	}
+	*value = v;
+	*len = eol - v;
+	return true;
+}
+
+/**
+ * Look at the first buffer of an upstream response, and if it can be
+ * compressed, send the headers changed for a compressed body and start
+ * compressing the body. The headers must all be in the first buffer,
+ * the status must be 200, the request not a HEAD, and the body must not be
+ * encoded already.
+ * Returns: the stream the rest of the response is written to, NULL if
+ * it is passed on as it is
+ */
+_gzip_stream *
+gzipUpstreamResponse(_request *req, const char *buffer, size_t bytes)
+{
+	// a response to HEAD has no body to compress
+	if (!acceptsGzip(req) || (req->verb && (strcmp(req->verb, "HEAD") == 0))) {
+		return NULL;
+	}
+	const char *end = memmem(buffer, bytes, "\r\n\r\n", 4);
+	const char *sp = memchr(buffer, ' ', bytes);
+	if ((end == NULL) || (sp == NULL) || (atoi(sp + 1) != 200)) {
+		return NULL;
+	}
+	char headers[BUFF_SIZE];
+	const char *line = memmem(buffer, bytes, "\r\n", 2);
+	int len = line - buffer;
+	if (len + 2 > BUFF_SIZE) {
+		return NULL;
+	}
+	memcpy(headers, buffer, len + 2);
+	len += 2;
+	bool compress = false;
+	while (line < end) {
+		line += 2;
+		const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+		const char *v;
+		int vLen;
+		if (headerIs(line, eol, "Content-Encoding", &v, &vLen)
+			|| headerIs(line, eol, "Transfer-Encoding", &v, &vLen)) {
+			return NULL;
+		}
+		if (headerIs(line, eol, "Content-Type", &v, &vLen)) {
+			compress = isGzipType(v, vLen);
+		}
+		if (headerIs(line, eol, "Content-Length", &v, &vLen)) {
+			if (atol(v) < getGzipMinLength()) {
+				return NULL;
+			}
+		} else if (!headerIs(line, eol, "Connection", &v, &vLen)
+			&& !headerIs(line, eol, "Keep-Alive", &v, &vLen)) {
+			if (len + (eol + 2 - line) >= BUFF_SIZE) {
+				return NULL;
+			}
+			memcpy(headers + len, line, eol + 2 - line);
+			len += eol + 2 - line;
+		}
+		line = eol;
+	}
+	const char *added = "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\nConnection: close\r\n\r\n";
+	if (!compress || (len + strlen(added) >= BUFF_SIZE)) {
+		return NULL;
+	}
+	memcpy(headers + len, added, strlen(added));
+	len += strlen(added);
+	if (sendToClient(req, headers, len) < 0) {
+		return NULL;
+	}
+	_gzip_stream *gz = startGzipStream(req, false);
+	gzipStreamWrite(gz, end + 4, buffer + bytes - (end + 4));
+	return gz;
+}
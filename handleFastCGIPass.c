@@ -14,6 +14,7 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <time.h>
 #include "serverlist.h"
 #include "server.h"
 typedef struct _param {
@@ -111,6 +112,8 @@ void
 handleFastCGIPass(_request *req)
 {
 	initParameters(req);
+	struct timespec upstreamStart;
+	clock_gettime(CLOCK_MONOTONIC, &upstreamStart);
 	int upstream = getUpstreamServer(req);
 	if (upstream < 0) {
 		doDebug("upstream failed");
@@ -145,26 +148,38 @@ handleFastCGIPass(_request *req)
 	int startOfResponse = 1;
 	int httpCode = 200;
 	int size = 0;
+	_gzip_stream *gz = NULL;
 	do {
 		bytes = recvData(upstream, buffer, BUFF_SIZE);
 		if (bytes == 0) {
 			break;
 		}
 		size += bytes;
-		sendData(req->clientFd, req->ssl, (char *)&buffer, bytes);
 		if (startOfResponse) {
 			startOfResponse = 0;
 			// extract the HTTP responsse code
-			char *p = (char *)&buffer;
-			p = strchr(p, ' ');
-			char *q = ++p;
-			p = strchr(q, ' ');
-			*p = '\0';
-			httpCode = atoi(q);
+			char *p = memchr(buffer, ' ', bytes);
+			if (p) {
+				httpCode = atoi(p + 1);
+			}
+			// compressed on the way to the client, if it can be
+			gz = gzipUpstreamResponse(req, buffer, bytes);
+			if (gz) {
+				continue;
+			}
+		}
+		if (gz) {
+			gzipStreamWrite(gz, buffer, bytes);
+		} else {
+			sendToClient(req, (char *)&buffer, bytes);
 		}
 	} while(bytes == BUFF_SIZE);
+	if (gz) {
+		size = finishGzipStream(gz);
+	}
 	shutdown(upstream, SHUT_RDWR);
 	close(upstream);
-	accessLog(req->clientFd, req->server, req->verb, httpCode, req->path, size);
+	req->upstreamTime = microsSince(&upstreamStart);
+	accessLog(req, httpCode, size);
 	return;
 }
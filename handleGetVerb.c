@@ -3,6 +3,7 @@
  *
  * (c) Tom Lang 2/2023
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +15,8 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <limits.h>
 #include <openssl/bio.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -27,6 +30,9 @@ handleGetVerb(_request *req)
 	if (req->queryString != NULL) {
 		doDebug("Query string ignored, not yet implemented.");
 	}
+	if (sendCachedFile(req)) {
+		return;
+	}
 	if (pathExists(req, req->path) == -1) {
 		sendErrorResponse(req, 404, "Not Found", req->path);
 		return;
@@ -35,8 +41,8 @@ handleGetVerb(_request *req)
 	// if the path pointing to a directory?
 	if (req->isDir) {
 		// default to the index file if not specified
-		req->localFd = openDefaultIndexFile(req);
-		if (req->localFd == -1) {
+		int fd = openDefaultIndexFile(req);
+		if (fd == -1) {
 			// if the path is a directory, and the index file is not present,
 			// do we want to show a directory listing?
 			if (req->server->autoIndex) {
@@ -45,121 +51,281 @@ handleGetVerb(_request *req)
 				if (isDebug()) {
 					fprintf(stderr, "%s: file open failed: %s\n", req->fullPath, strerror(errno));
 				}
+				close(req->localFd);
 				sendErrorResponse(req, 404, "Not Found", req->path);
 			}
 			return;
 		}
+		close(req->localFd);
+		req->localFd = fd;
 	} else {
-		// not a directory
-		req->localFd = open(req->fullPath, O_RDONLY);
-		if (req->localFd == -1) {
-			if (isDebug()) {
-				fprintf(stderr, "%s: file open failed: %s\n", req->fullPath, strerror(errno));
-			}
-			sendErrorResponse(req, 404, "Not Found", req->path);
-			return;
+		// a compressed copy of the file, if there is one
+		int fd = openPrecompressed(req);
+		if (fd != -1) {
+			close(req->localFd);
+			req->localFd = fd;
 		}
 	}
 
-	serveFile(req);
+	serveFileOrNotModified(req);
 	return;
 }
 
 /**
- * Server a file to a client
+ * The entity tag of a file, made of its modification time, size and inode
  */
 void
-serveFile(_request *req)
+formatETag(const struct stat *st, char *buf, int size)
 {
-	// guess the mime type by the extension, if any
-	char mt[256];
-	char *mimeType = (char *)&mt;
-	getMimeType(req->fullPath, mimeType);
+	snprintf(buf, size, "\"%lx-%lx-%lx\"", (unsigned long)st->st_mtime,
+		(unsigned long)st->st_size, (unsigned long)st->st_ino);
+}
 
-	// get the content length
-	size_t size = lseek(req->localFd, 0, SEEK_END);
-	lseek(req->localFd, 0, SEEK_SET);
+/**
+ * Add the validators for the file, from its stat data
+ */
+void
+addValidators(_response *r, const struct stat *st)
+{
+	char etag[64];
+	formatETag(st, etag, sizeof(etag));
+	addHeader(r, "ETag: %s\r\nLast-Modified: %s\r\n", etag, getHttpDate(st->st_mtime));
+}
+
+/**
+ * Check if an entity tag is in an If-None-Match list. The comparison is
+ * weak, a `W/` prefix is ignored.
+ */
+static bool
+etagMatches(const char *list, int len, const char *etag)
+{
+	const char *end = list + len;
+	int etagLen = strlen(etag);
+	const char *p = list;
+	while (p < end) {
+		while ((p < end) && ((*p == ' ') || (*p == ','))) {
+			p++;
+		}
+		if (p == end) {
+			break;
+		}
+		if (*p == '*') {
+			return true;
+		}
+		if ((end - p > 2) && (strncmp(p, "W/", 2) == 0)) {
+			p += 2;
+		}
+		const char *q = p;
+		while ((q < end) && (*q != ',')) {
+			q++;
+		}
+		int tagLen = q - p;
+		while ((tagLen > 0) && (p[tagLen-1] == ' ')) {
+			tagLen--;
+		}
+		if ((tagLen == etagLen) && (strncmp(p, etag, etagLen) == 0)) {
+			return true;
+		}
+		p = q;
+	}
+	return false;
+}
+
+/**
+ * Evaluate If-None-Match and If-Modified-Since against the file's stat
+ * data. If-None-Match takes precedence, as RFC 7232 requires.
+ * Returns: true if the client's copy is current
+ */
+bool
+notModified(_request *req)
+{
+	int len;
+	const char *v = getRequestHeader(req, "If-None-Match", strlen("If-None-Match"), &len);
+	if (v) {
+		char etag[64];
+		formatETag(&req->st, etag, sizeof(etag));
+		return etagMatches(v, len, etag);
+	}
+	v = getRequestHeader(req, "If-Modified-Since", strlen("If-Modified-Since"), &len);
+	if (v) {
+		char date[64];
+		if (len >= (int)sizeof(date)) {
+			return false;
+		}
+		memcpy(date, v, len);
+		date[len] = '\0';
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+			return false;
+		}
+		return req->st.st_mtime <= timegm(&tm);
+	}
+	return false;
+}
+
+/**
+ * Tell the client its copy of the file is current
+ */
+void
+sendNotModified(_request *req)
+{
+	_response r;
+	startResponse(&r, 304, "Not Modified");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	addValidators(&r, &req->st);
+	addContentEncoding(&r, req);
+	addExpires(&r, req->loc, req->st.st_mtime);
+	sendResponse(req, &r, false);
+	accessLog(req, 304, 0);
+}
+
+/**
+ * Serve the file found for a request, as `req->localFd`, or tell the client
+ * its copy is current. The file is only resolved, with `O_PATH`, so a 304
+ * doesn't cost opening it.
+ */
+void
+serveFileOrNotModified(_request *req)
+{
+	// the file may be an index file, a compressed copy or a try_files target
+	if (fstat(req->localFd, &req->st) == -1) {
+		close(req->localFd);
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		return;
+	}
+	if (notModified(req)) {
+		close(req->localFd);
+		sendNotModified(req);
+		return;
+	}
+	serveFile(req);
+}
 
-	char ts[TIME_BUF];
-	getTimestamp((char *)&ts, RESPONSE_FORMAT);
+/**
+ * Server a file to a client. The file was found with `O_PATH`, and is
+ * opened here to be read.
+ */
+void
+serveFile(_request *req)
+{
+	// nonblocking, so a FIFO put in its place doesn't hang the worker
+	int fd = reopenFile(req->localFd, O_RDONLY | O_NONBLOCK);
+	close(req->localFd);
+	req->localFd = fd;
+	if (fd == -1) {
+		if (isDebug()) {
+			fprintf(stderr, "%s: file open failed: %s\n", req->fullPath, strerror(errno));
+		}
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		return;
+	}
+	if (sendGzippedFile(req)) {
+		close(req->localFd);
+		return;
+	}
+	if (sendRanges(req)) {
+		close(req->localFd);
+		return;
+	}
+	if (cacheAndSendFile(req)) {
+		close(req->localFd);
+		return;
+	}
+	size_t size = req->st.st_size;
 
 	int httpCode = 200;
-	char *responseHeaders = 
-"HTTP/1.1 %d OK\r\n"
-"Server: ogws/%s\r\n"
-"Date: %s\r\n"
-"Content-Type: %s\r\n"
-"Content-Length: %d\r\n\r\n";
-
-	char buffer[BUFF_SIZE];
-	size_t sz = snprintf(buffer, BUFF_SIZE, responseHeaders, httpCode, getVersion(), ts, mimeType, size);
-	size_t sent = sendData(req->clientFd, req->ssl, buffer, sz);
-	if (sent != sz) {
+	_response r;
+	startResponse(&r, httpCode, "OK");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	// guess the mime type by the extension, if any
+	int len;
+	const char *contentType = getContentTypeHeader(req->fullPath, &len);
+	addHeaderBlock(&r, contentType, len);
+	addHeader(&r, "Accept-Ranges: bytes\r\nContent-Length: %zu\r\n", size);
+	addValidators(&r, &req->st);
+	addContentEncoding(&r, req);
+	addExpires(&r, req->loc, req->st.st_mtime);
+
+	// only send the response body if the verb is GET
+	bool body = (strcmp(req->verb, "GET") == 0) && (size > 0);
+	corkClient(req, true);
+	if (sendResponse(req, &r, body) < 0) {
 		doDebug("Problem sending response headers");
+		body = false;
 	}
-	// only send the response body if the verb is GET
-	if (strcmp(req->verb, "GET") == 0) {
-		sendFile(req, size);
-		accessLog(req->clientFd, req->server, "GET", httpCode, req->path, size);
-	} else {
-		accessLog(req->clientFd, req->server, "HEAD", httpCode, req->path, size);
+	if (body) {
+		sendFile(req, 0, size);
 	}
+	corkClient(req, false);
+	accessLog(req, httpCode, size);
 	close(req->localFd);
 	return;
 }
 
 /**
- * Guess the mime type of a file using its extension, if any.
- * Default: html
+ * Find the mime type of a file by its extension, if any.
+ * Returns: the mime type entry, NULL if the extension isn't known
  */
-void
-getMimeType(char *name, char *mimeType)
+_mimeTypes *
+getMimeTypeEntry(const char *name)
 {
-	strcpy(mimeType, getDefaultType());	// default
-	char *p = strrchr(name, '.');
+	const char *p = strrchr(name, '.');
 	if (p != NULL) {
 		p++;
-		struct _mimeTypes *mt = getMimeTypeList();
-		while (mt != NULL) {
+		for (_mimeTypes *mt = getMimeTypeList(); mt != NULL; mt = mt->next) {
 			if (strcmp(p, mt->extension) == 0) {
-				strcpy(mimeType, mt->mimeType);
-				break;
+				return mt;
 			}
-			mt = mt->next;
 		}
 	}
-	return;
+	return NULL;
+}
+
+/**
+ * Guess the mime type of a file using its extension, if any.
+ * Returns: the prebuilt Content-Type header, the default type if the
+ * extension isn't known
+ */
+const char *
+getContentTypeHeader(const char *name, int *len)
+{
+	_mimeTypes *mt = getMimeTypeEntry(name);
+	if (mt != NULL) {
+		*len = mt->headerLen;
+		return mt->header;
+	}
+	return getDefaultTypeHeader(len);
 }
 
 /**
- * Open the default index file for a directory.
+ * Open the default index file for a directory, the open directory is
+ * `req->localFd`.
  * Return the file descriptor on success.
  */
 int
 openDefaultIndexFile(_request *req)
 {
-	char indexPath[300];
-	_index_file *ifn = req->server->indexFiles;
-	while(ifn) {
-		strcpy(indexPath, req->fullPath);
-		if (ifn->indexFile[0] != '/') {
-			strcat(indexPath, "/");
-		}
-		strcat(indexPath, ifn->indexFile);
-		int fd = open(indexPath, O_RDONLY);
+	const _server_index *si = req->server->index;
+	for (int i = 0; i < si->indexFileCount; i++) {
+		const _index_entry *e = &si->indexFiles[i];
+		int fd = openBeneath(req->localFd, e->name, O_PATH);
 		if (fd >= 0) {
 			// update the full path to include the index file
-			strcpy(req->fullPath, indexPath);
+			int len = strlen(req->fullPath);
+			bool slash = (len > 0) && (req->fullPath[len-1] == '/');
+			req->fullPath = realloc(req->fullPath, len + e->len + 2);
+			sprintf(req->fullPath + len, "%s%s", slash ? "" : "/", e->name);
 			return fd;
 		}
-		ifn = ifn->next;
 	}
 	return -1;
 }
 
 /**
- * Check if a path exists.
- * The fullPath parameter is updated.
+ * Check if a path exists, and resolve it with `O_PATH`, the file is only
+ * opened to be read if it is served. The fullPath, localFd and st members
+ * are updated.
  *
  * Note: Even though `request` has a `path` member, the input path may be
  * something different (see `try_files`) so it is passed explicitly.
@@ -167,21 +333,36 @@ openDefaultIndexFile(_request *req)
 int
 pathExists(_request *req, char *path)
 {
-	req->fullPath = (char *)calloc(1, 300);
+	free(req->fullPath);
+	req->fullPath = NULL;
+	req->localFd = -1;
 	req->isDir = 0;
-	strcpy(req->fullPath, req->loc->root);
-	if (path[0] != '/') {
-		strcat(req->fullPath, "/");
+	char rel[PATH_MAX];
+	if (normalizePath(path, rel, PATH_MAX) == -1) {
+		if (isDebug()) {
+			fprintf(stderr, "%s: invalid path\n", path);
+		}
+		return -1;
 	}
-	strcat(req->fullPath, path);
-	struct stat sb;
-	if (stat(req->fullPath, &sb) == -1) {
+	int rootLen = strlen(req->loc->root);
+	req->fullPath = (char *)malloc(rootLen + strlen(rel) + 2);
+	sprintf(req->fullPath, "%s/%s", req->loc->root, rel);
+	int fd = openUnderRoot(req->loc, rel, O_PATH);
+	if ((fd == -1) || (fstat(fd, &req->st) == -1)) {
 		int e = errno;
 		if (isDebug()) {
-			fprintf(stderr, "%s: file stat failed: %s\n", req->fullPath, strerror(e));
+			fprintf(stderr, "%s: file open failed: %s\n", req->fullPath, strerror(e));
+		}
+		if (fd >= 0) {
+			close(fd);
 		}
 		return -1;
 	}
-	req->isDir = (S_ISDIR(sb.st_mode)) ? 1 : 0;
+	if (!S_ISREG(req->st.st_mode) && !S_ISDIR(req->st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	req->isDir = (S_ISDIR(req->st.st_mode)) ? 1 : 0;
+	req->localFd = fd;
 	return 1;
 }
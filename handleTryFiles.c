@@ -1,18 +1,28 @@
 /**
- * Handle a `try_files` directive. We've already serverd the request if
- * there was a matching file or directory, so now check if there is a 
- * fallback file to use.
+ * Handle a `try_files` directive. The targets are tried in order, and
+ * the first that exists is served. The last parameter is the fallback,
+ * used when none of the others exist: a URI, which the request is
+ * redirected to internally, a named location, or `=code`.
  *
  * Example directives:
  * 		location / {
- * 			try_files $uri $uri/ /index.php;
+ * 			try_files $uri $uri/ /index.php?q=$uri&$args;
  * 		}
  *
  * 	In this example, if the file exists, serve it. If the path is a directory
- * 	with an index file, servve that index file. Otherwise send everything
+ * 	with an index file, serve that index file. Otherwise send everything
  * 	to index.php.
  *
- * 	Note: This is the only `try_files` format implemented at this time.
+ * 	The targets are compiled when the config file is loaded, like the
+ * 	`log_format` templates. A target ending with a slash matches only a
+ * 	directory, the others only a regular file. A location that also has
+ * 	`proxy_pass` or `fastcgi_pass` passes the request upstream instead of
+ * 	falling back.
+ *
+ * 	Whether a target exists is remembered for TRY_CACHE_VALID seconds,
+ * 	so the sites that send most requests to the fallback, such as single
+ * 	page applications, don't look for the same missing files on every
+ * 	request. A file created meanwhile may be missed for that long.
  *
  * (c) Tom Lang 8/2023
  */
@@ -23,78 +33,143 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <sys/stat.h>
-#include <openssl/bio.h>
-#include <openssl/err.h>
-#include <openssl/ssl.h>
 #include "serverlist.h"
 #include "server.h"
 
-static char *tryTarget;
+#define TRY_CACHE_SIZE 1024
+// seconds a result is used for
+#define TRY_CACHE_VALID 2
+
+#define TRY_MISSING 0
+#define TRY_FILE 1
+#define TRY_DIR 2
+
+typedef struct {
+	_location *loc;
+	char *path;		// the expanded target
+	time_t checked;
+	int kind;
+} _try_entry;
+
+// shared by the threads of the TLS server
+static pthread_mutex_t tryLock = PTHREAD_MUTEX_INITIALIZER;
+static _try_entry tryCache[TRY_CACHE_SIZE];
+
+static _try_entry *
+entryFor(_location *loc, const char *path)
+{
+	unsigned long h = (unsigned long)loc;
+	for (const char *p = path; *p; p++) {
+		h = h * 31 + (unsigned char)*p;
+	}
+	return &tryCache[h % TRY_CACHE_SIZE];
+}
 
 /**
- * If the requested path is not a file or directory, 
- * serve the default file.
+ * What a target was found to be, recently
+ * Returns: TRY_MISSING, TRY_FILE, TRY_DIR, or -1 if it isn't known
  */
-void
-serveDefaultFile(_request *req)
+static int
+cachedKind(_location *loc, const char *path)
 {
-	if (req->loc->type & TYPE_PROXY_PASS) {
-		handleProxyPass(req);
-		return;
+	int kind = -1;
+	pthread_mutex_lock(&tryLock);
+	_try_entry *e = entryFor(loc, path);
+	if ((e->loc == loc) && e->path && (strcmp(e->path, path) == 0)
+			&& (time(NULL) - e->checked < TRY_CACHE_VALID)) {
+		kind = e->kind;
 	}
-	free(req->path);
-	req->path = (char *)malloc(strlen(tryTarget)+1);
-	strcpy(req->path, tryTarget);
-	free(req->fullPath);
-	if (pathExists(req, tryTarget)) {
-		if (req->isDir) {
-			sendErrorResponse(req, 404, "Not Found", req->path);
-			doDebug("Try target is a directory not a file");
-		} else {
-			req->localFd = open(req->fullPath, O_RDONLY);
-			if (req->localFd == -1) {
-				sendErrorResponse(req, 404, "Not Found", req->path);
-			} else {
-				serveFile(req);
-			}
-		}
-	} else {
-		sendErrorResponse(req, 404, "Not Found", req->path);
+	pthread_mutex_unlock(&tryLock);
+	return kind;
+}
+
+static void
+cacheKind(_location *loc, const char *path, int kind)
+{
+	pthread_mutex_lock(&tryLock);
+	_try_entry *e = entryFor(loc, path);
+	if ((e->path == NULL) || (e->loc != loc) || (strcmp(e->path, path) != 0)) {
+		free(e->path);
+		e->path = strdup(path);
+		e->loc = loc;
 	}
+	e->kind = kind;
+	e->checked = time(NULL);
+	pthread_mutex_unlock(&tryLock);
 }
 
 /**
- * At this time, only a specific format is implemented.
- * 	try_files $uri $uri/ /index_file
+ * Serve a target if it exists
+ * Returns: true if the request was answered
  */
-char *
-checkTryFilesFormat(_location *loc)
+static bool
+tryTarget(_request *req, _try_target *tt)
 {
-	_try_target *tt = loc->tryTarget;
-	if (!tt) {
-		return NULL;
+	char path[PATH_MAX];
+	if (expandVariables(tt->ops, req, path, PATH_MAX) < 0) {
+		return false;
+	}
+	int kind = cachedKind(req->loc, path);
+	if ((kind == TRY_MISSING) || ((kind >= 0) && ((kind == TRY_DIR) != tt->dir))) {
+		return false;
+	}
+	if (pathExists(req, path) == -1) {
+		cacheKind(req->loc, path, TRY_MISSING);
+		return false;
+	}
+	cacheKind(req->loc, path, req->isDir ? TRY_DIR : TRY_FILE);
+	if ((req->isDir != 0) != tt->dir) {
+		close(req->localFd);
+		return false;
 	}
-	if ((strlen(tt->target) != 4)
-		|| (strcmp(tt->target, "$uri") != 0)) {
-		return NULL;
+	if (!req->isDir) {
+		serveFileOrNotModified(req);
+		return true;
 	}
-	tt = tt->next;
-	if (!tt) {
-		return NULL;
+	// a directory, with its index file
+	int fd = openDefaultIndexFile(req);
+	if (fd != -1) {
+		close(req->localFd);
+		req->localFd = fd;
+		serveFileOrNotModified(req);
+		return true;
 	}
-	if ((strlen(tt->target) != 5)
-		|| (strcmp(tt->target, "$uri/") != 0)) {
-		return NULL;
+	// the index file is not present,
+	// do we want to show a directory listing?
+	if (req->server->autoIndex) {
+		showDirectoryListing(req);
+		return true;
+	}
+	close(req->localFd);
+	return false;
+}
+
+/**
+ * Process the request again with another URI, which may have a query
+ * string
+ */
+static void
+internalRedirect(_request *req, const char *uri)
+{
+	const char *q = strchr(uri, '?');
+	free(req->path);
+	req->path = q ? strndup(uri, q - uri) : strdup(uri);
+	if (q) {
+		free(req->queryString);
+		req->queryString = (q[1] != '\0') ? strdup(q + 1) : NULL;
 	}
-	tt = tt->next;
-	if (!tt) {
-		return NULL;
+	req->loc = getDocRoot(req->server, req->path);
+	if (!req->loc || !req->loc->root) {
+		doDebug("No doc root.");
+		sendErrorResponse(req, 500, "Bad configuration", "No doc root");
+		return;
 	}
-	return tt->target;
+	routeRequest(req);
 }
 
 /**
@@ -103,42 +178,34 @@ checkTryFilesFormat(_location *loc)
 void
 handleTryFiles(_request *req)
 {
-	tryTarget = checkTryFilesFormat(req->loc);
-	if (!tryTarget) {
-		fprintf(stderr, "Unrecognized `try_files` format\n");
-		sendErrorResponse(req, 404, "Not Found", req->path);
-	}
-	req->isDir = 0;
-	if (pathExists(req, req->path) == -1) {
-		serveDefaultFile(req);
+	if (++req->redirects > MAX_REDIRECTS) {
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		doDebug("try_files redirection cycle");
 		return;
 	}
-	// file exists and is a plain file
-	if (req->isDir == 0) {
-		req->localFd = open(req->fullPath, O_RDONLY);
-		if (req->localFd == -1) {
-			serveDefaultFile(req);
-		} else {
-			serveFile(req);
+	_try_target *tt = req->loc->tryTarget;
+	for (; tt->next != NULL; tt = tt->next) {
+		if (tryTarget(req, tt)) {
+			return;
 		}
+	}
+
+	// none of them exist, use the fallback
+	if (tt->code) {
+		sendErrorResponse(req, tt->code, "Error", req->path);
+	} else if (req->loc->type & TYPE_PROXY_PASS) {
+		handleProxyPass(req);
+	} else if (req->loc->type & TYPE_FASTCGI_PASS) {
+		handleFastCGIPass(req);
+	} else if (tt->named) {
+		req->loc = tt->named;
+		routeRequest(req);
 	} else {
-		// this is a directory
-		req->localFd = openDefaultIndexFile(req);
-		if (req->localFd == -1) {
-			// the index file is not present,
-			// do we want to show a directory listing?
-			if (req->server->autoIndex) {
-				showDirectoryListing(req);
-			} else {
-				serveDefaultFile(req);
-			}
-		} else {
-			// handle proxy_pass or fastcgi_pass
-			if (req->loc->type & TYPE_PROXY_PASS) {
-				handleProxyPass(req);
-			} else {
-				serveFile(req);
-			}
+		char uri[PATH_MAX];
+		if (expandVariables(tt->ops, req, uri, PATH_MAX) < 0) {
+			sendErrorResponse(req, 414, "URI too long", req->path);
+			return;
 		}
+		internalRedirect(req, uri);
 	}
 }
@@ -0,0 +1,328 @@
+/**
+ * Limit the connections of a client or a server, with `limit_conn_zone`
+ * and `limit_conn`.
+ *
+ * Example directives:
+ * 		limit_conn_zone $binary_remote_addr zone=perip:1m;
+ * 		limit_conn_zone $server_name zone=perserver:64k;
+ * 		server {
+ * 			limit_conn perip 10;
+ * 			limit_conn perserver 1000;
+ * 		}
+ *
+ * 	The limits are checked when a connection is accepted, before the TLS
+ * 	handshake or the thread of a TLS connection, and a connection over a
+ * 	limit is closed right away. So the key may only use the variables
+ * 	known then: $remote_addr, $binary_remote_addr and $server_name, which
+ * 	is the server the connection was accepted for.
+ *
+ * 	Each zone is a block of shared memory, mapped by the master, with an
+ * 	open addressing table of counters. A counter is a 64 bit word holding
+ * 	a hash of the key and the number of connections. A key is looked up
+ * 	and added with the zone's lock held, so it never gets two counters,
+ * 	and a closed connection is uncounted with an atomic decrement, without
+ * 	the lock. A counter down to 0 may be taken by another key. Keys with
+ * 	the same hash share a counter.
+ *
+ * 	Each worker also records the counters it holds in a table shared with
+ * 	the master. When a worker dies without closing its connections, the
+ * 	master gives its counts back, otherwise they would be lost for good,
+ * 	since the zones outlive the workers.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+#define CONN_KEY_SIZE 256
+// the counters looked at for a key
+#define CONN_PROBES 16
+
+#define TAG(w) ((uint32_t)((w) >> 32))
+#define COUNT(w) ((uint32_t)(w))
+#define WORD(tag, count) (((uint64_t)(tag) << 32) | (count))
+
+// a hold table entry, the zone and its counter. Ids start at 1, so 0 is
+// a free entry.
+#define ENTRY(id, slot) (((uint64_t)(id) << 32) | (uint32_t)(slot))
+#define ENTRY_ZONE(e) ((uint32_t)((e) >> 32))
+#define ENTRY_SLOT(e) ((uint32_t)(e))
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t id;		// names the zone in the hold tables
+	size_t slotCount;
+	_Atomic uint64_t slots[];
+} _conn_shm;
+
+typedef struct {
+	size_t mapSize;
+	size_t size;
+	_Atomic uint64_t entries[];
+} _hold_table;
+
+// the ids of the zones mapped by the master
+static uint32_t nextZoneId = 1;
+// the counters held by this worker
+static _hold_table *holdTable = NULL;
+
+/**
+ * Map the memory of a `limit_conn_zone`
+ */
+void *
+createConnShm(_limit_zone *zone)
+{
+	if (zone->size < sizeof(_conn_shm) + CONN_PROBES * sizeof(uint64_t)) {
+		fprintf(stderr, "%s: ", zone->name);
+		errorExit("limit_conn_zone is too small\n");
+	}
+	_conn_shm *shm = mmap(NULL, zone->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "%s: ", zone->name);
+		errorExit("can't map the limit_conn_zone memory\n");
+	}
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	// a worker killed while it holds the lock must not stop the others
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	shm->id = nextZoneId++;
+	// the mapping is zeroed, all the counters are free
+	shm->slotCount = (zone->size - sizeof(_conn_shm)) / sizeof(uint64_t);
+	return shm;
+}
+
+static int
+listLength(_limit_conn *list)
+{
+	int n = 0;
+	for (_limit_conn *lc = list; lc != NULL; lc = lc->next) {
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Map the hold table of a worker about to be started, in the master.
+ * A connection holds a counter for each `limit_conn` of its server, and a
+ * worker has up to `worker_connections` of them, a few more while it
+ * drains its listen queue.
+ * Returns: NULL if no server limits its connections
+ */
+void *
+createHoldTable()
+{
+	int longest = listLength(getLimitConnList());
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		int n = listLength(s->limitConns);
+		if (n > longest) {
+			longest = n;
+		}
+	}
+	if (longest == 0) {
+		return NULL;
+	}
+	size_t size = (size_t)(getWorkerConnections() + 64) * longest;
+	size_t mapSize = sizeof(_hold_table) + size * sizeof(uint64_t);
+	_hold_table *table = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		perror("Can't map the limit_conn hold table");
+		return NULL;
+	}
+	table->mapSize = mapSize;
+	table->size = size;
+	return table;
+}
+
+/**
+ * The hold table of this worker
+ */
+void
+setHoldTable(void *table)
+{
+	holdTable = table;
+}
+
+/**
+ * Give back the counters still held by a worker that has exited, and
+ * unmap its table. Called by the master.
+ */
+void
+releaseHoldTable(void *param)
+{
+	_hold_table *table = param;
+	if (table == NULL) {
+		return;
+	}
+	int released = 0;
+	for (size_t i = 0; i < table->size; i++) {
+		uint64_t e = atomic_load(&table->entries[i]);
+		if (e == 0) {
+			continue;
+		}
+		// a zone dropped by a reload is gone, with its counts
+		for (_limit_zone *zone = getLimitZoneList(); zone != NULL; zone = zone->next) {
+			_conn_shm *shm = zone->shm;
+			if ((zone->type != LIMIT_ZONE_CONN) || (shm == NULL) || (shm->id != ENTRY_ZONE(e))) {
+				continue;
+			}
+			_Atomic uint64_t *counter = &shm->slots[ENTRY_SLOT(e)];
+			uint64_t w = atomic_load(counter);
+			while ((COUNT(w) > 0) && !atomic_compare_exchange_weak(counter, &w, w - 1)) {
+				;
+			}
+			released++;
+			break;
+		}
+	}
+	if (released && isDebug()) {
+		fprintf(stderr, "Released %d limit_conn count(s) of a dead worker\n", released);
+	}
+	munmap(table, table->mapSize);
+}
+
+/**
+ * Record a counter held by this worker
+ * Returns: the entry, -1 if the table is full and it isn't recorded
+ */
+static int
+recordHold(_conn_shm *shm, int slot)
+{
+	if (holdTable == NULL) {
+		return -1;
+	}
+	uint64_t e = ENTRY(shm->id, slot);
+	for (size_t i = 0; i < holdTable->size; i++) {
+		uint64_t free = 0;
+		if (atomic_compare_exchange_strong(&holdTable->entries[i], &free, e)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+lockConnShm(_conn_shm *shm)
+{
+	if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+		// a worker died holding the lock, the counters are consistent
+		pthread_mutex_consistent(&shm->lock);
+	}
+}
+
+/**
+ * Count a connection for a key
+ * Returns: the counter, or -1 if the key is at its limit or the zone is full
+ */
+static int
+acquire(_conn_shm *shm, uint32_t tag, int limit)
+{
+	size_t home = tag % shm->slotCount;
+	int slot = -1;
+	int freeSlot = -1;
+	lockConnShm(shm);
+	for (int i = 0; i < CONN_PROBES; i++) {
+		int s = (home + i) % shm->slotCount;
+		uint64_t w = atomic_load(&shm->slots[s]);
+		if ((TAG(w) == tag) && (COUNT(w) > 0)) {
+			slot = s;
+			break;
+		}
+		if ((COUNT(w) == 0) && (freeSlot < 0)) {
+			freeSlot = s;
+		}
+	}
+	if (slot >= 0) {
+		// without the lock the count can only go down, and a counter
+		// released to 0 meanwhile still has the key's tag
+		if (COUNT(atomic_load(&shm->slots[slot])) >= (uint32_t)limit) {
+			slot = -1;
+		} else {
+			atomic_fetch_add(&shm->slots[slot], 1);
+		}
+	} else if (freeSlot >= 0) {
+		// a free counter isn't changed without the lock
+		atomic_store(&shm->slots[freeSlot], WORD(tag, 1));
+		slot = freeSlot;
+	}
+	pthread_mutex_unlock(&shm->lock);
+	return slot;
+}
+
+/**
+ * Count a new connection in the zones of its server, with the
+ * `limit_conn` directives of the server or of the http section.
+ * Returns: false if the connection is over a limit and must be closed
+ */
+bool
+limitConnection(_clientConnection *client)
+{
+	_limit_conn *list = client->server->limitConns ? client->server->limitConns : getLimitConnList();
+	if (list == NULL) {
+		return true;
+	}
+	// the variables of the key only need the server and the client
+	_request req;
+	memset(&req, 0, sizeof(req));
+	req.server = client->server;
+	req.client = client;
+	for (_limit_conn *lc = list; lc != NULL; lc = lc->next) {
+		char key[CONN_KEY_SIZE];
+		int len = expandVariables(lc->zone->ops, &req, key, CONN_KEY_SIZE);
+		if (len == 0) {
+			continue;
+		}
+		if (len < 0) {
+			len = CONN_KEY_SIZE - 1;
+		}
+		uint32_t tag = 2166136261u;
+		for (int i = 0; i < len; i++) {
+			tag = (tag ^ (unsigned char)key[i]) * 16777619u;
+		}
+		int slot = acquire(lc->zone->shm, tag ? tag : 1, lc->limit);
+		if (slot < 0) {
+			if (isDebug()) {
+				fprintf(stderr, "Limiting connections from %s by zone \"%s\"\n", client->ip, lc->zone->name);
+			}
+			return false;
+		}
+		_conn_hold *hold = (_conn_hold *)malloc(sizeof(_conn_hold));
+		hold->zone = lc->zone;
+		hold->slot = slot;
+		hold->entry = recordHold(lc->zone->shm, slot);
+		hold->next = client->holds;
+		client->holds = hold;
+	}
+	return true;
+}
+
+/**
+ * Uncount a connection that is closed
+ */
+void
+releaseConnection(_clientConnection *client)
+{
+	while (client->holds) {
+		_conn_hold *hold = client->holds;
+		client->holds = hold->next;
+		_conn_shm *shm = hold->zone->shm;
+		// forgotten first, so the master can't release it a second time
+		if (hold->entry >= 0) {
+			atomic_store(&holdTable->entries[hold->entry], 0);
+		}
+		atomic_fetch_sub(&shm->slots[hold->slot], 1);
+		free(hold);
+	}
+}
@@ -0,0 +1,363 @@
+/**
+ * Limit the rate of requests, with `limit_req_zone` and `limit_req`.
+ *
+ * Example directives:
+ * 		limit_req_zone $binary_remote_addr zone=perip:10m rate=10r/s;
+ * 		location /search {
+ * 			limit_req zone=perip burst=20 nodelay;
+ * 		}
+ *
+ * 	Each zone is a block of shared memory, mapped by the master when the
+ * 	config file is loaded, so all the workers see it. It holds a hash of
+ * 	the keys with the state of their leaky bucket: how many requests in
+ * 	excess of the rate a key has made. A request that would take the
+ * 	excess over the burst is rejected with 429. The others are served, the
+ * 	ones over the `delay` after waiting until they conform to the rate.
+ *
+ * 	When a zone is full the least recently used key is dropped. A zone
+ * 	with the same name, size and key is kept on a reload, so the workers
+ * 	started by it go on with the same state. The zones of `limit_conn`
+ * 	are set up and kept the same way, see limitConn.c.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+// a longer key is cut to this length
+#define LIMIT_KEY_SIZE 64
+#define LIMIT_NONE -1
+
+// the state of a key, linked in its hash bucket and in the LRU list
+typedef struct {
+	uint32_t hash;
+	int32_t hashNext;
+	int32_t prev;		// more recently used
+	int32_t next;		// less recently used
+	long excess;		// thousandths of a request
+	long last;			// milliseconds, on the monotonic clock
+	uint16_t keyLen;
+	char key[LIMIT_KEY_SIZE];
+} _limit_node;
+
+typedef struct _limit_shm {
+	pthread_mutex_t lock;
+	size_t size;
+	int32_t nodeCount;
+	int32_t head;		// most recently used
+	int32_t tail;
+	int32_t free;		// nodes not used yet
+	int32_t *buckets;	// nodeCount of them, after the nodes
+	_limit_node nodes[];
+} _limit_shm;
+
+// the zones mapped for the current config, kept for the next reload
+static _limit_zone *mappedZones = NULL;
+
+static long
+nowMillis()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+/**
+ * Map the memory of a zone and set up an empty hash
+ */
+static _limit_shm *
+createShm(_limit_zone *zone)
+{
+	size_t perNode = sizeof(_limit_node) + sizeof(int32_t);
+	if (zone->size < sizeof(_limit_shm) + 8 * perNode) {
+		fprintf(stderr, "%s: ", zone->name);
+		errorExit("limit_req_zone is too small\n");
+	}
+	_limit_shm *shm = mmap(NULL, zone->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "%s: ", zone->name);
+		errorExit("can't map the limit_req_zone memory\n");
+	}
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	// a worker killed while it holds the lock must not stop the others
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&shm->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	shm->size = zone->size;
+	shm->nodeCount = (zone->size - sizeof(_limit_shm)) / perNode;
+	shm->head = shm->tail = LIMIT_NONE;
+	shm->free = 0;
+	shm->buckets = (int32_t *)&shm->nodes[shm->nodeCount];
+	for (int i = 0; i < shm->nodeCount; i++) {
+		shm->buckets[i] = LIMIT_NONE;
+	}
+	return shm;
+}
+
+/**
+ * A zone of the previous config that can be used as it is
+ */
+static _limit_zone *
+findMappedZone(_limit_zone *zone)
+{
+	for (_limit_zone *z = mappedZones; z != NULL; z = z->next) {
+		if (z->shm && (z->type == zone->type) && (strcmp(z->name, zone->name) == 0)
+				&& (z->size == zone->size) && (strcmp(z->key, zone->key) == 0)) {
+			return z;
+		}
+	}
+	return NULL;
+}
+
+static _limit_zone *
+findZone(const char *name, int type)
+{
+	for (_limit_zone *zone = getLimitZoneList(); zone != NULL; zone = zone->next) {
+		if ((zone->type == type) && (strcmp(zone->name, name) == 0)) {
+			return zone;
+		}
+	}
+	return NULL;
+}
+
+static void
+resolveZones(_limit_req *list)
+{
+	for (_limit_req *lr = list; lr != NULL; lr = lr->next) {
+		if ((lr->zone == NULL) && ((lr->zone = findZone(lr->zoneName, LIMIT_ZONE_REQ)) == NULL)) {
+			fprintf(stderr, "%s: ", lr->zoneName);
+			errorExit("unknown limit_req zone\n");
+		}
+	}
+}
+
+static void
+resolveConnZones(_limit_conn *list)
+{
+	for (_limit_conn *lc = list; lc != NULL; lc = lc->next) {
+		if ((lc->zone == NULL) && ((lc->zone = findZone(lc->zoneName, LIMIT_ZONE_CONN)) == NULL)) {
+			fprintf(stderr, "%s: ", lc->zoneName);
+			errorExit("unknown limit_conn zone\n");
+		}
+	}
+}
+
+/**
+ * Map the zones and find the zones of the `limit_req` and `limit_conn`
+ * directives. Called
+ * when the config file has been parsed, by the master, before the
+ * workers are started.
+ */
+void
+buildLimitZones()
+{
+	for (_limit_zone *zone = getLimitZoneList(); zone != NULL; zone = zone->next) {
+		_limit_zone *old = findMappedZone(zone);
+		if (old) {
+			zone->shm = old->shm;
+			old->shm = NULL;
+		} else if (zone->type == LIMIT_ZONE_CONN) {
+			zone->shm = createConnShm(zone);
+		} else {
+			zone->shm = createShm(zone);
+		}
+	}
+	// the zones the new config doesn't use
+	while (mappedZones) {
+		_limit_zone *z = mappedZones;
+		mappedZones = z->next;
+		if (z->shm) {
+			munmap(z->shm, z->size);
+		}
+		free(z->name);
+		free(z->key);
+		free(z);
+	}
+	for (_limit_zone *zone = getLimitZoneList(); zone != NULL; zone = zone->next) {
+		_limit_zone *z = (_limit_zone *)calloc(1, sizeof(_limit_zone));
+		z->type = zone->type;
+		z->name = strdup(zone->name);
+		z->key = strdup(zone->key);
+		z->size = zone->size;
+		z->shm = zone->shm;
+		z->next = mappedZones;
+		mappedZones = z;
+	}
+
+	resolveZones(getLimitReqList());
+	resolveConnZones(getLimitConnList());
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		resolveZones(s->limitReqs);
+		resolveConnZones(s->limitConns);
+		for (_location *loc = s->locations; loc != NULL; loc = loc->next) {
+			resolveZones(loc->limitReqs);
+		}
+	}
+}
+
+static void
+lockShm(_limit_shm *shm)
+{
+	if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+		// a worker died holding the lock, go on with the state as it is
+		pthread_mutex_consistent(&shm->lock);
+	}
+}
+
+static void
+unlinkLru(_limit_shm *shm, int32_t n)
+{
+	_limit_node *node = &shm->nodes[n];
+	if (node->prev != LIMIT_NONE) {
+		shm->nodes[node->prev].next = node->next;
+	} else {
+		shm->head = node->next;
+	}
+	if (node->next != LIMIT_NONE) {
+		shm->nodes[node->next].prev = node->prev;
+	} else {
+		shm->tail = node->prev;
+	}
+}
+
+static void
+pushLru(_limit_shm *shm, int32_t n)
+{
+	_limit_node *node = &shm->nodes[n];
+	node->prev = LIMIT_NONE;
+	node->next = shm->head;
+	if (shm->head != LIMIT_NONE) {
+		shm->nodes[shm->head].prev = n;
+	} else {
+		shm->tail = n;
+	}
+	shm->head = n;
+}
+
+/**
+ * A node for a new key, the least recently used one when all are taken
+ */
+static int32_t
+takeNode(_limit_shm *shm)
+{
+	if (shm->free < shm->nodeCount) {
+		return shm->free++;
+	}
+	int32_t n = shm->tail;
+	unlinkLru(shm, n);
+	int32_t *p = &shm->buckets[shm->nodes[n].hash % shm->nodeCount];
+	while (*p != n) {
+		p = &shm->nodes[*p].hashNext;
+	}
+	*p = shm->nodes[n].hashNext;
+	return n;
+}
+
+/**
+ * Account a request to its key in a zone
+ * Returns: the excess of the key, -1 if the request is over the burst
+ */
+static long
+account(_limit_req *lr, const char *key, size_t len)
+{
+	_limit_shm *shm = lr->zone->shm;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+	}
+	long now = nowMillis();
+	long excess = -1;
+
+	lockShm(shm);
+	int32_t *bucket = &shm->buckets[hash % shm->nodeCount];
+	int32_t n = *bucket;
+	while ((n != LIMIT_NONE) && ((shm->nodes[n].hash != hash) || (shm->nodes[n].keyLen != len)
+			|| (memcmp(shm->nodes[n].key, key, len) != 0))) {
+		n = shm->nodes[n].hashNext;
+	}
+	if (n == LIMIT_NONE) {
+		n = takeNode(shm);
+		_limit_node *node = &shm->nodes[n];
+		node->hash = hash;
+		node->keyLen = len;
+		memcpy(node->key, key, len);
+		node->excess = 0;
+		node->last = now;
+		// the bucket may have changed if the node taken was in it
+		bucket = &shm->buckets[hash % shm->nodeCount];
+		node->hashNext = *bucket;
+		*bucket = n;
+		excess = 0;
+	} else {
+		_limit_node *node = &shm->nodes[n];
+		unlinkLru(shm, n);
+		long elapsed = now - node->last;
+		excess = node->excess - lr->zone->rate * (elapsed > 0 ? elapsed : 0) / 1000 + 1000;
+		if (excess < 0) {
+			excess = 0;
+		}
+		if (excess > lr->burst) {
+			excess = -1;
+		} else {
+			node->excess = excess;
+			node->last = now;
+		}
+	}
+	pushLru(shm, n);
+	pthread_mutex_unlock(&shm->lock);
+	return excess;
+}
+
+/**
+ * Apply the `limit_req` directives of the request's location, once for a
+ * request. A request over a burst is answered with 429.
+ * Returns: -1 if the request was answered, otherwise the milliseconds
+ * it must wait, 0 to go on now
+ */
+long
+limitRequest(_request *req)
+{
+	req->limited = true;
+	_limit_req *list = req->loc->limitReqs;
+	if (list == NULL) {
+		list = req->server->limitReqs ? req->server->limitReqs : getLimitReqList();
+	}
+	long delay = 0;
+	for (_limit_req *lr = list; lr != NULL; lr = lr->next) {
+		char key[LIMIT_KEY_SIZE + 1];
+		int len = expandVariables(lr->zone->ops, req, key, sizeof(key));
+		if (len < 0) {
+			len = LIMIT_KEY_SIZE;
+		}
+		if (len == 0) {
+			// nginx doesn't account requests with an empty key
+			continue;
+		}
+		long excess = account(lr, key, len);
+		if (excess < 0) {
+			char msg[128];
+			snprintf(msg, sizeof(msg), "limiting requests by zone \"%s\"", lr->zone->name);
+			sendErrorResponse(req, 429, msg, req->path);
+			return -1;
+		}
+		if (excess > lr->delay) {
+			long wait = (excess - lr->delay) * 1000 / lr->zone->rate;
+			if (wait > delay) {
+				delay = wait;
+			}
+		}
+	}
+	return delay;
+}
@@ -3,6 +3,7 @@
  *
  * (c) Tom Lang 2/2023
  */
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,43 +12,170 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "serverlist.h"
 #include "server.h"
 
+static void logWrite(_log_file *, const char *, size_t);
+
+/**
+ * Write an access log record for a request, in the format of the log
+ */
 void
-accessLog(int clientFd, _server *server,  char *verb, int httpCode, char *path, int size)
+accessLog(_request *req, int httpCode, size_t size)
 {
-	char ts[TIME_BUF];
-	getTimestamp((char *)&ts, LOG_RECORD_FORMAT);
+	_log_file *log = req->server->accessLog;
+	char buffer[BUFF_SIZE];
+	int sz = formatLogRecord(log->format->ops, req, httpCode, size, buffer, BUFF_SIZE);
+	logWrite(log, buffer, sz);
+}
 
-	struct sockaddr_in peeraddr;
-	socklen_t len = sizeof(peeraddr);
-	getpeername(clientFd, (struct sockaddr*)&peeraddr, &len);
-	char peerIp[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &peeraddr.sin_addr.s_addr, peerIp, INET_ADDRSTRLEN);
+void
+errorLog(_request *req, int httpCode, char *path, char *msg)
+{
+	const char *ts = getTimestamp(LOG_RECORD_FORMAT);
 
+	const char *peerIp = req->client ? req->client->ip : "-";
+	const char *verb = req->verb ? req->verb : "-";
 	char buffer[BUFF_SIZE];
-	int sz = snprintf(buffer, BUFF_SIZE, "%s %s %s %d %s %s %d\n", ts, peerIp, verb, httpCode, server->serverNames->serverName, path, size);
-	write(server->accessLog->fd, buffer, sz);
+	int sz = snprintf(buffer, BUFF_SIZE, "%s %s %s %d %s %s %s\n", ts, peerIp, verb, httpCode, req->server->serverNames->serverName, path, msg);
+	if (sz >= BUFF_SIZE) {
+		sz = BUFF_SIZE - 1;
+	}
+	logWrite(req->server->errorLog, buffer, sz);
+}
+
+/**
+ * Write the whole buffer, a log record must not be split
+ */
+static void
+writeAll(int fd, const char *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/**
+ * Write out the buffer of a log file. Called with the lock held.
+ */
+static void
+flushLog(_log_file *log)
+{
+	if (log->used) {
+		writeAll(log->fd, log->buf, log->used);
+		log->used = 0;
+	}
+}
+
+/**
+ * Add a record to a log file. With `buffer=size` the records are collected
+ * and written when the buffer is full or the `flush=time` has passed, this
+ * saves a system call per request. Each worker has its own buffers, and the
+ * records are whole lines, so the workers' writes don't interleave.
+ */
+static void
+logWrite(_log_file *log, const char *record, size_t len)
+{
+	pthread_mutex_lock(&log->lock);
+	if (log->bufSize == 0) {
+		writeAll(log->fd, record, len);
+	} else {
+		if (log->used + len > log->bufSize) {
+			flushLog(log);
+		}
+		if (len > log->bufSize) {
+			writeAll(log->fd, record, len);
+		} else {
+			if (log->used == 0) {
+				log->buffered = time(NULL);
+			}
+			memcpy(log->buf + log->used, record, len);
+			log->used += len;
+		}
+	}
+	pthread_mutex_unlock(&log->lock);
 }
 
+/**
+ * Write out the log buffers whose flush time has passed, or all of
+ * them if `force` is set (on exit or before reopening the files).
+ */
+static void
+flushList(_log_file *list, bool force, time_t now)
+{
+	for (_log_file *log = list; log != NULL; log = log->next) {
+		if (log->used && (force || (log->flush && (now - log->buffered >= log->flush)))) {
+			pthread_mutex_lock(&log->lock);
+			flushLog(log);
+			pthread_mutex_unlock(&log->lock);
+		}
+	}
+}
 void
-errorLog(int clientFd, _server *server, char *verb, int httpCode, char *path, char *msg)
+flushLogs(bool force)
 {
-	char ts[TIME_BUF];
-	getTimestamp((char *)&ts, LOG_RECORD_FORMAT);
+	time_t now = time(NULL);
+	flushList(getDefaultAccessLog(), force, now);
+	flushList(getDefaultErrorLog(), force, now);
+}
 
-	struct sockaddr_in peeraddr;
-	socklen_t len = sizeof(peeraddr);
-	getpeername(clientFd, (struct sockaddr*)&peeraddr, &len);
-	char peerIp[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &peeraddr.sin_addr.s_addr, peerIp, INET_ADDRSTRLEN);
+/**
+ * How long the event loop may wait before a log buffer is due
+ * Returns: milliseconds, -1 if no log has a flush time
+ */
+int
+logFlushTimeout()
+{
+	for (_log_file *log = getDefaultAccessLog(); log != NULL; log = log->next) {
+		if (log->flush) {
+			return 1000;
+		}
+	}
+	for (_log_file *log = getDefaultErrorLog(); log != NULL; log = log->next) {
+		if (log->flush) {
+			return 1000;
+		}
+	}
+	return -1;
+}
 
-	char buffer[BUFF_SIZE];
-	int sz = snprintf(buffer, BUFF_SIZE, "%s %s %s %d %s %s %s\n", ts, peerIp, verb, httpCode, server->serverNames->serverName, path, msg);
-	write(server->errorLog->fd, buffer, sz);
+/**
+ * Reopen the log files after they have been rotated (`-s reopen`). The
+ * new file replaces the old one on the same descriptor, so the servers
+ * sharing a log file keep sharing it.
+ */
+static void
+reopenList(_log_file *list)
+{
+	for (_log_file *log = list; log != NULL; log = log->next) {
+		int fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd == -1) {
+			fprintf(stderr, "%s: can't reopen file: %m\n", log->path);
+			continue;
+		}
+		if (fd != log->fd) {
+			dup3(fd, log->fd, O_CLOEXEC);
+			close(fd);
+		}
+	}
+}
+void
+reopenLogFiles()
+{
+	flushLogs(true);
+	reopenList(getDefaultAccessLog());
+	reopenList(getDefaultErrorLog());
 }
 
 /**
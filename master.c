@@ -0,0 +1,904 @@
+/**
+ * The master process.
+ *
+ * The master creates the listening sockets, forks the worker processes
+ * and then does nothing but supervise them. It never serves requests.
+ *
+ * - If a worker dies unexpectedly it is started again, on the same
+ *   listening socket, so the capacity of the server is restored without
+ *   a restart. A worker that keeps crashing right after being started is
+ *   restarted with an increasing delay, to avoid a busy fork loop.
+ * - On SIGQUIT (`-s quit`) the master closes its listening sockets and asks
+ *   the workers to stop accepting connections and finish what they are
+ *   doing. Workers which haven't exited by the `worker_shutdown_timeout`
+ *   deadline are killed.
+ * - On SIGTERM (`-s stop`) the workers are terminated immediately.
+ * - On SIGHUP (`-s reload`) the config file is parsed again and a new
+ *   generation of workers is started with it. The listening sockets are
+ *   handed over to the new workers, so no connection is refused, and the
+ *   old workers drain like on a graceful shutdown.
+ * - On SIGUSR1 (`-s reopen`) the log files are reopened, by the master
+ *   and the workers, after they have been rotated.
+ * - On SIGUSR2 (`-s upgrade`) the master starts the binary again, which
+ *   may have been replaced by a new version, and passes it the listening
+ *   sockets. Once the workers of the new master are accepting connections
+ *   it sends SIGWINCH to the old master, whose workers then drain and exit.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+/**
+ * The service starts one process per port that is listened to, times the
+ * number of worker processes from the configuration. This structure keeps
+ * track of which port number, whether it is TLS (SSL) or not, and a list
+ * of servers that listen on this port for each process.
+ *
+ * All of the server-related data structures are created as the config file
+ * is parsed. Then, processes are started. Due to the semantics of the `fork`
+ * system call, each process gets a clone of all the data structures. There
+ * is no need for any interprocess communication or synchronization, each
+ * process operates independantly of the others.
+ *
+ * The listening sockets are created by the master, one per process, in
+ * worker order. All the sockets for a port are in the same SO_REUSEPORT
+ * group, and socket N of the group belongs to worker N, which lets the
+ * kernel steer connections to the worker bound to a given CPU. Since the
+ * master keeps the sockets open, a restarted worker picks up where the
+ * old one left off.
+ *
+ * It gets more complicated for a TLS server, where a thread is created to
+ * process each request. The threads do not modify any of the server data
+ * structures so locking/synchronization is not required.
+ */
+typedef struct _procs {
+	struct _procs *next;
+	_server *server;
+	int portNum;
+	int tls;
+	int worker;		// index of the worker for this port
+	int sockFd;		// listening socket
+	pid_t pid;		// 0 if the worker is not running
+	time_t started;	// when the worker was last started
+	int backoff;	// seconds to wait before restarting a crashed worker
+	time_t respawnAt;	// when a crashed worker is due to be restarted
+	time_t killAt;	// when a retired worker still running is killed
+	bool ready;		// the worker has reported that it is accepting
+	void *holds;	// the `limit_conn` counters the worker holds
+}_procs;
+
+static _procs *procList = NULL;
+// old generation workers which are draining after a reload
+static _procs *retiredList = NULL;
+
+// for a binary upgrade
+static char *binaryPath = NULL;
+static char **savedArgv = NULL;
+static char *startDir = NULL;
+static pid_t upgradePid = 0;	// new master started by this one
+static pid_t oldMaster = 0;		// master which started this one
+// the workers write their pid to it once they are accepting connections,
+// so the old master is only told to go when they all are
+static int readyPipe[2] = {-1, -1};
+
+// a worker that dies sooner than this after starting is crash looping
+#define MIN_WORKER_LIFETIME 10
+#define MAX_RESPAWN_BACKOFF 60
+
+static void masterLoop(void);
+static void shutdownWorkers(void);
+static _procs *inheritedListeners(void);
+
+/**
+ * While determining how many processes to start we scan the list of servers
+ * to see which ports are listened to. This function checks the list of 
+ * known ports to see if we already know about this port.
+ */
+int
+uniquePort(int portNum)
+{
+	_procs *p = procList;
+	while (p) {
+		if (p->portNum == portNum) {
+			return 0;
+		}
+		p = p->next;
+	}
+	return 1;
+}
+
+/**
+ * A worker only keeps its own listening socket open.
+ */
+static void
+closeListeners(_procs *keep)
+{
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		if ((p != keep) && (p->sockFd != -1)) {
+			close(p->sockFd);
+			p->sockFd = -1;
+		}
+	}
+}
+
+/**
+ * Signals handled by the master. They are blocked and collected
+ * synchronously in the master loop.
+ */
+static void
+masterSignals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGCHLD);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGHUP);
+	sigaddset(set, SIGUSR2);
+	sigaddset(set, SIGWINCH);
+	sigaddset(set, SIGUSR1);
+}
+
+/**
+ * In a worker, SIGQUIT (or SIGINT) asks for a graceful shutdown,
+ * SIGUSR1 to reopen the log files.
+ */
+static void
+workerSignalHandler(int sig)
+{
+	if ((sig == SIGQUIT) || (sig == SIGINT)) {
+		setQuitting(true);
+	} else if (sig == SIGUSR1) {
+		setReopenLogs(true);
+	}
+}
+
+/**
+ * Signals handled by a worker. They are blocked, except while the worker
+ * waits for connections or events, so one that comes just before a wait
+ * ends it rather than being noticed after it.
+ */
+static void
+workerSignals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGUSR1);
+}
+
+/**
+ * The signal mask for the waits of a worker, with its signals unblocked
+ */
+void
+getWorkerWaitMask(sigset_t *mask)
+{
+	pthread_sigmask(SIG_SETMASK, NULL, mask);
+	sigdelset(mask, SIGQUIT);
+	sigdelset(mask, SIGINT);
+	sigdelset(mask, SIGUSR1);
+}
+
+/**
+ * Called by a worker once it is accepting connections. Only the workers
+ * of a master started by an upgrade report it.
+ */
+void
+workerReady()
+{
+	if (readyPipe[1] != -1) {
+		pid_t pid = getpid();
+		if (write(readyPipe[1], &pid, sizeof(pid)) != sizeof(pid)) {
+			perror("Can't report the worker ready");
+		}
+		close(readyPipe[1]);
+		readyPipe[1] = -1;
+	}
+}
+
+/**
+ * After an upgrade, collect the reports of the workers that are ready.
+ * Returns: true when all the workers are accepting connections
+ */
+static bool
+workersReady()
+{
+	pid_t pid;
+	while (read(readyPipe[0], &pid, sizeof(pid)) == sizeof(pid)) {
+		for (_procs *p = procList; p != NULL; p = p->next) {
+			if (p->pid == pid) {
+				p->ready = true;
+			}
+		}
+	}
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		if (!p->ready) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Set the open file limit of a worker, with `worker_rlimit_nofile`. Each
+ * connection takes a descriptor, so warn when `worker_connections` can't
+ * be reached.
+ */
+static void
+setWorkerFileLimit()
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl)) {
+		return;
+	}
+	rlim_t want = getWorkerRlimitNofile();
+	if (want > 0) {
+		struct rlimit raised = {want, (want > rl.rlim_max) ? want : rl.rlim_max};
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+			rl = raised;
+		} else if ((want > rl.rlim_max) && (rl.rlim_cur < rl.rlim_max)) {
+			// raising the hard limit needs privileges, take what is allowed
+			fprintf(stderr, "Can't set worker_rlimit_nofile %d: %m, using %ld\n",
+				getWorkerRlimitNofile(), (long)rl.rlim_max);
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		} else {
+			fprintf(stderr, "Can't set worker_rlimit_nofile %d: %m\n", getWorkerRlimitNofile());
+		}
+	}
+	if ((rl.rlim_cur != RLIM_INFINITY) && ((rlim_t)getWorkerConnections() > rl.rlim_cur)) {
+		fprintf(stderr, "worker_connections %d exceed the open file limit of %ld\n",
+			getWorkerConnections(), (long)rl.rlim_cur);
+	}
+}
+
+/**
+ * Fork a worker process for one listening socket.
+ */
+static void
+spawnWorker(_procs *p)
+{
+	pid_t master = getpid();
+	p->holds = createHoldTable();
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Can't fork");
+		releaseHoldTable(p->holds);
+		p->holds = NULL;
+		// try again later
+		p->respawnAt = time(NULL) + 1;
+		return;
+	}
+	if (pid > 0) {
+		p->pid = pid;
+		p->started = time(NULL);
+		p->respawnAt = 0;
+		if (isDebug()) {
+			fprintf(stderr, "Server Starting, process: %d for port %d\n", pid, p->portNum);
+		}
+		return;
+	}
+
+	// This is the worker process.
+	// Link to the master process so that killing the master causes
+	// the whole family to die.
+	if (prctl(PR_SET_PDEATHSIG, SIGTERM)) {
+		perror("Can't link to parent signal");
+		exit(1);
+	}
+	if (getppid() != master) {
+		// the master died before the link was made
+		exit(1);
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = workerSignalHandler;
+	sigemptyset(&sa.sa_mask);
+	// no SA_RESTART, the wait for events must be interrupted to notice
+	// the request
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+	sigset_t set;
+	masterSignals(&set);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	workerSignals(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	closeListeners(p);
+	setHoldTable(p->holds);
+	if (readyPipe[0] != -1) {
+		close(readyPipe[0]);
+	}
+	setWorkerFileLimit();
+	setWorkerCpuAffinity(p->worker);
+	openDocRoots();
+	if (p->tls) {
+		tlsServer(p->sockFd, p->portNum, p->server);
+	} else {
+		server(p->sockFd, p->server);
+	}
+	// The servers loop until they are asked to shut down.
+	flushLogs(true);
+	exit(0);
+}
+
+/**
+ * Keep what is needed to start the binary again for an upgrade. The path
+ * is resolved now, since the working directory changes and the file may
+ * be replaced later.
+ */
+void
+setUpgradeArgs(char *argv[])
+{
+	savedArgv = argv;
+	// relative paths in the arguments are relative to this
+	startDir = getcwd(NULL, 0);
+	char path[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path)-1);
+	if (len > 0) {
+		path[len] = '\0';
+		binaryPath = strdup(path);
+	} else {
+		binaryPath = realpath(argv[0], NULL);
+	}
+}
+
+/**
+ * A master started by an upgrade gets the listening sockets of the old
+ * one in the environment, as a list of `port:tls:worker:fd` entries.
+ * Returns: list of the sockets, NULL if this isn't an upgrade
+ */
+static _procs *
+inheritedListeners()
+{
+	char *env = getenv(LISTEN_FDS_ENV);
+	if (env == NULL) {
+		return NULL;
+	}
+	_procs *list = NULL;
+	char *save = NULL;
+	char *fds = strdup(env);
+	for (char *e = strtok_r(fds, ",", &save); e != NULL; e = strtok_r(NULL, ",", &save)) {
+		_procs *p = (_procs *)calloc(1, sizeof(_procs));
+		if (sscanf(e, "%d:%d:%d:%d", &p->portNum, &p->tls, &p->worker, &p->sockFd) != 4) {
+			fprintf(stderr, "Ignoring inherited socket \"%s\"\n", e);
+			free(p);
+			continue;
+		}
+		p->next = list;
+		list = p;
+	}
+	free(fds);
+	char *old = getenv(OLD_MASTER_ENV);
+	if (old) {
+		oldMaster = atoi(old);
+	}
+	unsetenv(LISTEN_FDS_ENV);
+	unsetenv(OLD_MASTER_ENV);
+	return list;
+}
+
+/**
+ * Build the list of processes from the configuration, one per port on which
+ * we are listening times the `worker_processes` directive.
+ *
+ * The listening sockets are created in worker order. On a reload the
+ * socket of the same port and worker in the old list is taken over
+ * instead, so the port is never closed.
+ */
+static void
+createListeners(_procs *old)
+{
+	_procs *last = NULL;
+	for (_server *server = getServerList(); server != NULL; server = server->next) {
+		for (_port *port = server->ports; port != NULL; port = port->next) {
+			if (uniquePort(port->portNum)) {
+				int firstFd = -1;
+				for (int i = 0; i < getWorkerProcesses(); i++) {
+					_procs *p = (_procs *)calloc(1, sizeof(_procs));
+					p->portNum = port->portNum;
+					p->tls = port->tls;
+					p->server = server;
+					p->worker = i;
+					p->sockFd = -1;
+					for (_procs *o = old; o != NULL; o = o->next) {
+						if ((o->portNum == p->portNum) && (o->tls == p->tls)
+							&& (o->worker == i) && (o->sockFd != -1)) {
+							p->sockFd = o->sockFd;
+							o->sockFd = -1;
+							break;
+						}
+					}
+					if (p->sockFd == -1) {
+						p->sockFd = createBindAndListen(port->portNum);
+					}
+					if (firstFd == -1) {
+						firstFd = p->sockFd;
+					}
+					p->next = NULL;
+					if (last) {
+						last->next = p;
+					} else {
+						procList = p;
+					}
+					last = p;
+				}
+				steerConnectionsToWorkerCpus(firstFd, getWorkerProcesses());
+			}	
+		}
+	}
+}
+
+/**
+ * Start at least 1 process per port on which we are listening.
+ * The processes needed per port is controlled by `worker_processes`
+ * directive in the config file.
+ */
+void
+startProcesses()
+{
+	_procs *inherited = inheritedListeners();
+	createListeners(inherited);
+	// close the sockets of ports the new configuration doesn't listen to
+	while (inherited) {
+		_procs *p = inherited;
+		inherited = inherited->next;
+		if (p->sockFd != -1) {
+			close(p->sockFd);
+		}
+		free(p);
+	}
+
+	if (oldMaster && pipe2(readyPipe, O_CLOEXEC | O_NONBLOCK)) {
+		perror("Can't create the ready pipe");
+	}
+
+	// The master handles its signals synchronously. The mask is set
+	// before forking so no signal is lost in between.
+	sigset_t set;
+	masterSignals(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	// All the workers call server() or tlsServer() depending
+	// on the `tls` attribute in the port list. Note: we don't support
+	// serving both TLS and non-TLS on the same port.
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		spawnWorker(p);
+	}
+	masterLoop();
+}
+
+/**
+ * Parse the config file in a child process first, since any error in it
+ * exits the process. The running configuration is kept if it fails.
+ */
+static bool
+configIsValid()
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Can't fork");
+		return false;
+	}
+	if (pid == 0) {
+		resetConfig();
+		parseConfig();
+		exit(0);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+/**
+ * The master only needs to close its copies of the old log files,
+ * the draining workers still have theirs.
+ */
+static void
+closeLogFiles(_log_file *list)
+{
+	for (_log_file *log = list; log != NULL; log = log->next) {
+		if (log->fd != -1) {
+			close(log->fd);
+		}
+	}
+}
+
+/**
+ * Reload the configuration and replace the workers. The old workers are
+ * asked to quit once the new ones are started, and are not restarted.
+ */
+static void
+reloadConfig()
+{
+	if (!configIsValid()) {
+		fprintf(stderr, "Reload failed, keeping the current configuration\n");
+		return;
+	}
+	_log_file *oldAccessLog = getDefaultAccessLog();
+	_log_file *oldErrorLog = getDefaultErrorLog();
+	// the old workers drain with the timeout they were started with
+	int oldTimeout = getWorkerShutdownTimeout();
+	// the pid file and the user can't be changed without a restart
+	char *pidFile = strdup(getPidFile());
+	resetConfig();
+	parseConfig();
+	setPidFile(pidFile);
+	closeLogFiles(oldAccessLog);
+	closeLogFiles(oldErrorLog);
+
+	_procs *old = procList;
+	procList = NULL;
+	createListeners(old);
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		spawnWorker(p);
+	}
+
+	// Retire the old generation. Sockets that weren't taken over belong
+	// to ports no longer listened to.
+	while (old) {
+		_procs *p = old;
+		old = old->next;
+		if (p->sockFd != -1) {
+			close(p->sockFd);
+			p->sockFd = -1;
+		}
+		if (p->pid) {
+			kill(p->pid, SIGQUIT);
+			// a second more than the worker gives itself, so it has
+			// time to write out its logs
+			p->killAt = time(NULL) + oldTimeout + 1;
+			p->next = retiredList;
+			retiredList = p;
+		} else {
+			free(p);
+		}
+	}
+	fprintf(stderr, "Configuration reloaded\n");
+}
+
+/**
+ * Start a new master from the binary, which may have been replaced since
+ * this one was started, and pass it the listening sockets. The new master
+ * parses the config file and takes over the sockets the same way a reload
+ * does. The pid file is copied to `<pid file>.oldbin` and the new master
+ * writes its own pid into the pid file.
+ */
+static void
+upgradeBinary()
+{
+	if (upgradePid) {
+		fprintf(stderr, "Upgrade already in progress\n");
+		return;
+	}
+	if (binaryPath == NULL) {
+		fprintf(stderr, "Upgrade failed, the path of the binary is unknown\n");
+		return;
+	}
+	char *oldBin = malloc(strlen(getPidFile()) + strlen(OLDBIN_SUFFIX) + 1);
+	strcpy(oldBin, getPidFile());
+	strcat(oldBin, OLDBIN_SUFFIX);
+	FILE *fp = fopen(oldBin, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: can't create file: %m\n", oldBin);
+		free(oldBin);
+		return;
+	}
+	fprintf(fp, "%d\n", getpid());
+	fclose(fp);
+
+	// port:tls:worker:fd, at most 4 numbers of 11 characters each
+	size_t size = 1;
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		size += 4*12;
+	}
+	char *fds = calloc(1, size);
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		char *e = fds + strlen(fds);
+		snprintf(e, size - (e - fds), "%s%d:%d:%d:%d", (e == fds) ? "" : ",",
+			p->portNum, p->tls, p->worker, p->sockFd);
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Can't fork");
+		unlink(oldBin);
+		free(oldBin);
+		free(fds);
+		return;
+	}
+	if (pid == 0) {
+		char master[16];
+		snprintf(master, sizeof(master), "%d", getppid());
+		setenv(LISTEN_FDS_ENV, fds, 1);
+		setenv(OLD_MASTER_ENV, master, 1);
+		sigset_t set;
+		sigemptyset(&set);
+		sigprocmask(SIG_SETMASK, &set, NULL);
+		if (startDir && (chdir(startDir) == -1)) {
+			fprintf(stderr, "%s: %m\n", startDir);
+		}
+		execv(binaryPath, savedArgv);
+		fprintf(stderr, "%s: exec failed: %m\n", binaryPath);
+		exit(1);
+	}
+	upgradePid = pid;
+	// from now on this master removes the old pid file when it exits
+	setPidFile(oldBin);
+	free(fds);
+	fprintf(stderr, "Upgrade started, new master %d\n", pid);
+}
+
+/**
+ * The new master exited before taking over, so this one carries on.
+ */
+static void
+upgradeFailed(int status)
+{
+	fprintf(stderr, "Upgrade failed, new master exited with status %d\n", status);
+	upgradePid = 0;
+	char *pidFile = getPidFile();
+	char *p = pidFile + strlen(pidFile) - strlen(OLDBIN_SUFFIX);
+	unlink(pidFile);
+	*p = '\0';
+	FILE *fp = fopen(pidFile, "w");
+	if (fp) {
+		fprintf(fp, "%d\n", getpid());
+		fclose(fp);
+	}
+}
+
+/**
+ * Forget an old generation worker that has exited.
+ * Returns: true if it was one
+ */
+static bool
+removeRetired(pid_t pid)
+{
+	_procs *prev = NULL;
+	for (_procs *p = retiredList; p != NULL; p = p->next) {
+		if (p->pid == pid) {
+			if (prev) {
+				prev->next = p->next;
+			} else {
+				retiredList = p->next;
+			}
+			releaseHoldTable(p->holds);
+			free(p);
+			return true;
+		}
+		prev = p;
+	}
+	return false;
+}
+
+/**
+ * Collect the exit status of workers, and schedule a restart of those
+ * that weren't asked to stop.
+ */
+static void
+reapWorkers(bool restart)
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (removeRetired(pid)) {
+			continue;
+		}
+		if (pid == upgradePid) {
+			upgradeFailed(status);
+			continue;
+		}
+		_procs *p = procList;
+		while (p && (p->pid != pid)) {
+			p = p->next;
+		}
+		if (!p) {
+			continue;
+		}
+		p->pid = 0;
+		// the counts of the connections it didn't close, if it crashed
+		releaseHoldTable(p->holds);
+		p->holds = NULL;
+		if (!restart) {
+			continue;
+		}
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "Worker %d for port %d killed by signal %d\n", pid, p->portNum, WTERMSIG(status));
+		} else {
+			fprintf(stderr, "Worker %d for port %d exited with status %d\n", pid, p->portNum, WEXITSTATUS(status));
+		}
+		time_t now = time(NULL);
+		if (now - p->started < MIN_WORKER_LIFETIME) {
+			p->backoff = (p->backoff == 0) ? 1 : p->backoff * 2;
+			if (p->backoff > MAX_RESPAWN_BACKOFF) {
+				p->backoff = MAX_RESPAWN_BACKOFF;
+			}
+		} else {
+			p->backoff = 0;
+		}
+		p->respawnAt = now + p->backoff;
+	}
+}
+
+/**
+ * Restart the workers whose backoff delay has passed
+ */
+static void
+respawnWorkers()
+{
+	time_t now = time(NULL);
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		if ((p->pid == 0) && (p->respawnAt != 0) && (p->respawnAt <= now)) {
+			if (p->backoff) {
+				fprintf(stderr, "Restarting worker for port %d after %d seconds\n", p->portNum, p->backoff);
+			}
+			spawnWorker(p);
+		}
+	}
+}
+
+/**
+ * Kill the old generation workers still running at their shutdown
+ * deadline. They are forgotten when they have been reaped.
+ */
+static void
+killRetired()
+{
+	time_t now = time(NULL);
+	for (_procs *p = retiredList; p != NULL; p = p->next) {
+		if (p->killAt && (p->killAt <= now)) {
+			fprintf(stderr, "Killed old worker %d still running at the shutdown deadline\n", p->pid);
+			kill(p->pid, SIGKILL);
+			p->killAt = 0;
+		}
+	}
+}
+
+/**
+ * Send a signal to all running workers.
+ * Returns: the number of running workers
+ */
+static int
+signalWorkers(int sig)
+{
+	int count = 0;
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		if (p->pid) {
+			kill(p->pid, sig);
+			count++;
+		}
+	}
+	for (_procs *p = retiredList; p != NULL; p = p->next) {
+		kill(p->pid, sig);
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Graceful shutdown. The workers stop accepting connections, finish the
+ * requests in progress and exit. Those still running at the deadline
+ * are killed.
+ */
+static void
+shutdownWorkers()
+{
+	closeListeners(NULL);
+	signalWorkers(SIGQUIT);
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	time_t deadline = time(NULL) + getWorkerShutdownTimeout();
+	while (time(NULL) < deadline) {
+		reapWorkers(false);
+		if (signalWorkers(0) == 0) {
+			return;
+		}
+		struct timespec timeout = {1, 0};
+		sigtimedwait(&set, NULL, &timeout);
+	}
+	int count = signalWorkers(SIGKILL);
+	if (count) {
+		fprintf(stderr, "Killed %d worker(s) still running at the shutdown deadline\n", count);
+	}
+	// not waitpid(-1), a new master from an upgrade is also a child
+	for (_procs *p = procList; p != NULL; p = p->next) {
+		if (p->pid) {
+			waitpid(p->pid, NULL, 0);
+		}
+	}
+	for (_procs *p = retiredList; p != NULL; p = p->next) {
+		waitpid(p->pid, NULL, 0);
+	}
+}
+
+/**
+ * The master waits for signals, and once a second checks if any
+ * crashed worker is due to be restarted.
+ */
+static void
+masterLoop()
+{
+	sigset_t set;
+	masterSignals(&set);
+	while (1) {
+		struct timespec timeout = {1, 0};
+		int sig = sigtimedwait(&set, NULL, &timeout);
+		switch (sig) {
+			case SIGCHLD:
+				reapWorkers(true);
+				break;
+			case SIGQUIT:
+			case SIGINT:
+				fprintf(stderr, "Graceful shutdown requested\n");
+				shutdownWorkers();
+				unlink(getPidFile());
+				exit(0);
+			case SIGHUP:
+				reloadConfig();
+				break;
+			case SIGUSR2:
+				upgradeBinary();
+				break;
+			case SIGUSR1:
+				// the master's copies are used by restarted workers
+				reopenLogFiles();
+				signalWorkers(SIGUSR1);
+				break;
+			case SIGWINCH:
+				// the new master has taken over
+				if (upgradePid) {
+					fprintf(stderr, "Upgrade complete, shutting down\n");
+					shutdownWorkers();
+					unlink(getPidFile());
+					exit(0);
+				}
+				break;
+			case SIGTERM:
+				signalWorkers(SIGTERM);
+				unlink(getPidFile());
+				exit(0);
+			default:
+				break;
+		}
+		respawnWorkers();
+		killRetired();
+		// let the old master know once the workers are accepting
+		// connections. Until then, or if they never are, it goes on.
+		if (oldMaster && ((readyPipe[0] == -1) || workersReady())) {
+			kill(oldMaster, SIGWINCH);
+			oldMaster = 0;
+			if (readyPipe[0] != -1) {
+				close(readyPipe[0]);
+				close(readyPipe[1]);
+				readyPipe[0] = readyPipe[1] = -1;
+			}
+		}
+	}
+}
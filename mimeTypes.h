@@ -1,9 +1,13 @@
 #ifndef __MIME_TYPES
 #define __MIME_TYPES
+#include <stdbool.h>
 // mime types list
 typedef struct _mimeTypes {
 	struct _mimeTypes *next;
 	char *mimeType;
 	char *extension;
+	char *header;		// Content-Type header
+	int headerLen;
+	bool gzip;			// in `gzip_types`
 }_mimeTypes;
 #endif
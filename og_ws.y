@@ -20,10 +20,9 @@ void yyerror( const char * );
 };
 %token <str>  USER;
 %token <str>  ERRORLOG;
-%token <str>  ACCESSLOG;
-%token <str>  LOGFORMAT;
+%token ACCESSLOG;
+%token LOGFORMAT;
 %token <iValue>  WORKERPROCESSES;
-%token <str>  INCLUDE;
 %token <str>  PID;
 %token <str>  PATH;
 %token <str>  BUILTIN;
@@ -31,6 +30,9 @@ void yyerror( const char * );
 %token EVENTS;
 %token <iValue> WORKERCONNECTIONS;
 %token <iValue> WORKERRLIMIT;
+%token WORKERCPUAFFINITY;
+%token <str>  WORKERSHUTDOWNTIMEOUT;
+%token <str>  WORD;
 %token <str>  QUOTEDSTRING;
 %token <str>  DQUOTEDSTRING;
 %token <str>  HTTP2;
@@ -44,6 +46,8 @@ void yyerror( const char * );
 %token <str>  SERVER;
 %token <str>  SENDFILE;
 %token AUTOINDEX;
+%token <str>  AUTOINDEXSORT;
+%token AUTOINDEXFORMAT;
 %token <str>  TCPNOPUSH;
 %token <iValue>  HASHBUCKET;
 %token <str>  LISTEN;
@@ -58,13 +62,27 @@ void yyerror( const char * );
 %token <str>  FASTCGIINDEX;
 %token <str>  FASTCGIPARAM;
 %token <str>  FASTCGISPLITPATHINFO;
-%token <str>  RETURN;
+%token RETURN;
 %token WEIGHT;
-%token <str>  EXPIRES;
-%token <str>  REWRITE;
-%token <str>  ERRORPAGE;
+%token EXPIRES;
+%token ADDHEADER;
+%token REWRITE;
+%token ERRORPAGE;
+%token LIMITREQZONE;
+%token LIMITREQ;
+%token LIMITCONNZONE;
+%token LIMITCONN;
 %token <str>  LOGNOTFOUND;
-%token <str>  TRYFILES;
+%token <str>  GZIPSTATIC;
+%token <str>  BROTLISTATIC;
+%token <str>  GZIP;
+%token GZIPCOMPLEVEL;
+%token GZIPMINLENGTH;
+%token GZIPTYPES;
+%token GZIPCACHESIZE;
+%token CONTENTCACHE;
+%token TRYFILES;
+%token <str>  NAMEDLOCATION;
 %token <str>  SSLPREFERSERVERCIPHERS;
 %token <str>  SSLCERTIFICATEKEY;
 %token <str>  SSLSESSIONCACHE;
@@ -80,7 +98,6 @@ void yyerror( const char * );
 %token INDEX;
 %token ON;
 %token OFF;
-%token <str> MAIN;
 %token EOL;
 %token <str>  IP;
 %token <str>  UNITS;
@@ -110,10 +127,11 @@ main_directive
 	| access_log_directive
 	| error_log_directive
 	| pid_directive
-	| include_directive
 	| trace_directive
 	| worker_processes_directive
 	| worker_rlimit_nofile_directive
+	| worker_cpu_affinity_directive
+	| worker_shutdown_timeout_directive
 	;
 user_directive
 	:
@@ -128,11 +146,6 @@ pid_directive
 	PID PATH EOL
 	{f_pid($2);}
 	;
-include_directive
-	:
-	INCLUDE PATH EOL
-	{f_include($2);}
-	;
 trace_directive
 	: TRACE ON EOL
 	{f_trace(true);}
@@ -146,7 +159,24 @@ worker_processes_directive
 	;
 worker_rlimit_nofile_directive
 	: WORKERRLIMIT NUMBER EOL
-	{printf("UNIMPLEMENTED Worker rlimit number of files: %d\n", $2);}
+	{f_worker_rlimit_nofile($2);}
+	;
+worker_cpu_affinity_directive
+	: WORKERCPUAFFINITY words EOL
+	{f_worker_cpu_affinity();}
+	;
+worker_shutdown_timeout_directive
+	: WORKERSHUTDOWNTIMEOUT UNITS EOL
+	{f_worker_shutdown_timeout($2);}
+	|
+	WORKERSHUTDOWNTIMEOUT NUMBER EOL
+	{f_worker_shutdown_timeout_num($2);}
+	;
+words
+	: words WORD
+	{f_word($2);}
+	| WORD
+	{f_word($1);}
 	;
 events_section
 	: EVENTS '{' events_directives '}'
@@ -169,14 +199,29 @@ http_directives
 	| http_directive
 	;
 http_directive
-	: include_directive
-	| index_directive
+	: index_directive
 	| default_type_directive
 	| access_log_directive
 	| error_log_directive
 	| log_format_directive
+	| http_error_page_directive
+	| log_not_found_directive
+	| gzip_static_directive
+	| brotli_static_directive
+	| gzip_directive
+	| gzip_comp_level_directive
+	| gzip_min_length_directive
+	| gzip_types_directive
 	| sendfile_directive
 	| tcp_nopush_directive
+	| autoindex_sort_directive
+	| autoindex_format_directive
+	| gzip_cache_size_directive
+	| content_cache_directive
+	| limit_req_zone_directive
+	| http_limit_req_directive
+	| limit_conn_zone_directive
+	| http_limit_conn_directive
 	| keepalive_directive
 	| server_names_hash_bucket_size_directive
 	| server_section
@@ -230,16 +275,8 @@ server_names_hash_bucket_size_directive
 	;
 log_format_directive
 	:
-	LOGFORMAT MAIN strings EOL
-	{printf("NOT YET IMPLEMENTED MAIN log format\n");}
-	|
-	LOGFORMAT strings EOL
-	;
-strings
-	: strings QUOTEDSTRING
-	{printf("NOT YET IMPLEMENTED log format part %s\n", $2);}
-	| QUOTEDSTRING
-	{printf("NOT YET IMPLEMENTED log format part %s\n", $1);}
+	LOGFORMAT words EOL
+	{f_log_format();}
 	;
 server_section
 	:
@@ -260,7 +297,14 @@ server_directive
 	| error_log_directive
 	| root_directive
 	| autoindex_directive
+	| autoindex_sort_directive
+	| autoindex_format_directive
+	| error_page_directive
 	| location_section
+	| server_rewrite_directive
+	| server_return_directive
+	| server_limit_req_directive
+	| limit_conn_directive
 	| listen_directive
 	| ssl_directive
 	| index_directive
@@ -343,16 +387,76 @@ upstream
 	;
 access_log_directive
 	:
-	ACCESSLOG PATH EOL
-	{f_access_log($2, 0);}
-	| ACCESSLOG PATH MAIN EOL
-	{f_access_log($2, 1);}
+	ACCESSLOG words EOL
+	{f_access_log();}
 	;
 error_log_directive
 	:
 	ERRORLOG PATH EOL
 	{f_error_log($2);}
 	;
+http_error_page_directive
+	:
+	ERRORPAGE words EOL
+	{f_error_page(true);}
+	;
+error_page_directive
+	:
+	ERRORPAGE words EOL
+	{f_error_page(false);}
+	;
+log_not_found_directive
+	:
+	LOGNOTFOUND ON EOL
+	{f_log_not_found(true);}
+	|
+	LOGNOTFOUND OFF EOL
+	{f_log_not_found(false);}
+	;
+gzip_static_directive
+	:
+	GZIPSTATIC ON EOL
+	{f_gzip_static(true);}
+	|
+	GZIPSTATIC OFF EOL
+	{f_gzip_static(false);}
+	;
+brotli_static_directive
+	:
+	BROTLISTATIC ON EOL
+	{f_brotli_static(true);}
+	|
+	BROTLISTATIC OFF EOL
+	{f_brotli_static(false);}
+	;
+gzip_directive
+	:
+	GZIP ON EOL
+	{f_gzip(true);}
+	|
+	GZIP OFF EOL
+	{f_gzip(false);}
+	;
+gzip_comp_level_directive
+	: GZIPCOMPLEVEL words EOL
+	{f_gzip_comp_level();}
+	;
+gzip_min_length_directive
+	: GZIPMINLENGTH words EOL
+	{f_gzip_min_length();}
+	;
+gzip_types_directive
+	: GZIPTYPES words EOL
+	{f_gzip_types();}
+	;
+gzip_cache_size_directive
+	: GZIPCACHESIZE words EOL
+	{f_gzip_cache_size();}
+	;
+content_cache_directive
+	: CONTENTCACHE words EOL
+	{f_content_cache();}
+	;
 root_directive
 	:
 	ROOT PATH EOL
@@ -430,6 +534,18 @@ autoindex_directive
 	AUTOINDEX OFF EOL
 	{f_autoindex(0);}
 	;
+autoindex_sort_directive
+	:
+	AUTOINDEXSORT ON EOL
+	{f_autoindex_sort(true);}
+	|
+	AUTOINDEXSORT OFF EOL
+	{f_autoindex_sort(false);}
+	;
+autoindex_format_directive
+	: AUTOINDEXFORMAT words EOL
+	{f_autoindex_format();}
+	;
 location_section
 	:
 	LOCATION EQUAL_OPERATOR PATH '{' location_directives '}'
@@ -440,6 +556,9 @@ location_section
 	|
 	LOCATION PATH '{' location_directives '}'
 	{f_location(PREFIX_MATCH, $2);}
+	|
+	LOCATION NAMEDLOCATION '{' location_directives '}'
+	{f_location(NAMED_MATCH, $2);}
 	;
 location_directives
 	: location_directives location_directive
@@ -453,7 +572,11 @@ location_directive
 	| fastcgi_index
 	| fastcgi_param
 	| expires_directive
+	| add_header_directive
 	| try_files_directive
+	| rewrite_directive
+	| return_directive
+	| limit_req_directive
 	| default_type_directive
 	;
 proxy_pass_directive
@@ -501,29 +624,52 @@ fastcgi_param
 	{f_fastcgi_param($2, $3, NULL);}
 	;
 try_files_directive
-	:
-	TRYFILES try_paths EOL
+	: TRYFILES words EOL
 	{f_try_files();}
 	;
-try_paths
-	:
-	try_paths PATH
-	{f_try_target($2);}
-	|
-	PATH
-	{f_try_target($1);}
-	|
-	try_paths NAME
-	{f_try_target($2);}
-	|
-	NAME
-	{f_try_target($1);}
-	|
-	try_paths VARIABLE
-	{f_try_target($2);}
-	|
-	VARIABLE
-	{f_try_target($1);}
+server_rewrite_directive
+	: REWRITE words EOL
+	{f_rewrite(true);}
+	;
+rewrite_directive
+	: REWRITE words EOL
+	{f_rewrite(false);}
+	;
+server_return_directive
+	: RETURN words EOL
+	{f_return(true);}
+	;
+return_directive
+	: RETURN words EOL
+	{f_return(false);}
+	;
+limit_req_zone_directive
+	: LIMITREQZONE words EOL
+	{f_limit_req_zone();}
+	;
+http_limit_req_directive
+	: LIMITREQ words EOL
+	{f_limit_req(CONTEXT_HTTP);}
+	;
+server_limit_req_directive
+	: LIMITREQ words EOL
+	{f_limit_req(CONTEXT_SERVER);}
+	;
+limit_req_directive
+	: LIMITREQ words EOL
+	{f_limit_req(CONTEXT_LOCATION);}
+	;
+limit_conn_zone_directive
+	: LIMITCONNZONE words EOL
+	{f_limit_conn_zone();}
+	;
+http_limit_conn_directive
+	: LIMITCONN words EOL
+	{f_limit_conn(true);}
+	;
+limit_conn_directive
+	: LIMITCONN words EOL
+	{f_limit_conn(false);}
 	;
 protocol
 	: HTTP1
@@ -534,10 +680,12 @@ protocol
 	{f_protocol("http2");}
 	;
 expires_directive
-	: EXPIRES UNITS EOL
-	{f_expires($2);}
-	| EXPIRES OFF EOL
-	{f_expires("off");}
+	: EXPIRES words EOL
+	{f_expires();}
+	;
+add_header_directive
+	: ADDHEADER words EOL
+	{f_add_header();}
 	;
 listen_directive
 	: LISTEN listen_options EOL
@@ -584,9 +732,15 @@ int main( int argc, char **argv )
 void f_pid(char *path) {
 	printf("PID file %s\n", path);
 }
-void f_include(char *path) {
+void includeFiles(const char *path) {
 	printf("Include file %s\n", path);
 }
+bool endOfConfigFile() {
+	return false;
+}
+const char *currentConfigFile() {
+	return "config";
+}
 void f_trace(bool flag) {
 	if (flag) {
 		printf("Trace ON\n");
@@ -637,8 +791,11 @@ void f_http() {
 void f_root(char *path) {
 	printf("Document root: %s\n", path);
 }
-void f_expires(char *expires) {
-	printf("Expires: %s\n", expires);
+void f_expires() {
+	printf("Expires\n");
+}
+void f_add_header() {
+	printf("Add header\n");
 }
 void f_server_name(char *name, int type) {
 	printf("Server name: %s type %d\n", name, type);
@@ -649,8 +806,67 @@ void f_indexFile(char *indexFile) {
 void f_error_log(char *path) {
 	printf("Error log path %s\n", path);
 }
-void f_access_log(char *path, int type) {
-	printf("Access log path %s type %d\n", path, type);
+void f_access_log() {
+	printf("Access log\n");
+}
+void f_log_format() {
+	printf("Log format\n");
+}
+void f_error_page(bool http) {
+	printf("Error page%s\n", http ? " (http)" : "");
+}
+void f_log_not_found(bool flag) {
+	if (flag) {
+		printf("Log not found ON\n");
+	} else {
+		printf("Log not found OFF\n");
+	}
+}
+void f_gzip_static(bool flag) {
+	if (flag) {
+		printf("Gzip static ON\n");
+	} else {
+		printf("Gzip static OFF\n");
+	}
+}
+void f_brotli_static(bool flag) {
+	if (flag) {
+		printf("Brotli static ON\n");
+	} else {
+		printf("Brotli static OFF\n");
+	}
+}
+void f_gzip(bool flag) {
+	if (flag) {
+		printf("Gzip ON\n");
+	} else {
+		printf("Gzip OFF\n");
+	}
+}
+void f_gzip_comp_level() {
+	printf("Gzip compression level\n");
+}
+void f_gzip_min_length() {
+	printf("Gzip minimum length\n");
+}
+void f_gzip_types() {
+	printf("Gzip types\n");
+}
+void f_gzip_cache_size() {
+	printf("Gzip cache size\n");
+}
+void f_content_cache() {
+	printf("Content cache\n");
+}
+void f_autoindex_sort(bool flag) {
+	if (flag) {
+		printf("Auto index sort ON\n");
+	} else {
+		printf("Auto index sort OFF\n");
+	}
+}
+void f_autoindex_format() {
+	printf("Auto index format\n");
 }
 void f_ssl_certificate(char *cert) {
 	printf("SSL cert %s\n", cert);
@@ -716,6 +932,8 @@ void f_location(int type, char *match) {
 		printf("Location regex match %s\n", match);
 	} else if (type == PREFIX_MATCH) {
 		printf("Location prefix match %s\n", match);
+	} else if (type == NAMED_MATCH) {
+		printf("Named location %s\n", match);
 	} else {
 		printf("Location : unknown match type\n");
 	}
@@ -731,12 +949,27 @@ void f_upstream(char *host, int port, int weight) {
 		printf("weight %d\n", weight);
 	}
 }
-void f_try_target(char *target) {
-	printf("Try files target %s\n", target);
-}
 void f_try_files() {
 	printf("Try files\n");
 }
+void f_rewrite(bool server) {
+	printf("Rewrite in %s\n", server ? "server" : "location");
+}
+void f_return(bool server) {
+	printf("Return in %s\n", server ? "server" : "location");
+}
+void f_limit_req_zone() {
+	printf("Limit req zone\n");
+}
+void f_limit_req(int context) {
+	printf("Limit req in context %d\n", context);
+}
+void f_limit_conn_zone() {
+	printf("Limit conn zone\n");
+}
+void f_limit_conn(bool http) {
+	printf("Limit conn in %s\n", http ? "http" : "server");
+}
 void f_proxy_pass(char *host, int port) {
 	if (port) {
 		printf("Proxy pass to %s:%d\n", host, port);
@@ -756,6 +989,21 @@ void f_workerProcesses(int num) {
 void f_workerConnections(int num) {
 	printf("Worker connections %d\n", num);
 }
+void f_worker_rlimit_nofile(int num) {
+	printf("Worker rlimit number of files: %d\n", num);
+}
+void f_word(char *word) {
+	printf("Argument %s\n", word);
+}
+void f_worker_cpu_affinity() {
+	printf("Worker CPU affinity\n");
+}
+void f_worker_shutdown_timeout(char *units) {
+	printf("Worker shutdown timeout %s\n", units);
+}
+void f_worker_shutdown_timeout_num(int units) {
+	printf("Worker shutdown timeout %d\n", units);
+}
 void f_events() {
 	printf("Events section\n");
 }
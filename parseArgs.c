@@ -45,7 +45,7 @@ parseArgs(int argc, char* argv[])
 				printf("	-f = run in the foreground (else daemon)\n");
 				printf("	-d = turn on debugging\n");
 				printf("	-s = send a signal to the process, options are:\n");
-				printf("	          stop | quit | reload | reopen\n");
+				printf("	          stop | quit | reload | reopen | upgrade\n");
 				printf("	-t = test the configuration\n");
 				printf("	-n = do not launch a default web server\n");
 				printf("	-h = print this message\n");
@@ -78,6 +78,13 @@ parseArgs(int argc, char* argv[])
 		perror("config file not valid:");
 		exit(1);
 	}
+	// The daemon changes its working directory, and a reload
+	// must find the same file.
+	char *absPath = realpath(configFile, NULL);
+	if (absPath) {
+		free(configFile);
+		configFile = absPath;
+	}
 	setConfigFile(configFile);
 	char *p = strdup(configFile);
 	char *q = strrchr(p, '/');
@@ -8,11 +8,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <math.h>
 #include <fcntl.h>
+#include <time.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include "serverlist.h"
@@ -27,21 +29,69 @@ static _index_file *indexFiles = NULL;
 static _server_name *serverNames = NULL;
 static _port *ports = NULL;
 static _location *locations = NULL;
-static _try_target *tryTargets = NULL;
 static _upstream *servers = NULL;
 static _log_file *currentAccessLog = NULL;
 static _log_file *currentErrorLog = NULL;
+static _error_page *currentErrorPages = NULL;
+static _rewrite *currentRewrites = NULL;
+static _limit_req *currentLimitReqs = NULL;
+static _limit_conn *currentLimitConns = NULL;
 static char *certFile = NULL;
 static char *keyFile = NULL;
 static int autoIndex = 0;
 static int protocol = PROTOCOL_UNSET;
+// set when a `location` block ends, the next directive starts another
+static bool locationClosed = false;
+
+//
+// Free-form directive arguments (see the ARGS start condition in the lexer)
+// are collected here until the directive is complete.
+//
+typedef struct _word {
+	struct _word *next;
+	char *word;
+} _word;
+static _word *words = NULL;
+
+static int sizeUnitsToBytes(char *);
+static int timeUnitsToSeconds(char *);
 
 /**
  * This is the interface to generated parser code from yacc/lex.
  */
 extern FILE *yyin;
+extern int yylineno;
 int yyparse (void);
-char tempFile[] = "/tmp/ogws.conf";
+void yyrestart(FILE *);
+
+// set while the scanner reads the config files
+static bool parsing = false;
+
+/**
+ * The temporary lists are normally consumed by the time parsing
+ * completes, but a reload must not pick up anything left over.
+ */
+static void
+resetParser()
+{
+	indexFiles = NULL;
+	serverNames = NULL;
+	ports = NULL;
+	locations = NULL;
+	servers = NULL;
+	currentAccessLog = NULL;
+	currentErrorLog = NULL;
+	currentErrorPages = NULL;
+	currentRewrites = NULL;
+	currentLimitReqs = NULL;
+	currentLimitConns = NULL;
+	certFile = NULL;
+	keyFile = NULL;
+	autoIndex = 0;
+	protocol = PROTOCOL_UNSET;
+	locationClosed = false;
+	freeWords();
+}
 
 // common error exit
 void
@@ -49,23 +99,37 @@ errorExit(char *msg)
 {
 	fprintf(stderr, msg);
 	fprintf(stderr, "Bad configuration, exiting\n");
-	fprintf(stderr, "Examine the file %s to determine the error.\n", tempFile);
+	if (parsing) {
+		fprintf(stderr, "Examine the file %s near line %d to determine the error.\n",
+			currentConfigFile(), yylineno);
+	}
 	exit(1);
 }
 
 /**
- * The first step of config file processing is to recursively find all the 
- * included files and concatenate their contents into a temp file.
- *
- * Next defaults are set up for each essential component such that a bare bones
+ * With `-t`, show how long a step of loading the config took
+ */
+static void
+timePhase(const char *phase, struct timespec *start)
+{
+	if (isTestConfig()) {
+		printf("%-16s %8.3f ms\n", phase, microsSince(start) / 1000.0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/**
+ * The first step of config file processing is to set up defaults for each
+ * essential component such that a bare bones
  * config file consists simply of:
  * http {
  *    server {
  *    }
  * }
  *
- * Next, parse the contents of the expanded, concatenated config files. This
- * is done by calling the code generated by lex and yacc (flex and bison).
+ * Next, parse the config file. This is done by calling the code generated
+ * by lex and yacc (flex and bison). The scanner reads the included files
+ * where they are included, see expandIncludeFiles.c.
  *
  * The yacc code calls out to functions to process parts of the config, and 
  * these functions all start with an `f_` prefix.
@@ -76,10 +140,19 @@ errorExit(char *msg)
  * If the config is found to be valid the final step is to open all the log
  * files. There may be just a single access log and error log, or each server
  * may have its own log files.
+ *
+ * With `-t` the time each step took is shown.
  */
 void
 parseConfig() {
-	yyin = expandIncludeFiles((char *)&tempFile);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	resetParser();
+	yyin = openConfigFile();
+	// the scanner is at the end of the previous file on a reload
+	yyrestart(yyin);
+	yylineno = 1;
+	defaultLogFormats();
 	defaultAccessLog();
 	defaultErrorLog();
 	defaultPort();
@@ -88,13 +161,31 @@ parseConfig() {
 	defaultIndexFile();
 	defaultType();
 	// call the parser
+	parsing = true;
 	if (yyparse() != 0) {
 		errorExit("Config file not parsed correctly.\n");
 	}
+	parsing = false;
 	fclose(yyin);
+	if (isTestConfig()) {
+		printf("%d config files\n", getConfigFileCount());
+	}
+	timePhase("parse", &start);
 	checkConfig();
+	timePhase("check", &start);
+	buildConfigSnapshot();
+	timePhase("snapshot", &start);
+	// the error pages need the content types
+	parseMimeTypes();
+	timePhase("mime types", &start);
+	buildStaticHeaders();
+	buildErrorPages();
+	buildRewrites();
+	timePhase("responses", &start);
+	buildLimitZones();
+	timePhase("limit zones", &start);
 	openLogFiles();
-	unlink((char *)&tempFile);
+	timePhase("log files", &start);
 }
 
 /**
@@ -279,6 +370,25 @@ isUpstreamGroup(char *host)
 	return NULL;
 }
 
+/**
+ * Start a location for the directives that follow, as a copy of the
+ * default location. One that follows a `location` block gets its root
+ * from that block, in f_location().
+ */
+static _location *
+newLocation(_location *defLoc)
+{
+	_location *loc = (_location *)calloc(1, sizeof(_location));
+	memcpy(loc, defLoc, sizeof(_location));
+	if (locationClosed) {
+		loc->root = NULL;
+		locationClosed = false;
+	}
+	loc->next = locations;
+	locations = loc;
+	return loc;
+}
+
 /** 
  * Set up a `proxy_pass` to an upstream group
  */
@@ -293,7 +403,7 @@ proxyPassToUpstreamGroup(int type, char *host, _upstreams *group)
 	// if there is a pending location in addition to the default,
 	// update the pending location.
 	// set defaults
-	if (locations != defLoc) {
+	if ((locations != defLoc) && !locationClosed) {
 		locations->type |= type;
 		if (locations->group) {
 			free(locations->group);
@@ -304,10 +414,7 @@ proxyPassToUpstreamGroup(int type, char *host, _upstreams *group)
 			fprintf(stderr,"Updated upstream group %s\n", host);
 		}
 	} else {
-		_location *loc = (_location *)calloc(1, sizeof(_location));
-		memcpy(loc, defLoc, sizeof(_location));
-		loc->next = locations;
-		locations = loc;
+		_location *loc = newLocation(defLoc);
 		loc->group = group;
 		loc->type |= TYPE_UPSTREAM_GROUP;
 		if (isDebug()) {
@@ -355,7 +462,7 @@ proxyPassToHost(int type, char * host, int port)
 	// if there is a pending location in addition to the default,
 	// update the pending location.
 	// set defaults
-	if (locations != defLoc) {
+	if ((locations != defLoc) && !locationClosed) {
 		locations->type |= type;
 		if (locations->passTo) {
 			free(locations->passTo);
@@ -366,10 +473,7 @@ proxyPassToHost(int type, char * host, int port)
 			fprintf(stderr,"Updated proxy pass host %s\n", host);
 		}
 	} else {
-		_location *loc = (_location *)calloc(1, sizeof(_location));
-		memcpy(loc, defLoc, sizeof(_location));
-		loc->next = locations;
-		locations = loc;
+		_location *loc = newLocation(defLoc);
 		loc->passTo = passTo;
 		loc->type |= TYPE_PROXY_PASS;
 		if (isDebug()) {
@@ -378,6 +482,23 @@ proxyPassToHost(int type, char * host, int port)
 	}
 }
 
+/**
+ * Define the predefined log formats. `ogws` is the format used when an
+ * access log doesn't name one, `combined` is the nginx default.
+ */
+void
+defaultLogFormats()
+{
+	_log_format *f = (_log_format *)calloc(1, sizeof(_log_format));
+	f->name = "ogws";
+	f->ops = compileLogFormat("$time_record $remote_addr $request_method $status $server_name $uri $body_bytes_sent");
+	setLogFormatList(f);
+	f = (_log_format *)calloc(1, sizeof(_log_format));
+	f->name = "combined";
+	f->ops = compileLogFormat("$remote_addr - $remote_user [$time_local] \"$request\" $status $body_bytes_sent \"$http_referer\" \"$http_user_agent\"");
+	setLogFormatList(f);
+}
+
 /**
  * Define a default access log
  */
@@ -388,6 +509,7 @@ defaultAccessLog()
 	char path[] = "/var/log/ogws/access.log";
 	log->path = (char *)calloc(1, strlen(path)+1);
 	strcpy(log->path, path);
+	log->format = getLogFormat("ogws");
 	log->fd = -1;
 	log->next = NULL;
 	setAccessLog(log);
@@ -443,9 +565,11 @@ defaultLocation()
 	loc->matchType = PREFIX_MATCH;
 	loc->match = "/";
 	loc->root = "/var/www/ogws/html";
+	loc->rootFd = -1;
 	loc->tryTarget = NULL;
 	loc->passTo = NULL;	
 	loc->group = NULL;	
+	loc->expiresMode = EXPIRES_OFF;
 	loc->expires = 0;
 	loc->next = locations;
 	locations = loc;
@@ -497,6 +621,9 @@ pathAlreadyOpened(const char *path, _log_file *list)
 
 /**
  * Open all the log files (access and error)
+ *
+ * The files are closed on exec, a new binary started by an upgrade
+ * opens its own.
  */
 void
 openLogFiles()
@@ -506,13 +633,17 @@ openLogFiles()
 	while(log) {
 		log->fd = pathAlreadyOpened(log->path, getDefaultAccessLog());
 		if (log->fd == -1) {
-			log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+			log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
 		}
 		if (log->fd == -1) {
 			fprintf(stderr, "%s: ", log->path);
 			perror("can't open file");
 			errorExit("access log not valid\n");
 		}
+		pthread_mutex_init(&log->lock, NULL);
+		if (log->bufSize) {
+			log->buf = malloc(log->bufSize);
+		}
 		log = log->next;
 	}
 	// list of one or more error logs starting with the default
@@ -520,17 +651,46 @@ openLogFiles()
 	while(log) {
 		log->fd = pathAlreadyOpened(log->path, getDefaultErrorLog());
 		if (log->fd == -1) {
-			log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+			log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
 		}
 		if (log->fd == -1) {
 			fprintf(stderr, "%s: ", log->path);
 			perror("can't open file");
 			errorExit("error log not valid\n");
 		}
+		pthread_mutex_init(&log->lock, NULL);
+		// the error log is always buffered, so an error response doesn't
+		// cost a write of its own
+		log->bufSize = ERROR_LOG_BUFFER;
+		log->flush = ERROR_LOG_FLUSH;
+		log->buf = malloc(log->bufSize);
 		log = log->next;
 	}
 }
 
+/**
+ * Find the named location a `try_files` falls back to, `@name`
+ */
+void
+checkTryFiles(_server *s, _location *loc)
+{
+	_try_target *tt = loc->tryTarget;
+	while (tt->next) {
+		tt = tt->next;
+	}
+	if (tt->target[0] != '@') {
+		return;
+	}
+	for (_location *l = s->locations; l != NULL; l = l->next) {
+		if ((l->matchType == NAMED_MATCH) && (strcmp(l->match, tt->target) == 0)) {
+			tt->named = l;
+			return;
+		}
+	}
+	fprintf(stderr, "%s: ", tt->target);
+	errorExit("try_files location not found\n");
+}
+
 /**
  * Check sanity of the configuration
  */
@@ -558,6 +718,9 @@ checkDocRoots(_server *s)
 			fprintf(stderr, "%d: ", loc->type);
 			errorExit("Unknown location type\n");
 		}
+		if (loc->tryTarget) {
+			checkTryFiles(s, loc);
+		}
 	}
 }
 
@@ -579,18 +742,6 @@ f_pid(char *pidFile) {
 	}
 }
 
-// Include a file. Note: This should never be called since a pre-processing
-// step expands all the include files.
-// Syntax:	include file | mask;
-// Default:	—
-// Context:	any
-void
-f_include(char *path) {
-	if (isDebug()) {
-		fprintf(stderr, "Include file ignored %s\n", path);
-	}
-}
-
 // set the default MIME type for responses
 // Syntax:	default_type mime-type;
 // Default: default_type text/plain;
@@ -626,6 +777,222 @@ f_autoindex(int flag) {
 	return;
 }
 
+// sort the entries of a directory listing, directories first
+// Syntax:	autoindex_sort on | off;
+// Default: autoindex_sort on;
+// Context:	http, server
+// Note: not an NGINX directive. The setting applies to all servers.
+void
+f_autoindex_sort(bool flag) {
+	setAutoIndexSort(flag);
+	if (isDebug()) {
+		fprintf(stderr,"Auto index sort %s\n", flag ? "ON" : "OFF");
+	}
+}
+
+// the format of a directory listing
+// Syntax:	autoindex_format html | xml | json;
+// Default: autoindex_format html;
+// Context:	http, server
+// Note: the setting applies to all servers.
+void
+f_autoindex_format() {
+	int format;
+	if (strcmp(words->word, "html") == 0) {
+		format = AUTOINDEX_HTML;
+	} else if (strcmp(words->word, "xml") == 0) {
+		format = AUTOINDEX_XML;
+	} else if (strcmp(words->word, "json") == 0) {
+		format = AUTOINDEX_JSON;
+	} else {
+		format = -1;
+	}
+	if ((words->next != NULL) || (format < 0)) {
+		fprintf(stderr, "%s: ", words->word);
+		errorExit("invalid autoindex format\n");
+	}
+	setAutoIndexFormat(format);
+	if (isDebug()) {
+		fprintf(stderr,"Auto index format %s\n", words->word);
+	}
+	freeWords();
+}
+
+// log "file not found" errors in the error log
+// Syntax:	log_not_found on | off;
+// Default: log_not_found on;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_log_not_found(bool flag) {
+	setLogNotFound(flag);
+	if (isDebug()) {
+		if (isLogNotFound()) {
+			fprintf(stderr,"Log not found ON\n");
+		} else {
+			fprintf(stderr,"Log not found OFF\n");
+		}
+	}
+}
+
+// send a precompressed `.gz` copy of a file, if there is one, to clients
+// that accept gzip
+// Syntax:	gzip_static on | off;
+// Default: gzip_static off;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_gzip_static(bool flag) {
+	setGzipStatic(flag);
+	if (isDebug()) {
+		fprintf(stderr,"Gzip static %s\n", flag ? "ON" : "OFF");
+	}
+}
+
+// send a precompressed `.br` copy of a file, if there is one, to clients
+// that accept brotli. It is preferred to the `.gz` copy.
+// Syntax:	brotli_static on | off;
+// Default: brotli_static off;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_brotli_static(bool flag) {
+	setBrotliStatic(flag);
+	if (isDebug()) {
+		fprintf(stderr,"Brotli static %s\n", flag ? "ON" : "OFF");
+	}
+}
+
+// compress responses with gzip on the fly
+// Syntax:	gzip on | off;
+// Default: gzip off;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_gzip(bool flag) {
+	setGzip(flag);
+	if (isDebug()) {
+		fprintf(stderr,"Gzip %s\n", flag ? "ON" : "OFF");
+	}
+}
+
+// the gzip compression level, 1 to 9
+// Syntax:	gzip_comp_level level;
+// Default: gzip_comp_level 1;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_gzip_comp_level() {
+	int level = atoi(words->word);
+	if ((words->next != NULL) || !isdigit(words->word[0]) || (level < 1) || (level > 9)) {
+		fprintf(stderr, "%s: ", words->word);
+		errorExit("invalid gzip compression level\n");
+	}
+	setGzipCompLevel(level);
+	if (isDebug()) {
+		fprintf(stderr,"Gzip compression level %d\n", level);
+	}
+	freeWords();
+}
+
+// the minimum length of a response that is compressed, from its
+// Content-Length
+// Syntax:	gzip_min_length length;
+// Default: gzip_min_length 20;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_gzip_min_length() {
+	int length = sizeUnitsToBytes(words->word);
+	if ((words->next != NULL) || (length < 0)) {
+		fprintf(stderr, "%s: ", words->word);
+		errorExit("invalid gzip minimum length\n");
+	}
+	setGzipMinLength(length);
+	if (isDebug()) {
+		fprintf(stderr,"Gzip minimum length %d\n", length);
+	}
+	freeWords();
+}
+
+// the mime types compressed besides text/html, `*` for any type
+// Syntax:	gzip_types mime-type ...;
+// Default: gzip_types text/html;
+// Context:	http
+// Note: nginx also takes it in a server or a location. Here it applies
+// to all the servers, so only the http section takes it.
+void
+f_gzip_types() {
+	for (_word *w = words; w != NULL; w = w->next) {
+		_gzip_type *t = (_gzip_type *)calloc(1, sizeof(_gzip_type));
+		t->type = strdup(w->word);
+		setGzipTypeList(t);
+		if (isDebug()) {
+			fprintf(stderr,"Gzip type %s\n", t->type);
+		}
+	}
+	freeWords();
+}
+
+// memory for the compressed copies of static files kept by each worker,
+// 0 to compress a file for each request
+// Syntax:	gzip_cache_size size;
+// Default: gzip_cache_size 16m;
+// Context:	http
+// Note: not an NGINX directive.
+void
+f_gzip_cache_size() {
+	int size = sizeUnitsToBytes(words->word);
+	if ((words->next != NULL) || (size < 0)) {
+		fprintf(stderr, "%s: ", words->word);
+		errorExit("invalid gzip cache size\n");
+	}
+	setGzipCacheSize(size);
+	if (isDebug()) {
+		fprintf(stderr,"Gzip cache size %d\n", size);
+	}
+	freeWords();
+}
+
+// keep small files, with their response headers, in memory
+// Syntax:	content_cache off | max_size=size [max_file=size];
+// Default: content_cache off;
+// Context:	http
+// Note: not an NGINX directive. The size is for each worker, max_file
+// defaults to 64k.
+void
+f_content_cache() {
+	if ((strcmp(words->word, "off") == 0) && (words->next == NULL)) {
+		setContentCacheSize(0);
+		freeWords();
+		return;
+	}
+	for (_word *w = words; w != NULL; w = w->next) {
+		int size = -1;
+		if (strncmp(w->word, "max_size=", strlen("max_size=")) == 0) {
+			size = sizeUnitsToBytes(w->word + strlen("max_size="));
+			setContentCacheSize(size);
+		} else if (strncmp(w->word, "max_file=", strlen("max_file=")) == 0) {
+			size = sizeUnitsToBytes(w->word + strlen("max_file="));
+			setContentCacheMaxFile(size);
+		}
+		if (size <= 0) {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid content_cache parameter\n");
+		}
+	}
+	if (isDebug()) {
+		fprintf(stderr,"Content cache size %d, max file %d\n", getContentCacheSize(), getContentCacheMaxFile());
+	}
+	freeWords();
+}
+
 // specify if the `sendfile` system call should be used
 // Syntax:	sendfile on | off;
 // Default: sendfile off;
@@ -794,11 +1161,20 @@ f_server() {
 	} else {
 		server->errorLog = getDefaultErrorLog();
 	}
+	server->errorPages = currentErrorPages;
+	currentErrorPages = NULL;
+	server->rewrites = currentRewrites;
+	currentRewrites = NULL;
+	server->limitReqs = currentLimitReqs;
+	currentLimitReqs = NULL;
+	server->limitConns = currentLimitConns;
+	currentLimitConns = NULL;
 		
 	// reset defaults
 	autoIndex = 0;
 	certFile = NULL;
 	keyFile = NULL;
+	locationClosed = false;
 	return;
 }
 
@@ -843,7 +1219,7 @@ f_root(char *root) {
 	}
 	// if there is a pending location in addition to the default,
 	// update the pending location.
-	if (locations != defLoc) {
+	if ((locations != defLoc) && !locationClosed) {
 		locations->type |= TYPE_DOC_ROOT;
 		if (locations->root) {
 			free(locations->root);
@@ -854,10 +1230,7 @@ f_root(char *root) {
 			fprintf(stderr,"Updated Document root path %s\n", locations->root);
 		}
 	} else {
-		_location *loc = (_location *)calloc(1, sizeof(_location));
-		memcpy(loc, defLoc, sizeof(_location));
-		loc->next = locations;
-		locations = loc;
+		_location *loc = newLocation(defLoc);
 		loc->root = root;
 		loc->type |= TYPE_DOC_ROOT;
 		if (isDebug()) {
@@ -867,46 +1240,104 @@ f_root(char *root) {
 	return;
 }
 
+/**
+ * The location being parsed. A location is created by the first of its
+ * directives, as a copy of the default location.
+ */
+static _location *
+pendingLocation()
+{
+	_location *defLoc = locations;
+	// get the default location
+	while (defLoc->next) {
+		defLoc = defLoc->next;
+	}
+	if ((locations != defLoc) && !locationClosed) {
+		return locations;
+	}
+	return newLocation(defLoc);
+}
+
 // expires directive
 // Syntax:	expires [modified] time;
 //          expires epoch | max | off;
 // Default: expires off;
 // Context:	http, server, location, if in location
-void
-f_expires(char *expires) {
-	if (!locations) {
-		fprintf(stderr, "Expires directive with no Location, ignored\n");
-		free(expires);
-		return;
-	}
-	if (strncmp(expires, "off", 3) == 0) {
-		locations->expires = 0;
+// Note: only supported in a location. A negative time means the response
+// must not be cached.
+void
+f_expires() {
+	_location *loc = pendingLocation();
+	_word *w = words;
+	loc->expiresMode = EXPIRES_ACCESS;
+	if ((strcmp(w->word, "modified") == 0) && w->next) {
+		loc->expiresMode = EXPIRES_MODIFIED;
+		w = w->next;
+	}
+	if (w->next) {
+		fprintf(stderr, "%s: ", w->next->word);
+		errorExit("too many expires parameters\n");
+	}
+	if (strcmp(w->word, "off") == 0) {
+		loc->expiresMode = EXPIRES_OFF;
+	} else if (strcmp(w->word, "epoch") == 0) {
+		loc->expiresMode = EXPIRES_EPOCH;
+	} else if (strcmp(w->word, "max") == 0) {
+		loc->expiresMode = EXPIRES_MAX;
 	} else {
-		// format [0-9]+ or [0-9]+[hms]
-		int len = strlen(expires);
-		int c = expires[len-1];
-		if (isdigit(c)) {
-			locations->expires = atoi(expires);
-		} else {
-			int mult = 1;
-			if (c == 'm') {
-				mult *= 60;
-			} else if (c == 'h') {
-				mult *= 60*60;
-			} else {
-				fprintf(stderr, "Unknown unit, ignored\n");
-			}
-			expires[len-1] = '\0';
-			locations->expires = atoi(expires) * mult;
+		bool negative = (w->word[0] == '-');
+		int seconds = timeUnitsToSeconds(w->word + (negative ? 1 : 0));
+		if (seconds < 0) {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid expires time\n");
 		}
+		loc->expires = negative ? -seconds : seconds;
 	}
 	if (isDebug()) {
-		fprintf(stderr,"Expires directive %d\n", locations->expires);
+		fprintf(stderr,"Expires directive mode %d %d\n", loc->expiresMode, loc->expires);
 	}
-	free(expires);
+	freeWords();
 	return;
 }
 
+// add a response header
+// Syntax:	add_header name value [always];
+// Default: —
+// Context:	http, server, location, if in location
+// Note: only supported in a location, and `always` is ignored, the header
+// is added to 200 and 304 responses. A Cache-Control or Expires header
+// replaces the one from the `expires` directive.
+void
+f_add_header() {
+	_location *loc = pendingLocation();
+	_word *w = words;
+	if (w->next == NULL) {
+		fprintf(stderr, "%s: ", w->word);
+		errorExit("add_header needs a name and a value\n");
+	}
+	if (w->next->next) {
+		fprintf(stderr, "Add header parameter %s ignored\n", w->next->next->word);
+	}
+	_header *h = (_header *)calloc(1, sizeof(_header));
+	h->name = strdup(w->word);
+	h->value = strdup(w->next->word);
+	// keep the order of the directives
+	_header **p = &loc->addHeaders;
+	while (*p) {
+		p = &(*p)->next;
+	}
+	*p = h;
+	if (strcasecmp(h->name, "Expires") == 0) {
+		loc->addsExpires = true;
+	} else if (strcasecmp(h->name, "Cache-Control") == 0) {
+		loc->addsCacheControl = true;
+	}
+	if (isDebug()) {
+		fprintf(stderr,"Add header %s: %s\n", h->name, h->value);
+	}
+	freeWords();
+}
+
 // check for a duplicate server name
 int dupName(char *name) {
 	_server_name *sn = serverNames;
@@ -1000,27 +1431,157 @@ f_error_log(char *path) {
 //           access_log off;
 // Default: access_log logs/access.log combined;
 // Context:	http, server, location, if in location, limit_except
+// Note: `gzip`, `if` and `off` are not supported. The format must be
+// defined before it is used.
 void
-f_access_log(char *path, int type) {
+f_access_log() {
 	if (currentAccessLog) {
 		fprintf(stderr, "More than one access log defined for a server, not allowed\n");
 		exit(1);
 	}
 	_log_file *log = (_log_file *)calloc(1, sizeof(_log_file));
-	log->path = path;
-	log->type = type;
+	log->path = strdup(words->word);
 	log->fd = -1;
+	for (_word *w = words->next; w != NULL; w = w->next) {
+		if (strncmp(w->word, "buffer=", strlen("buffer=")) == 0) {
+			int size = sizeUnitsToBytes(w->word + strlen("buffer="));
+			if (size <= 0) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("invalid access log buffer size\n");
+			}
+			log->bufSize = size;
+		} else if (strncmp(w->word, "flush=", strlen("flush=")) == 0) {
+			log->flush = timeUnitsToSeconds(w->word + strlen("flush="));
+			if (log->flush <= 0) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("invalid access log flush time\n");
+			}
+		} else if (strchr(w->word, '=') == NULL && (w == words->next)) {
+			log->format = getLogFormat(w->word);
+			if (log->format == NULL) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("unknown log format\n");
+			}
+		} else {
+			fprintf(stderr, "Access log parameter %s ignored\n", w->word);
+		}
+	}
+	if (log->format == NULL) {
+		log->format = getLogFormat("ogws");
+	}
+	// as in nginx, a flush time without a buffer size uses the default
+	if (log->flush && !log->bufSize) {
+		log->bufSize = DEFAULT_LOG_BUFFER;
+	}
+	freeWords();
 	setAccessLog(log);
 	if (isDebug()) {
-		fprintf(stderr,"Access log file path %s\n", log->path);
-	}
-	if (type) {
-		fprintf(stderr, "Access log MAIN ignored\n");
+		fprintf(stderr,"Access log file path %s buffer %zu flush %d\n", log->path, log->bufSize, log->flush);
 	}
 	currentAccessLog = log;
 	return;
 }
 
+// log record format, compiled once here
+// Syntax:	log_format name [escape=default|json|none] string ...;
+// Default: log_format combined "...";
+// Context:	http
+// Note: `escape` is not supported, values from the client are always
+// escaped the default way.
+void
+f_log_format() {
+	_word *w = words;
+	if (w->next == NULL) {
+		errorExit("log_format needs a name and a format\n");
+	}
+	if (getLogFormat(w->word)) {
+		fprintf(stderr, "%s: ", w->word);
+		errorExit("duplicate log format\n");
+	}
+	_log_format *f = (_log_format *)calloc(1, sizeof(_log_format));
+	f->name = strdup(w->word);
+	w = w->next;
+	if (strncmp(w->word, "escape=", strlen("escape=")) == 0) {
+		fprintf(stderr, "Log format parameter %s ignored\n", w->word);
+		w = w->next;
+	}
+	// the strings are joined
+	size_t len = 1;
+	for (_word *p = w; p != NULL; p = p->next) {
+		len += strlen(p->word);
+	}
+	char *template = calloc(1, len);
+	for (; w != NULL; w = w->next) {
+		strcat(template, w->word);
+	}
+	f->ops = compileLogFormat(template);
+	free(template);
+	freeWords();
+	setLogFormatList(f);
+	if (isDebug()) {
+		fprintf(stderr, "Log format %s\n", f->name);
+	}
+}
+
+// page sent for an error status code, read into memory when the config
+// is loaded
+// Syntax:	error_page code ... [=[response]] uri;
+// Default: —
+// Context:	http, server, location, if in location
+// Note: the uri is a file in the server's document root, redirects and
+// named locations are not supported. Not allowed in a location.
+void
+f_error_page(bool http) {
+	_word *uri = words;
+	while (uri->next) {
+		uri = uri->next;
+	}
+	if ((uri == words) || (uri->word[0] != '/')) {
+		fprintf(stderr, "%s: ", uri->word);
+		errorExit("error_page needs a status code and a page starting with /\n");
+	}
+	int status = 0;
+	for (_word *w = words; w != uri; w = w->next) {
+		if (w->word[0] == '=') {
+			status = atoi(w->word + 1);
+			if ((status < 200) || (status > 599)) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("invalid error_page response code\n");
+			}
+			continue;
+		}
+		int code = atoi(w->word);
+		if ((code < 300) || (code > 599)) {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid error_page status code\n");
+		}
+		_error_page *page = (_error_page *)calloc(1, sizeof(_error_page));
+		page->code = code;
+		page->uri = strdup(uri->word);
+		if (http) {
+			setErrorPageList(page);
+		} else {
+			// keep the order of the directives
+			_error_page **p = &currentErrorPages;
+			while (*p) {
+				p = &(*p)->next;
+			}
+			*p = page;
+		}
+		if (isDebug()) {
+			fprintf(stderr, "Error page %d %s\n", code, page->uri);
+		}
+	}
+	// `=response` applies to all the codes of the directive
+	_error_page *list = http ? getErrorPageList() : currentErrorPages;
+	for (_error_page *p = list; p != NULL; p = p->next) {
+		if (p->status == 0) {
+			p->status = status ? status : p->code;
+		}
+	}
+	freeWords();
+}
+
 // SSL parameter for DHE ciphers
 // Syntax:	ssl_dhparam file;
 // Default:	—
@@ -1305,7 +1866,7 @@ f_tls() {
 // Context:	server, location
 void
 f_location(int matchType, char *match) {
-	_location *loc = locations;
+	_location *loc = pendingLocation();
 	loc->matchType = matchType;
 	loc->match = match;
 	loc->protocol = protocol;
@@ -1316,6 +1877,7 @@ f_location(int matchType, char *match) {
 		loc->root = loc->next->root;
 	}
 	protocol = PROTOCOL_UNSET;
+	locationClosed = true;
 	return;
 }
 
@@ -1344,22 +1906,241 @@ f_upstream(char *host, int port, int weight) {
 	}
 }
 
-// this is a sub-directive of the `try_files` directive
+/**
+ * Add a `rewrite` or `return` to the server, or to the location being
+ * parsed, after the ones before it
+ */
+static void
+addRewrite(bool server, _rewrite *rw)
+{
+	_rewrite **p = server ? &currentRewrites : &pendingLocation()->rewrites;
+	while (*p) {
+		p = &(*p)->next;
+	}
+	*p = rw;
+}
+
+// rewrite directive
+// Syntax:	rewrite regex replacement [flag];
+// Default:	—
+// Context:	server, location, if
+// Note: the regex is a POSIX extended regex, and `if` is not supported.
+void
+f_rewrite(bool server) {
+	int n = 0;
+	for (_word *w = words; w != NULL; w = w->next) {
+		n++;
+	}
+	if ((n < 2) || (n > 3)) {
+		errorExit("rewrite needs a regex, a replacement and an optional flag\n");
+	}
+	_word *w = words;
+	addRewrite(server, compileRewrite(w->word, w->next->word,
+		(n == 3) ? w->next->next->word : NULL));
+	freeWords();
+	if (isDebug()) {
+		fprintf(stderr,"Rewrite in %s\n", server ? "server" : "location");
+	}
+}
+
+// return directive
+// Syntax:	return code [text];
+//          return code URL;
+//          return URL;
+// Default:	—
+// Context:	server, location, if
 void
-f_try_target(char *target) {
-	_try_target *tt = calloc(1, sizeof(_try_target));
-	_try_target *prev = tryTargets;
-	if (prev == NULL) {
-		tryTargets = tt;
-		tt->next = NULL;
+f_return(bool server) {
+	if ((words == NULL) || (words->next && words->next->next)) {
+		errorExit("return needs a code, or a URL, and an optional text\n");
+	}
+	addRewrite(server, compileReturn(words->word, words->next ? words->next->word : NULL));
+	freeWords();
+	if (isDebug()) {
+		fprintf(stderr,"Return in %s\n", server ? "server" : "location");
+	}
+}
+
+// shared memory zone for `limit_req`
+// Syntax:	limit_req_zone key zone=name:size rate=rate [sync];
+// Default:	—
+// Context:	http
+// Note: `sync` is ignored. A key longer than 64 bytes is cut.
+void
+f_limit_req_zone() {
+	_limit_zone *zone = (_limit_zone *)calloc(1, sizeof(_limit_zone));
+	zone->type = LIMIT_ZONE_REQ;
+	zone->key = strdup(words->word);
+	zone->ops = compileTemplate(zone->key, "limit_req_zone");
+	for (_word *w = words->next; w != NULL; w = w->next) {
+		if (strncmp(w->word, "zone=", strlen("zone=")) == 0) {
+			char *name = w->word + strlen("zone=");
+			char *size = strchr(name, ':');
+			if (size == NULL) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("limit_req_zone needs a zone name and size\n");
+			}
+			zone->name = strndup(name, size - name);
+			int bytes = sizeUnitsToBytes(size + 1);
+			zone->size = (bytes > 0) ? bytes : 0;
+		} else if (strncmp(w->word, "rate=", strlen("rate=")) == 0) {
+			char *unit = strstr(w->word, "r/");
+			int n = atoi(w->word + strlen("rate="));
+			if (unit && (strcmp(unit, "r/s") == 0)) {
+				zone->rate = n * 1000L;
+			} else if (unit && (strcmp(unit, "r/m") == 0)) {
+				zone->rate = n * 1000L / 60;
+			}
+		} else if (strcmp(w->word, "sync") != 0) {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid limit_req_zone parameter\n");
+		}
+	}
+	if ((zone->name == NULL) || (zone->size == 0)) {
+		errorExit("limit_req_zone needs a zone name and size\n");
+	}
+	if (zone->rate <= 0) {
+		fprintf(stderr, "%s: ", zone->name);
+		errorExit("limit_req_zone needs a rate in r/s or r/m\n");
+	}
+	for (_limit_zone *z = getLimitZoneList(); z != NULL; z = z->next) {
+		if (strcmp(z->name, zone->name) == 0) {
+			fprintf(stderr, "%s: ", zone->name);
+			errorExit("duplicate zone\n");
+		}
+	}
+	setLimitZoneList(zone);
+	freeWords();
+	if (isDebug()) {
+		fprintf(stderr,"Limit req zone %s %s, %zu bytes, rate %ld/1000 per second\n",
+			zone->name, zone->key, zone->size, zone->rate);
+	}
+}
+
+// shared memory zone for `limit_conn`
+// Syntax:	limit_conn_zone key zone=name:size;
+// Default:	—
+// Context:	http
+// Note: the key may only have $remote_addr, $binary_remote_addr and
+// $server_name, the connections are counted when they are accepted.
+void
+f_limit_conn_zone() {
+	_limit_zone *zone = (_limit_zone *)calloc(1, sizeof(_limit_zone));
+	zone->type = LIMIT_ZONE_CONN;
+	zone->key = strdup(words->word);
+	zone->ops = compileTemplate(zone->key, "limit_conn_zone");
+	if (!isConnectionTemplate(zone->ops)) {
+		fprintf(stderr, "%s: ", zone->key);
+		errorExit("limit_conn_zone key may only use the client address and server name\n");
+	}
+	_word *w = words->next;
+	if ((w == NULL) || (w->next != NULL) || (strncmp(w->word, "zone=", strlen("zone=")) != 0)
+			|| (strchr(w->word, ':') == NULL)) {
+		errorExit("limit_conn_zone needs a zone name and size\n");
+	}
+	char *name = w->word + strlen("zone=");
+	char *size = strchr(name, ':');
+	zone->name = strndup(name, size - name);
+	int bytes = sizeUnitsToBytes(size + 1);
+	if (bytes <= 0) {
+		fprintf(stderr, "%s: ", w->word);
+		errorExit("invalid limit_conn_zone size\n");
+	}
+	zone->size = bytes;
+	for (_limit_zone *z = getLimitZoneList(); z != NULL; z = z->next) {
+		if (strcmp(z->name, zone->name) == 0) {
+			fprintf(stderr, "%s: ", zone->name);
+			errorExit("duplicate zone\n");
+		}
+	}
+	setLimitZoneList(zone);
+	freeWords();
+	if (isDebug()) {
+		fprintf(stderr,"Limit conn zone %s %s, %zu bytes\n", zone->name, zone->key, zone->size);
+	}
+}
+
+// limit the connections for a key of a zone
+// Syntax:	limit_conn zone number;
+// Default:	—
+// Context:	http, server, location
+// Note: not allowed in a location, the limit applies to the connections
+// accepted for the server, before a request is read.
+void
+f_limit_conn(bool http) {
+	if ((words == NULL) || (words->next == NULL) || (words->next->next != NULL)) {
+		errorExit("limit_conn needs a zone and a number\n");
+	}
+	_limit_conn *lc = (_limit_conn *)calloc(1, sizeof(_limit_conn));
+	lc->zoneName = strdup(words->word);
+	lc->limit = atoi(words->next->word);
+	if (lc->limit <= 0) {
+		fprintf(stderr, "%s: ", words->next->word);
+		errorExit("invalid limit_conn number\n");
+	}
+	freeWords();
+	if (http) {
+		setLimitConnList(lc);
 	} else {
-		while(prev->next) {
-			prev = prev->next;
+		_limit_conn **p = &currentLimitConns;
+		while (*p) {
+			p = &(*p)->next;
+		}
+		*p = lc;
+	}
+	if (isDebug()) {
+		fprintf(stderr,"Limit conn zone %s to %d\n", lc->zoneName, lc->limit);
+	}
+}
+
+// limit the rate of requests with a zone
+// Syntax:	limit_req zone=name [burst=number] [nodelay | delay=number];
+// Default:	—
+// Context:	http, server, location
+// Note: a request over the burst gets 429. The zone is found when the
+// config has been parsed, see buildLimitZones().
+void
+f_limit_req(int context) {
+	_limit_req *lr = (_limit_req *)calloc(1, sizeof(_limit_req));
+	bool nodelay = false;
+	for (_word *w = words; w != NULL; w = w->next) {
+		if (strncmp(w->word, "zone=", strlen("zone=")) == 0) {
+			lr->zoneName = strdup(w->word + strlen("zone="));
+		} else if (strncmp(w->word, "burst=", strlen("burst=")) == 0) {
+			lr->burst = atoi(w->word + strlen("burst=")) * 1000L;
+		} else if (strncmp(w->word, "delay=", strlen("delay=")) == 0) {
+			lr->delay = atoi(w->word + strlen("delay=")) * 1000L;
+		} else if (strcmp(w->word, "nodelay") == 0) {
+			nodelay = true;
+		} else {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid limit_req parameter\n");
+		}
+	}
+	if (lr->zoneName == NULL) {
+		errorExit("limit_req needs a zone\n");
+	}
+	if ((lr->burst < 0) || (lr->delay < 0)) {
+		errorExit("invalid limit_req burst or delay\n");
+	}
+	if (nodelay) {
+		lr->delay = lr->burst;
+	}
+	freeWords();
+
+	if (context == CONTEXT_HTTP) {
+		setLimitReqList(lr);
+	} else {
+		// keep the order of the directives
+		_limit_req **p = (context == CONTEXT_SERVER) ? &currentLimitReqs : &pendingLocation()->limitReqs;
+		while (*p) {
+			p = &(*p)->next;
 		}
-		prev->next = tt;
-		tt->next = NULL;
+		*p = lr;
+	}
+	if (isDebug()) {
+		fprintf(stderr,"Limit req zone %s burst %ld delay %ld\n", lr->zoneName, lr->burst, lr->delay);
 	}
-	tt->target = target;
 }
 
 // try_files directive
@@ -1367,8 +2148,37 @@ f_try_target(char *target) {
 //          try_files file ... =code;
 // Default:	—
 // Context:	server, location
+// Note: the last parameter may also be a named location, `@name`.
 void
 f_try_files() {
+	_try_target *tryTargets = NULL;
+	_try_target *last = NULL;
+	for (_word *w = words; w != NULL; w = w->next) {
+		_try_target *tt = (_try_target *)calloc(1, sizeof(_try_target));
+		tt->target = strdup(w->word);
+		if ((w->next == NULL) && (w->word[0] == '=')) {
+			tt->code = atoi(w->word + 1);
+			if (!isdigit(w->word[1]) || (tt->code < 100) || (tt->code > 599)) {
+				fprintf(stderr, "%s: ", w->word);
+				errorExit("invalid try_files code\n");
+			}
+		} else if ((w->next == NULL) && (w->word[0] == '@')) {
+			// resolved when the config is checked
+		} else {
+			tt->ops = compileTemplate(w->word, "try_files");
+			tt->dir = (w->word[strlen(w->word)-1] == '/');
+		}
+		if (last) {
+			last->next = tt;
+		} else {
+			tryTargets = tt;
+		}
+		last = tt;
+	}
+	if ((tryTargets == NULL) || (tryTargets->next == NULL)) {
+		errorExit("try_files needs a file and a fallback\n");
+	}
+	freeWords();
 	_location *defLoc = locations;
 	// get the default location
 	while (defLoc->next) {
@@ -1377,23 +2187,18 @@ f_try_files() {
 	// if there is a pending location in addition to the default,
 	// update the pending location.
 	// set defaults
-	if (locations != defLoc) {
+	if ((locations != defLoc) && !locationClosed) {
 		locations->type |= TYPE_TRY_FILES;
 		locations->matchType = UNSET_MATCH;
 		locations->tryTarget = tryTargets;
-		tryTargets = NULL;
 		if (isDebug()) {
 			fprintf(stderr,"Updated try files\n");
 		}
 	} else {
-		_location *loc = (_location *)calloc(1, sizeof(_location));
-		memcpy(loc, defLoc, sizeof(_location));
-		loc->next = locations;
-		locations = loc;
+		_location *loc = newLocation(defLoc);
 		loc->type |= TYPE_TRY_FILES;
 		loc->matchType = UNSET_MATCH;
 		loc->tryTarget = tryTargets;
-		tryTargets = NULL;
 		if (isDebug()) {
 			fprintf(stderr,"New try files\n");
 		}
@@ -1537,6 +2342,155 @@ f_workerConnections(int workerConnections) {
 	}
 }
 
+// open file limit of the workers
+// Syntax:	worker_rlimit_nofile number;
+// Default:	—
+// Context:	main
+void
+f_worker_rlimit_nofile(int limit) {
+	if (limit <= 0) {
+		errorExit("worker_rlimit_nofile must be a positive number\n");
+	}
+	setWorkerRlimitNofile(limit);
+	if (isDebug()) {
+		fprintf(stderr,"Worker open file limit %d\n", getWorkerRlimitNofile());
+	}
+}
+
+// this collects the arguments of directives which use free-form words
+void
+f_word(char *word) {
+	_word *w = (_word *)calloc(1, sizeof(_word));
+	w->word = word;
+	w->next = NULL;
+	if (words == NULL) {
+		words = w;
+	} else {
+		_word *prev = words;
+		while(prev->next) {
+			prev = prev->next;
+		}
+		prev->next = w;
+	}
+}
+
+// release the collected arguments once a directive has consumed them
+void
+freeWords() {
+	while(words) {
+		_word *w = words;
+		words = w->next;
+		free(w->word);
+		free(w);
+	}
+}
+
+// bind worker processes to CPUs
+// Syntax:	worker_cpu_affinity cpumask ...;
+//          worker_cpu_affinity auto [cpumask];
+// Default: —
+// Context:	main
+void
+f_worker_cpu_affinity() {
+	_word *w = words;
+	if (strcmp(w->word, "auto") == 0) {
+		setCpuAffinityAuto(true);
+		w = w->next;
+		if (w && w->next) {
+			errorExit("worker_cpu_affinity auto takes at most one mask\n");
+		}
+	}
+	for (; w != NULL; w = w->next) {
+		if (strspn(w->word, "01") != strlen(w->word)) {
+			fprintf(stderr, "%s: ", w->word);
+			errorExit("invalid CPU mask\n");
+		}
+		_cpu_mask *m = (_cpu_mask *)calloc(1, sizeof(_cpu_mask));
+		m->mask = strdup(w->word);
+		setCpuMaskList(m);
+		if (isDebug()) {
+			fprintf(stderr, "Worker CPU mask %s\n", m->mask);
+		}
+	}
+	freeWords();
+}
+
+// Convert a size with an optional k or m suffix to bytes.
+// Returns: bytes, or -1 if the suffix isn't a size unit
+static int
+sizeUnitsToBytes(char *units) {
+	int mult;
+	switch(tolower(units[strlen(units)-1])) {
+		case 'k':
+			mult = 1024;
+			break;
+		case 'm':
+			mult = 1024*1024;
+			break;
+		default:
+			if (!isdigit(units[strlen(units)-1])) {
+				return -1;
+			}
+			mult = 1;
+	}
+	return atoi(units) * mult;
+}
+
+// Convert a time with an optional unit suffix to seconds.
+// Returns: seconds, or -1 if the unit isn't a time unit
+static int
+timeUnitsToSeconds(char *units) {
+	int mult;
+	switch(units[strlen(units)-1]) {
+		case 's':
+			mult = 1;
+			break;
+		case 'm':
+			mult = 60;
+			break;
+		case 'h':
+			mult = 60*60;
+			break;
+		case 'd':
+			mult = 24*60*60;
+			break;
+		case 'w':
+			mult = 7*24*60*60;
+			break;
+		case 'y':
+			mult = 365*24*60*60;
+			break;
+		default:
+			if (!isdigit(units[strlen(units)-1])) {
+				return -1;
+			}
+			mult = 1;
+	}
+	return atoi(units) * mult;
+}
+
+// time allowed for a graceful shutdown of the worker processes
+// Syntax:	worker_shutdown_timeout time;
+// Default: worker_shutdown_timeout 30s;
+// Context:	main
+void
+f_worker_shutdown_timeout(char *units) {
+	int val = timeUnitsToSeconds(units);
+	if (val < 0) {
+		fprintf(stderr, "%s: ", units);
+		errorExit("invalid worker_shutdown_timeout\n");
+	}
+	f_worker_shutdown_timeout_num(val);
+}
+// the parameter is passed as an integer rather than with a UNITS suffix
+void
+f_worker_shutdown_timeout_num(int val) {
+	setWorkerShutdownTimeout(val);
+	if (isDebug()) {
+		fprintf(stderr, "Worker shutdown timeout: %d\n", val);
+	}
+}
+
 // config file parsed successfully
 void
 f_config_complete() {
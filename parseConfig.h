@@ -1,7 +1,12 @@
 // config parser functions
 // which correspond to yacc parser actions.
+
+// the context of a directive allowed in several
+#define CONTEXT_HTTP 0
+#define CONTEXT_SERVER 1
+#define CONTEXT_LOCATION 2
+
 void f_pid(char *);
-void f_include(char *);
 void f_trace(bool);
 void f_autoindex(int);
 void f_sendfile(bool);
@@ -10,12 +15,32 @@ void f_user(char *, char *);
 void f_server();
 void f_http();
 void f_root(char *);
-void f_expires(char *);
+void f_expires();
+void f_add_header();
 void f_server_name(char *, int);
 void f_server_tokens(bool);
 void f_indexFile(char *);
 void f_error_log(char *);
-void f_access_log(char *, int);
+void f_access_log();
+void f_log_format();
+void f_error_page(bool);
+void f_rewrite(bool);
+void f_return(bool);
+void f_limit_req_zone();
+void f_limit_req(int);
+void f_limit_conn_zone();
+void f_limit_conn(bool);
+void f_log_not_found(bool);
+void f_gzip_static(bool);
+void f_brotli_static(bool);
+void f_gzip(bool);
+void f_gzip_comp_level();
+void f_gzip_min_length();
+void f_gzip_types();
+void f_gzip_cache_size();
+void f_content_cache();
+void f_autoindex_sort(bool);
+void f_autoindex_format();
 void f_ssl_certificate(char *);
 void f_ssl_certificate_key(char *);
 void f_ssl_session_cache(char *, char *);
@@ -34,7 +59,6 @@ void f_upstreams(char *);
 void f_upstream(char *, int, int);
 void f_default_type(char *);
 void f_try_files();
-void f_try_target(char *);
 void f_proxy_pass(char *, int);
 void f_protocol(char *);
 void f_fastcgi_pass(char *, int);
@@ -45,9 +69,17 @@ void f_fastcgi_split_path_info(char *);
 void f_keepalive_timeout(int);
 void f_workerProcesses(int);
 void f_workerConnections(int);
+void f_worker_rlimit_nofile(int);
+void f_worker_cpu_affinity();
+void f_worker_shutdown_timeout(char *);
+void f_worker_shutdown_timeout_num(int);
+void f_word(char *);
 void f_events();
 void f_config_complete();
 // utility functions for config file parsing
+void errorExit(char *);
+void defaultLogFormats();
+void freeWords();
 void defaultAccessLog();
 void defaultErrorLog();
 void defaultPort();
@@ -18,6 +18,7 @@
  *
  * (c) Tom Lang 2/2023
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -171,6 +172,9 @@ saveMimeType(char *extension, char *mimeType)
 	buff = malloc(strlen(extension)+1);
 	strcpy(buff, extension);
 	mt->extension = buff;
+
+	mt->headerLen = asprintf(&mt->header, "Content-Type: %s\r\n", mimeType);
+	mt->gzip = isGzipType(mimeType, strlen(mimeType));
 	return;
 }
 
@@ -0,0 +1,248 @@
+/**
+ * Serve precompressed copies of static files, `gzip_static` and
+ * `brotli_static`.
+ *
+ * When the client accepts the encoding and there is a `.br` or `.gz` file
+ * next to the requested one, at least as new as it, the compressed file is
+ * sent instead, with `sendfile` like any other file.
+ *
+ * Which copies exist is remembered for a while for each file, so a request
+ * doesn't cost two more `stat` calls. An entry is used only while the
+ * original file has the same inode, size and modification time.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "serverlist.h"
+#include "server.h"
+
+#define VARIANT_CACHE_SIZE 256
+// a compressed copy added later is noticed after this many seconds
+#define VARIANT_CACHE_VALID 60
+
+#define VARIANT_BR 0
+#define VARIANT_GZ 1
+
+static const struct {
+	const char *suffix;
+	const char *encoding;
+} variants[] = {
+	{".br", "br"},
+	{".gz", "gzip"},
+};
+
+typedef struct {
+	char *path;
+	time_t checked;
+	// the original file
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	// the compressed copies, st_nlink is 0 if there isn't one
+	struct stat variant[2];
+} _variant_entry;
+
+// shared by the threads of the TLS server
+static pthread_mutex_t variantLock = PTHREAD_MUTEX_INITIALIZER;
+static _variant_entry variantCache[VARIANT_CACHE_SIZE];
+
+static unsigned long
+hashPath(const char *s)
+{
+	unsigned long h = 5381;
+	while (*s) {
+		h = h * 33 + (unsigned char)*s++;
+	}
+	return h;
+}
+
+/**
+ * Check if the client accepts an encoding, it is in the Accept-Encoding
+ * header and not refused with `q=0`
+ */
+bool
+acceptsEncoding(_request *req, const char *encoding)
+{
+	int len;
+	const char *v = getRequestHeader(req, "Accept-Encoding", strlen("Accept-Encoding"), &len);
+	if (v == NULL) {
+		return false;
+	}
+	const char *end = v + len;
+	int encLen = strlen(encoding);
+	const char *p = v;
+	while (p < end) {
+		while ((p < end) && ((*p == ' ') || (*p == ','))) {
+			p++;
+		}
+		const char *token = p;
+		while ((p < end) && (*p != ',') && (*p != ';') && (*p != ' ')) {
+			p++;
+		}
+		bool match = ((p - token) == encLen) && (strncasecmp(token, encoding, encLen) == 0);
+		// parameters, only q matters
+		bool refused = false;
+		while ((p < end) && (*p != ',')) {
+			if ((*p == 'q') && (p + 1 < end) && (p[1] == '=')) {
+				const char *q = p + 2;
+				refused = true;
+				while ((q < end) && (*q != ',')) {
+					if ((*q >= '1') && (*q <= '9')) {
+						refused = false;
+					}
+					q++;
+				}
+			}
+			p++;
+		}
+		if (match) {
+			return !refused;
+		}
+	}
+	return false;
+}
+
+/**
+ * The compressed copies of a file found recently, while the file is
+ * unchanged
+ * Returns: true if they are known
+ */
+static bool
+cachedVariants(_request *req, struct stat *variant)
+{
+	bool found = false;
+	pthread_mutex_lock(&variantLock);
+	_variant_entry *e = &variantCache[hashPath(req->fullPath) % VARIANT_CACHE_SIZE];
+	if (e->path && (strcmp(e->path, req->fullPath) == 0)
+			&& (e->ino == req->st.st_ino) && (e->size == req->st.st_size)
+			&& (e->mtime == req->st.st_mtime) && (time(NULL) - e->checked < VARIANT_CACHE_VALID)) {
+		memcpy(variant, e->variant, sizeof(e->variant));
+		found = true;
+	}
+	pthread_mutex_unlock(&variantLock);
+	return found;
+}
+
+static void
+cacheVariants(_request *req, struct stat *variant)
+{
+	pthread_mutex_lock(&variantLock);
+	_variant_entry *e = &variantCache[hashPath(req->fullPath) % VARIANT_CACHE_SIZE];
+	if ((e->path == NULL) || (strcmp(e->path, req->fullPath) != 0)) {
+		free(e->path);
+		e->path = strdup(req->fullPath);
+	}
+	e->checked = time(NULL);
+	e->ino = req->st.st_ino;
+	e->size = req->st.st_size;
+	e->mtime = req->st.st_mtime;
+	memcpy(e->variant, variant, sizeof(e->variant));
+	pthread_mutex_unlock(&variantLock);
+}
+
+/**
+ * Look for the compressed copies of a file again on the next request,
+ * one of them is gone
+ */
+static void
+forgetVariants(_request *req)
+{
+	pthread_mutex_lock(&variantLock);
+	_variant_entry *e = &variantCache[hashPath(req->fullPath) % VARIANT_CACHE_SIZE];
+	if (e->path && (strcmp(e->path, req->fullPath) == 0)) {
+		e->checked = 0;
+	}
+	pthread_mutex_unlock(&variantLock);
+}
+
+/**
+ * Find the compressed copies of a file, from the cache or the file system
+ */
+static void
+lookupVariants(_request *req, struct stat *variant)
+{
+	if (cachedVariants(req, variant)) {
+		return;
+	}
+	char path[BUFF_SIZE];
+	for (int i = VARIANT_BR; i <= VARIANT_GZ; i++) {
+		memset(&variant[i], 0, sizeof(struct stat));
+		if ((i == VARIANT_BR) ? !isBrotliStatic() : !isGzipStatic()) {
+			continue;
+		}
+		snprintf(path, BUFF_SIZE, "%s%s", relativePath(req), variants[i].suffix);
+		struct stat st;
+		int fd = openUnderRoot(req->loc, path, O_PATH);
+		if (fd < 0) {
+			continue;
+		}
+		if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_mtime >= req->st.st_mtime)) {
+			variant[i] = st;
+		}
+		close(fd);
+	}
+	cacheVariants(req, variant);
+}
+
+/**
+ * Find a compressed copy of the file requested, if the client accepts it,
+ * and set the encoding of the request. The copy is served as a file of its
+ * own: its stat data gives the Content-Length, ETag and Last-Modified.
+ * Returns: `O_PATH` file descriptor of the compressed copy, -1 if there is
+ * none
+ */
+int
+openPrecompressed(_request *req)
+{
+	if (!isGzipStatic() && !isBrotliStatic()) {
+		return -1;
+	}
+	int len;
+	if (getRequestHeader(req, "Accept-Encoding", strlen("Accept-Encoding"), &len) == NULL) {
+		return -1;
+	}
+	struct stat variant[2];
+	lookupVariants(req, variant);
+	for (int i = VARIANT_BR; i <= VARIANT_GZ; i++) {
+		if ((variant[i].st_nlink == 0) || !acceptsEncoding(req, variants[i].encoding)) {
+			continue;
+		}
+		char path[BUFF_SIZE];
+		snprintf(path, BUFF_SIZE, "%s%s", relativePath(req), variants[i].suffix);
+		int fd = openUnderRoot(req->loc, path, O_PATH);
+		if (fd < 0) {
+			// removed since it was cached
+			forgetVariants(req);
+			continue;
+		}
+		req->encoding = variants[i].encoding;
+		return fd;
+	}
+	return -1;
+}
+
+/**
+ * Add the Content-Encoding of a compressed copy, and Vary whenever a
+ * compressed copy could have been chosen, so caches keep them apart
+ */
+void
+addContentEncoding(_response *r, _request *req)
+{
+	if (req->encoding) {
+		addHeader(r, "Content-Encoding: %s\r\n", req->encoding);
+	}
+	if (isGzipStatic() || isBrotliStatic() || isGzip()) {
+		addHeader(r, "Vary: Accept-Encoding\r\n");
+	}
+}
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
@@ -15,6 +16,8 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <time.h>
+#include <limits.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include "serverlist.h"
@@ -27,6 +30,12 @@ int verbIs(char *, char *);
 void
 processInput(_request *req)
 {
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	req->upstreamTime = -1;
+	req->encoding = NULL;
+	req->cacheable = false;
+	req->localFd = -1;
+	req->redirects = 0;
 	req->path = NULL;
 	req->queryString = NULL;
 	char *host = NULL;
@@ -120,6 +129,10 @@ processInput(_request *req)
 			sendErrorResponse(req, 404, "Bad request", "No server for this host");
 			return;
 		}
+		// the server's `rewrite` and `return` come before the location
+		if (req->server->rewrites && rewriteServer(req)) {
+			return;
+		}
 		req->loc = getDocRoot(req->server, req->path);
 		if (!req->loc || !req->loc->root) {
 			doDebug("No doc root.");
@@ -127,10 +140,9 @@ processInput(_request *req)
 			return;
 		}
 
-		// todo: disallow ../ in the path
-		int size = strlen(req->loc->root) + strlen(req->path);
-		const int maxLen = 255;
-		if (size > maxLen) {
+		// the path is resolved under the root, see resolvePath.c
+		const int maxLen = PATH_MAX - 1;
+		if (strlen(req->path) > (size_t)maxLen) {
 			doDebug("URI too long");
 			char truncated[maxLen+5];
 			strncpy(truncated, req->path, maxLen);
@@ -140,35 +152,111 @@ processInput(_request *req)
 			return;
 		}
 
-		// check for try_files
-		if (req->loc->type & TYPE_TRY_FILES) {
-			handleTryFiles(req);
-			return;
-		}
+		routeRequest(req);
+	}
+	return;
+}
 
-		//
-		// check for proxy_pass 
-		//
-		if (req->loc->type & (TYPE_PROXY_PASS)) {
-			handleProxyPass(req);
-			return;
-		}
+/**
+ * Hand the request to the handler for its location. Also used for the
+ * internal redirects of `try_files`.
+ */
+void
+routeRequest(_request *req)
+{
+	// `rewrite` and `return`, which may choose another location
+	if (req->loc->rewrites && rewriteLocation(req)) {
+		return;
+	}
 
-		//
-		// check for fastcgi_pass 
-		//
-		if (req->loc->type & (TYPE_FASTCGI_PASS)) {
-			handleFastCGIPass(req);
+	// `limit_req`, which may delay the request
+	if (!req->limited) {
+		long delay = limitRequest(req);
+		if (delay < 0) {
 			return;
 		}
+		if (delay > 0) {
+			if (!req->ssl) {
+				// the worker resumes it, see server.c
+				clock_gettime(CLOCK_MONOTONIC, &req->resumeAt);
+				req->resumeAt.tv_sec += delay / 1000;
+				req->resumeAt.tv_nsec += (delay % 1000) * 1000000;
+				if (req->resumeAt.tv_nsec >= 1000000000) {
+					req->resumeAt.tv_sec++;
+					req->resumeAt.tv_nsec -= 1000000000;
+				}
+				return;
+			}
+			// a TLS request has its own thread
+			struct timespec wait = {delay / 1000, (delay % 1000) * 1000000};
+			nanosleep(&wait, NULL);
+		}
+	}
+	handleRequest(req);
+}
+
+/**
+ * Run the handler of the request's location
+ */
+void
+handleRequest(_request *req)
+{
+	// check for try_files
+	if (req->loc->type & TYPE_TRY_FILES) {
+		handleTryFiles(req);
+		return;
+	}
 
-		if (verbIs(verb, "GET") || verbIs(verb, "HEAD")) {
-			handleGetVerb(req);
-		} else {
-			sendErrorResponse(req, 405, "Method Not Allowed", verb);
+	//
+	// check for proxy_pass 
+	//
+	if (req->loc->type & (TYPE_PROXY_PASS)) {
+		handleProxyPass(req);
+		return;
+	}
+
+	//
+	// check for fastcgi_pass 
+	//
+	if (req->loc->type & (TYPE_FASTCGI_PASS)) {
+		handleFastCGIPass(req);
+		return;
+	}
+
+	if (verbIs(req->verb, "GET") || verbIs(req->verb, "HEAD")) {
+		handleGetVerb(req);
+	} else {
+		sendErrorResponse(req, 405, "Method Not Allowed", req->verb);
+	}
+}
+
+/**
+ * Find a request header by name, ignoring case
+ * Returns: the value, which isn't terminated, NULL if the request doesn't
+ * have the header
+ */
+const char *
+getRequestHeader(_request *req, const char *name, int nameLen, int *len)
+{
+	if (req->headers == NULL) {
+		return NULL;
+	}
+	// skip the request line
+	const char *line = strstr(req->headers, "\r\n");
+	while (line && (line[2] != '\r') && (line[2] != '\0')) {
+		line += 2;
+		const char *eol = strstr(line, "\r\n");
+		if ((strncasecmp(line, name, nameLen) == 0) && (line[nameLen] == ':')) {
+			const char *v = line + nameLen + 1;
+			while (*v == ' ') {
+				v++;
+			}
+			*len = eol ? eol - v : (int)strlen(v);
+			return v;
 		}
+		line = eol;
 	}
-	return;
+	return NULL;
 }
 
 int
@@ -185,19 +273,6 @@ verbIs(char *verb, char *compare)
 /**
  * Find the server information based on the hostname
  */
-int
-hasPort(int portNum, _server *server)
-{
-	_port *p = server->ports;
-	while(p) {
-		if (p->portNum == portNum) {
-			return 1;
-		}
-		p = p->next;
-	}
-	return 0;
-}
-
 _server *
 getServerForHost(char *host)
 {
@@ -208,18 +283,9 @@ getServerForHost(char *host)
 		portNum = atoi(p+1);
 		*p = '\0';
 	} 
-	size_t hostLen = strlen(host);
-	while(server != NULL) {
-		_server_name *sn = server->serverNames;
-		while(sn != NULL) {
-			if ((hostLen == strlen(sn->serverName)) 
-					&& (strcmp(host, sn->serverName) == 0)
-					&& (hasPort(portNum, server))) {
-				return server;
-			}
-			sn = sn->next;
-		}
-		server = server->next;
+	server = lookupServer(portNum, host, strlen(host));
+	if (server) {
+		return server;
 	}
 	// no explicit matches, use the default
 	// unless default server is disabled
@@ -0,0 +1,172 @@
+/**
+ * Resolve the path of a request to a file under the document root.
+ *
+ * Each worker opens the root directory of its locations once, when it
+ * starts. A request path is percent-decoded and normalized in one pass,
+ * with `.` and `..` segments and repeated slashes taken out, and a path
+ * that climbs above the root is refused. The file is then opened relative
+ * to the root with `openat2(RESOLVE_BENEATH)`, so the kernel doesn't walk
+ * the root's own path again, and a symbolic link can't lead out of it.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include "serverlist.h"
+#include "server.h"
+
+/**
+ * Open the document roots of the locations of all the servers, since a
+ * worker serves every virtual host on its port and the default server.
+ * Called by each worker, the descriptors are not shared with the master.
+ */
+void
+openDocRoots()
+{
+	for (_server *server = getServerList(); server != NULL; server = server->next) {
+		for (_location *loc = server->locations; loc != NULL; loc = loc->next) {
+			if ((loc->root == NULL) || (loc->rootFd >= 0)) {
+				continue;
+			}
+			loc->rootFd = open(loc->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+			if ((loc->rootFd < 0) && isDebug()) {
+				fprintf(stderr, "%s: document root open failed: %s\n", loc->root, strerror(errno));
+			}
+		}
+	}
+}
+
+static int
+hexValue(int c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/**
+ * Percent-decode a request path and make it relative to the document
+ * root. A trailing slash is kept, so only a directory matches it.
+ * Returns: the length of the relative path, -1 if the path is invalid,
+ * too long or above the root
+ */
+int
+normalizePath(const char *path, char *out, size_t size)
+{
+	size_t len = 0;		// of the output
+	size_t seg = 0;		// where the current segment starts
+	for (const char *p = path; ; p++) {
+		int c = (unsigned char)*p;
+		if (c == '%') {
+			if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2])) {
+				return -1;
+			}
+			c = hexValue((unsigned char)p[1]) * 16 + hexValue((unsigned char)p[2]);
+			if (c == '\0') {
+				return -1;
+			}
+			p += 2;
+		}
+		if ((c != '/') && (c != '\0')) {
+			if (len + 2 >= size) {
+				return -1;
+			}
+			out[len++] = c;
+			continue;
+		}
+		// the end of a segment
+		size_t segLen = len - seg;
+		if ((segLen == 1) && (out[seg] == '.')) {
+			len = seg;
+		} else if ((segLen == 2) && (out[seg] == '.') && (out[seg+1] == '.')) {
+			if (seg == 0) {
+				return -1;
+			}
+			// back over the slash and the segment before it
+			len = seg - 1;
+			while ((len > 0) && (out[len-1] != '/')) {
+				len--;
+			}
+		} else if ((segLen > 0) && (c == '/')) {
+			out[len++] = '/';
+		}
+		seg = len;
+		if (c == '\0') {
+			break;
+		}
+	}
+	if (len == 0) {
+		out[len++] = '.';
+	}
+	out[len] = '\0';
+	return len;
+}
+
+/**
+ * Open a path relative to a directory, without leaving the directory
+ * Returns: the file descriptor, -1 on error with errno set
+ */
+int
+openBeneath(int dirFd, const char *path, int flags)
+{
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags | O_CLOEXEC;
+	how.resolve = RESOLVE_BENEATH;
+	int fd = syscall(SYS_openat2, dirFd, path, &how, sizeof(how));
+	if ((fd < 0) && (errno == ENOSYS)) {
+		// a kernel before 5.6, the path has no `..` in it at least
+		fd = openat(dirFd, path, flags | O_CLOEXEC);
+	}
+	return fd;
+}
+
+/**
+ * Open a path relative to the document root of a location. A root that
+ * couldn't be opened when the worker started is tried again.
+ * Returns: the file descriptor, -1 on error with errno set
+ */
+int
+openUnderRoot(_location *loc, const char *path, int flags)
+{
+	if (loc->rootFd >= 0) {
+		return openBeneath(loc->rootFd, path, flags);
+	}
+	int rootFd = open(loc->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (rootFd < 0) {
+		return -1;
+	}
+	int fd = openBeneath(rootFd, path, flags);
+	int e = errno;
+	close(rootFd);
+	errno = e;
+	return fd;
+}
+
+/**
+ * Open a file found with `O_PATH` for reading. It is opened through /proc,
+ * so it is the same file even if its path has changed since.
+ * Returns: the file descriptor, -1 on error with errno set
+ */
+int
+reopenFile(int fd, int flags)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, flags | O_CLOEXEC);
+}
+
+/**
+ * The path of the file being served, relative to the document root
+ */
+const char *
+relativePath(_request *req)
+{
+	return req->fullPath + strlen(req->loc->root) + 1;
+}
@@ -0,0 +1,316 @@
+/**
+ * Build and send HTTP response headers.
+ *
+ * The headers that don't change from one response to the next, like
+ * `Server` and `Content-Type`, are formatted once when the config is
+ * loaded, along with the `add_header` and `expires` headers of each
+ * location. A response is a list of pieces, the status line, these prebuilt
+ * blocks and the few headers that are formatted per request, which is
+ * sent with a single `sendmsg` together with a short body.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+/**
+ * Exit if a header of `more` bytes doesn't fit after `len` bytes of a
+ * location's header block
+ */
+static void
+checkHeaderRoom(int len, size_t more)
+{
+	if (len + more >= BUFF_SIZE) {
+		errorExit("add_header block too long\n");
+	}
+}
+
+/**
+ * The static headers for the responses from a location: the Server
+ * header, the ones from `add_header` and the parts of the `expires`
+ * headers that don't depend on the time.
+ */
+static void
+buildLocationHeaders(_location *loc, const char *server)
+{
+	char buffer[BUFF_SIZE];
+	int len = snprintf(buffer, BUFF_SIZE, "%s", server);
+	for (_header *h = loc->addHeaders; h != NULL; h = h->next) {
+		checkHeaderRoom(len, strlen(h->name) + strlen(h->value) + 4);
+		len += snprintf(buffer + len, BUFF_SIZE - len, "%s: %s\r\n", h->name, h->value);
+	}
+	const char *expires = NULL;
+	const char *cacheControl = NULL;
+	char maxAge[48];
+	switch (loc->expiresMode) {
+		case EXPIRES_ACCESS:
+			if (loc->expires < 0) {
+				cacheControl = "Cache-Control: no-cache\r\n";
+			} else {
+				snprintf(maxAge, sizeof(maxAge), "Cache-Control: max-age=%d\r\n", loc->expires);
+				cacheControl = maxAge;
+			}
+			break;
+		case EXPIRES_EPOCH:
+			expires = "Expires: Thu, 01 Jan 1970 00:00:01 GMT\r\n";
+			cacheControl = "Cache-Control: no-cache\r\n";
+			break;
+		case EXPIRES_MAX:
+			expires = "Expires: Thu, 31 Dec 2037 23:55:55 GMT\r\n";
+			cacheControl = "Cache-Control: max-age=315360000\r\n";
+			break;
+	}
+	if (expires && !loc->addsExpires) {
+		checkHeaderRoom(len, strlen(expires));
+		len += snprintf(buffer + len, BUFF_SIZE - len, "%s", expires);
+	}
+	if (cacheControl && !loc->addsCacheControl) {
+		checkHeaderRoom(len, strlen(cacheControl));
+		len += snprintf(buffer + len, BUFF_SIZE - len, "%s", cacheControl);
+	}
+	loc->headers = strndup(buffer, len);
+	loc->headersLen = len;
+}
+
+/**
+ * Format the static header blocks for the servers and their locations.
+ * Called when the config file has been parsed.
+ */
+void
+buildStaticHeaders()
+{
+	char buffer[BUFF_SIZE];
+	int len;
+	if (isServerTokensOn()) {
+		len = snprintf(buffer, BUFF_SIZE, "Server: ogws/%s\r\n", getVersion());
+	} else {
+		len = snprintf(buffer, BUFF_SIZE, "Server: ogws\r\n");
+	}
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		s->headers = strndup(buffer, len);
+		s->headersLen = len;
+		for (_location *loc = s->locations; loc != NULL; loc = loc->next) {
+			if (loc->headers != NULL) {
+				continue;	// shared with another server
+			}
+			buildLocationHeaders(loc, buffer);
+		}
+	}
+}
+
+/**
+ * Add the `expires` headers that depend on the time, the Expires date and,
+ * for `expires modified`, the max-age.
+ */
+void
+addExpires(_response *r, _location *loc, time_t modified)
+{
+	time_t expires;
+	switch (loc->expiresMode) {
+		case EXPIRES_ACCESS:
+			if (!loc->addsExpires) {
+				addHeader(r, "Expires: %s\r\n", getHttpDate(time(NULL) + loc->expires));
+			}
+			break;
+		case EXPIRES_MODIFIED:
+			expires = modified + loc->expires;
+			if (!loc->addsExpires) {
+				addHeader(r, "Expires: %s\r\n", getHttpDate(expires));
+			}
+			if (!loc->addsCacheControl) {
+				long maxAge = expires - time(NULL);
+				if (maxAge <= 0) {
+					addHeader(r, "Cache-Control: no-cache\r\n");
+				} else {
+					addHeader(r, "Cache-Control: max-age=%ld\r\n", maxAge);
+				}
+			}
+			break;
+	}
+}
+
+/**
+ * Start a response with the status line and the Date header
+ */
+void
+startResponse(_response *r, int code, const char *reason)
+{
+	r->iovcnt = 0;
+	r->used = 0;
+	r->body = NULL;
+	r->bodyLen = 0;
+	addHeader(r, "HTTP/1.1 %d %s\r\nDate: %s\r\n", code, reason, getTimestamp(RESPONSE_FORMAT));
+}
+
+/**
+ * Add a prebuilt block of headers. The text isn't copied.
+ */
+void
+addHeaderBlock(_response *r, const char *text, int len)
+{
+	if ((len <= 0) || (r->iovcnt >= RESPONSE_IOV - 2)) {
+		return;
+	}
+	r->iov[r->iovcnt].iov_base = (void *)text;
+	r->iov[r->iovcnt].iov_len = len;
+	r->iovcnt++;
+}
+
+/**
+ * Add a header formatted for this response
+ */
+void
+addHeader(_response *r, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int room = sizeof(r->buf) - r->used;
+	int len = vsnprintf(r->buf + r->used, room, format, ap);
+	va_end(ap);
+	if (len >= room) {
+		doDebug("Response headers too long");
+		return;
+	}
+	// merge with the previous piece when they are adjacent
+	if ((r->iovcnt > 0) && (r->iov[r->iovcnt-1].iov_base == r->buf + r->used - r->iov[r->iovcnt-1].iov_len)) {
+		r->iov[r->iovcnt-1].iov_len += len;
+	} else {
+		addHeaderBlock(r, r->buf + r->used, len);
+	}
+	r->used += len;
+}
+
+/**
+ * A body that is sent in the same call as the headers
+ */
+void
+setResponseBody(_response *r, const char *body, size_t len)
+{
+	r->body = body;
+	r->bodyLen = len;
+}
+
+/**
+ * Set TCP_CORK, when `tcp_nopush` is on, so the headers and a body sent
+ * with `sendfile` go out in full packets
+ */
+void
+corkClient(_request *req, bool cork)
+{
+	if ((req->ssl == NULL) && isTcpNoPush() && isSendFile()) {
+		int on = cork ? 1 : 0;
+		setsockopt(req->clientFd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+	}
+}
+
+/**
+ * Send part of a body. With chunked transfer encoding the data is framed
+ * as one chunk, and a length of 0 sends the last chunk. The frame goes out
+ * in one write, so it isn't held back by Nagle's algorithm.
+ * Returns: number of bytes sent, -1 on error
+ */
+int
+sendChunk(_request *req, const char *data, size_t len, bool chunked)
+{
+	if (!chunked) {
+		return (len > 0) ? sendToClient(req, data, len) : 0;
+	}
+	char *frame = malloc(len + 24);
+	int n = sprintf(frame, "%zx\r\n", len);
+	if (len > 0) {
+		memcpy(frame + n, data, len);
+		n += len;
+	}
+	memcpy(frame + n, "\r\n", 2);
+	n += 2;
+	int sent = sendToClient(req, frame, n);
+	free(frame);
+	return sent;
+}
+
+/**
+ * Send the headers, and the body if set. When `more` is true the rest of
+ * the body follows, and the kernel is told to wait for it.
+ * Returns: number of bytes sent, -1 on error
+ */
+int
+sendResponse(_request *req, _response *r, bool more)
+{
+	struct iovec *iov = r->iov;
+	int iovcnt = r->iovcnt;
+	iov[iovcnt].iov_base = "\r\n";
+	iov[iovcnt].iov_len = 2;
+	iovcnt++;
+	if (r->bodyLen > 0) {
+		iov[iovcnt].iov_base = (void *)r->body;
+		iov[iovcnt].iov_len = r->bodyLen;
+		iovcnt++;
+	}
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+
+	if (req->ssl) {
+		// a single TLS record
+		char *p = malloc(total);
+		char *q = p;
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(q, iov[i].iov_base, iov[i].iov_len);
+			q += iov[i].iov_len;
+		}
+		int sent = sendToClient(req, p, total);
+		free(p);
+		return sent;
+	}
+
+	if (isTrace()) {
+		for (int i = 0; i < iovcnt; i++) {
+			doTrace('S', iov[i].iov_base, iov[i].iov_len);
+		}
+	}
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+	size_t left = total;
+	while (left > 0) {
+		ssize_t n = sendmsg(req->clientFd, &msg, flags);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Send to socket %d failed: %m\n", req->clientFd);
+			return -1;
+		}
+		req->bytesSent += n;
+		left -= n;
+		// skip past what was sent
+		while ((n > 0) && ((size_t)n >= msg.msg_iov->iov_len)) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (n > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return total;
+}
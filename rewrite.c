@@ -0,0 +1,422 @@
+/**
+ * The `rewrite` and `return` directives.
+ *
+ * Example directives:
+ * 		server {
+ * 			rewrite ^/old/(.*)$ /new/$1 permanent;
+ * 			location /shop {
+ * 				rewrite ^/shop/item/([0-9]+)$ /item.php?id=$1 last;
+ * 				return 301 https://$host$request_uri;
+ * 			}
+ * 		}
+ *
+ * 	The regexes are compiled and the replacements are compiled like the
+ * 	`log_format` templates, when the config file is loaded. An anchored
+ * 	regex that starts with literal text, such as `^/old/`, is only run on
+ * 	a URI that starts with the same text, so a long list of rules for a
+ * 	migration costs a string compare per rule for most requests. A
+ * 	`return` without variables is a prebuilt response, like the error
+ * 	pages.
+ *
+ * 	The directives of the server run before the location is found, then
+ * 	those of the location, in the order they are written. After `last`, or
+ * 	a `rewrite` without a flag, the location of the new URI is found again.
+ * 	`break` carries on in the current location. `redirect`, `permanent`,
+ * 	and a replacement starting with `http://`, `https://` or `$scheme`,
+ * 	send the new URI to the client.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <regex.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+// the whole match and $1 to $9
+#define MAX_GROUPS 10
+
+// how running the directives of a server or location ended
+#define RUN_CONTINUE 0
+#define RUN_LAST 1
+#define RUN_BREAK 2
+#define RUN_SENT 3
+
+static bool
+isRedirectUri(const char *text)
+{
+	return (strncmp(text, "http://", 7) == 0)
+		|| (strncmp(text, "https://", 8) == 0)
+		|| (strncmp(text, "$scheme", 7) == 0);
+}
+
+static bool
+isRedirectCode(int code)
+{
+	return (code == 301) || (code == 302) || (code == 303)
+		|| (code == 307) || (code == 308);
+}
+
+/**
+ * The literal text an anchored regex starts with. Nothing is taken from
+ * a regex with alternatives, where the anchor may not apply to all of them.
+ */
+static void
+setPrefix(_rewrite *rw, const char *pattern)
+{
+	if ((pattern[0] != '^') || strchr(pattern, '|')) {
+		return;
+	}
+	const char *p = pattern + 1;
+	int len = 0;
+	while (p[len] && !strchr(".[]()*+?{}|\\^$", p[len])) {
+		len++;
+	}
+	// the character before a `*`, `?` or `{0,` may not be there
+	if ((len > 0) && p[len] && strchr("*?{", p[len])) {
+		len--;
+	}
+	if (len > 0) {
+		rw->prefix = strndup(p, len);
+		rw->prefixLen = len;
+	}
+}
+
+/**
+ * Compile a `rewrite` directive
+ * Returns: the compiled directive
+ */
+_rewrite *
+compileRewrite(const char *pattern, const char *replacement, const char *flag)
+{
+	_rewrite *rw = (_rewrite *)calloc(1, sizeof(_rewrite));
+	rw->type = REWRITE_URI;
+	int ret = regcomp(&rw->regex, pattern, REG_EXTENDED);
+	if (ret) {
+		char msgbuf[100];
+		regerror(ret, &rw->regex, msgbuf, sizeof(msgbuf));
+		fprintf(stderr, "%s: %s\n", pattern, msgbuf);
+		errorExit("invalid rewrite regex\n");
+	}
+	setPrefix(rw, pattern);
+
+	if (flag == NULL) {
+		rw->flag = REWRITE_NEXT;
+	} else if (strcmp(flag, "last") == 0) {
+		rw->flag = REWRITE_LAST;
+	} else if (strcmp(flag, "break") == 0) {
+		rw->flag = REWRITE_BREAK;
+	} else if (strcmp(flag, "redirect") == 0) {
+		rw->flag = REWRITE_REDIRECT;
+		rw->code = 302;
+	} else if (strcmp(flag, "permanent") == 0) {
+		rw->flag = REWRITE_PERMANENT;
+		rw->code = 301;
+	} else {
+		fprintf(stderr, "%s: ", flag);
+		errorExit("invalid rewrite flag\n");
+	}
+	if ((rw->code == 0) && isRedirectUri(replacement)) {
+		rw->code = 302;
+	}
+
+	// a `?` at the end drops the query string of the request
+	rw->text = strdup(replacement);
+	int len = strlen(rw->text);
+	rw->keepArgs = true;
+	if ((len > 0) && (rw->text[len-1] == '?')) {
+		rw->text[len-1] = '\0';
+		rw->keepArgs = false;
+	}
+	rw->ops = compileTemplate(rw->text, "rewrite");
+	return rw;
+}
+
+/**
+ * Compile a `return` directive. With one parameter it is either the code
+ * or a URL to redirect to.
+ * Returns: the compiled directive
+ */
+_rewrite *
+compileReturn(const char *code, const char *text)
+{
+	_rewrite *rw = (_rewrite *)calloc(1, sizeof(_rewrite));
+	rw->type = REWRITE_RETURN;
+	if ((text == NULL) && !isdigit(code[0])) {
+		if (!isRedirectUri(code)) {
+			fprintf(stderr, "%s: ", code);
+			errorExit("return needs a code or a URL\n");
+		}
+		text = code;
+		rw->code = 302;
+	} else {
+		for (const char *c = code; *c; c++) {
+			if (!isdigit(*c)) {
+				fprintf(stderr, "%s: ", code);
+				errorExit("invalid return code\n");
+			}
+		}
+		rw->code = atoi(code);
+		if ((rw->code < 100) || (rw->code > 599)) {
+			fprintf(stderr, "%s: ", code);
+			errorExit("invalid return code\n");
+		}
+	}
+	if (text) {
+		rw->text = strdup(text);
+		rw->ops = compileTemplate(rw->text, "return");
+	}
+	return rw;
+}
+
+/**
+ * Prebuild the response of a `return` that has no variables
+ */
+static void
+buildReturn(_rewrite *rw)
+{
+	if ((rw->type != REWRITE_RETURN) || rw->headers
+			|| (rw->text && strchr(rw->text, '$'))) {
+		return;
+	}
+	_error_page *page = getBuiltinPage(rw->code);
+	if (isRedirectCode(rw->code) && page) {
+		if (rw->text) {
+			rw->headersLen = asprintf(&rw->headers, "Location: %s\r\n%.*s", rw->text, page->headersLen, page->headers);
+		} else {
+			rw->headersLen = asprintf(&rw->headers, "%.*s", page->headersLen, page->headers);
+		}
+		rw->body = page->body;
+		rw->bodyLen = page->bodyLen;
+	} else if (rw->text) {
+		int len;
+		const char *contentType = getDefaultTypeHeader(&len);
+		rw->body = rw->text;
+		rw->bodyLen = strlen(rw->text);
+		rw->headersLen = asprintf(&rw->headers, "%.*sContent-Length: %d\r\n", len, contentType, rw->bodyLen);
+	} else if (rw->code < 400) {
+		rw->headersLen = asprintf(&rw->headers, "Content-Length: 0\r\n");
+	}
+	// an error code by itself is sent like any other error, with the
+	// server's `error_page`
+}
+
+/**
+ * Prebuild the `return` responses. Called when the error pages have been
+ * rendered.
+ */
+void
+buildRewrites()
+{
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		for (_rewrite *rw = s->rewrites; rw != NULL; rw = rw->next) {
+			buildReturn(rw);
+		}
+		for (_location *loc = s->locations; loc != NULL; loc = loc->next) {
+			for (_rewrite *rw = loc->rewrites; rw != NULL; rw = rw->next) {
+				buildReturn(rw);
+			}
+		}
+	}
+}
+
+/**
+ * Send a response, with a Location header if `location` isn't NULL
+ */
+static void
+respond(_request *req, int code, const char *location, const char *headers, int headersLen, const char *body, size_t bodyLen)
+{
+	_response r;
+	char *header = NULL;
+	startResponse(&r, code, reasonPhrase(code, "OK"));
+	addHeaderBlock(&r, req->server->headers, req->server->headersLen);
+	if (location) {
+		// may be longer than the room for formatted headers
+		int len = asprintf(&header, "Location: %s\r\n", location);
+		if (len < 0) {
+			sendErrorResponse(req, 500, "Internal Server Error", req->path);
+			return;
+		}
+		addHeaderBlock(&r, header, len);
+	}
+	addHeaderBlock(&r, headers, headersLen);
+	setResponseBody(&r, body, bodyLen);
+	if (req->verb && (strcmp(req->verb, "HEAD") == 0)) {
+		setResponseBody(&r, NULL, 0);
+	}
+	sendResponse(req, &r, false);
+	free(header);
+	accessLog(req, code, bodyLen);
+}
+
+/**
+ * Send the response of a `return`
+ */
+static void
+sendReturn(_request *req, _rewrite *rw)
+{
+	if (rw->headers) {
+		respond(req, rw->code, NULL, rw->headers, rw->headersLen, rw->body, rw->bodyLen);
+		return;
+	}
+	if (rw->text == NULL) {
+		sendErrorResponse(req, rw->code, (char *)reasonPhrase(rw->code, "Error"), req->path);
+		return;
+	}
+	char text[PATH_MAX];
+	if (expandVariables(rw->ops, req, text, PATH_MAX) < 0) {
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		return;
+	}
+	_error_page *page = getBuiltinPage(rw->code);
+	if (isRedirectCode(rw->code) && page) {
+		respond(req, rw->code, text, page->headers, page->headersLen, page->body, page->bodyLen);
+	} else {
+		int len;
+		const char *contentType = getDefaultTypeHeader(&len);
+		char headers[BUFF_SIZE];
+		int headersLen = snprintf(headers, BUFF_SIZE, "%.*sContent-Length: %zu\r\n", len, contentType, strlen(text));
+		respond(req, rw->code, NULL, headers, headersLen, text, strlen(text));
+	}
+}
+
+/**
+ * Send a redirect to the URI from a `rewrite`, with the query string of
+ * the request unless the replacement ended with `?`
+ */
+static void
+sendRedirect(_request *req, _rewrite *rw, const char *uri)
+{
+	_error_page *page = getBuiltinPage(rw->code);
+	if (rw->keepArgs && req->queryString) {
+		char *location;
+		if (asprintf(&location, "%s%c%s", uri, strchr(uri, '?') ? '&' : '?', req->queryString) < 0) {
+			sendErrorResponse(req, 500, "Internal Server Error", req->path);
+			return;
+		}
+		respond(req, rw->code, location, page->headers, page->headersLen, page->body, page->bodyLen);
+		free(location);
+	} else {
+		respond(req, rw->code, uri, page->headers, page->headersLen, page->body, page->bodyLen);
+	}
+}
+
+/**
+ * Change the URI of the request. The query string of a replacement comes
+ * before the one of the request.
+ */
+static void
+setUri(_request *req, char *uri, bool keepArgs)
+{
+	char *args = strchr(uri, '?');
+	if (args) {
+		*args++ = '\0';
+	}
+	free(req->path);
+	req->path = strdup(uri);
+	char *queryString = NULL;
+	if (args && *args && keepArgs && req->queryString) {
+		if (asprintf(&queryString, "%s&%s", args, req->queryString) < 0) {
+			queryString = NULL;
+		}
+	} else if (args && *args) {
+		queryString = strdup(args);
+	} else if (keepArgs && req->queryString) {
+		queryString = strdup(req->queryString);
+	}
+	free(req->queryString);
+	req->queryString = queryString;
+}
+
+/**
+ * Run the directives of a server or a location
+ * Returns: RUN_SENT if the request was answered, or how the last
+ * directive that applied ended
+ */
+static int
+runRewrites(_request *req, _rewrite *list, bool *changed)
+{
+	for (_rewrite *rw = list; rw != NULL; rw = rw->next) {
+		if (rw->type == REWRITE_RETURN) {
+			sendReturn(req, rw);
+			return RUN_SENT;
+		}
+		if (rw->prefix && (strncmp(req->path, rw->prefix, rw->prefixLen) != 0)) {
+			continue;
+		}
+		regmatch_t match[MAX_GROUPS];
+		if (regexec(&rw->regex, req->path, MAX_GROUPS, match, 0) != 0) {
+			continue;
+		}
+		char uri[PATH_MAX];
+		if (expandMatch(rw->ops, req, req->path, match, uri, PATH_MAX) < 0) {
+			sendErrorResponse(req, 500, "Internal Server Error", req->path);
+			return RUN_SENT;
+		}
+		if (rw->code) {
+			sendRedirect(req, rw, uri);
+			return RUN_SENT;
+		}
+		setUri(req, uri, rw->keepArgs);
+		*changed = true;
+		if (rw->flag == REWRITE_LAST) {
+			return RUN_LAST;
+		}
+		if (rw->flag == REWRITE_BREAK) {
+			return RUN_BREAK;
+		}
+	}
+	return RUN_CONTINUE;
+}
+
+/**
+ * Run the directives of the server, before its location is found
+ * Returns: true if the request was answered
+ */
+bool
+rewriteServer(_request *req)
+{
+	bool changed = false;
+	return runRewrites(req, req->server->rewrites, &changed) == RUN_SENT;
+}
+
+/**
+ * Run the directives of the location. When the URI changes, other than
+ * with `break`, the location is found again and its directives run.
+ * Returns: true if the request was answered
+ */
+bool
+rewriteLocation(_request *req)
+{
+	for (;;) {
+		bool changed = false;
+		int result = runRewrites(req, req->loc->rewrites, &changed);
+		if (result == RUN_SENT) {
+			return true;
+		}
+		if ((result == RUN_BREAK) || !changed) {
+			return false;
+		}
+		if (++req->redirects > MAX_REDIRECTS) {
+			sendErrorResponse(req, 500, "Internal Server Error", req->path);
+			doDebug("rewrite cycle");
+			return true;
+		}
+		req->loc = getDocRoot(req->server, req->path);
+		if (!req->loc || !req->loc->root) {
+			doDebug("No doc root.");
+			sendErrorResponse(req, 500, "Bad configuration", "No doc root");
+			return true;
+		}
+		if (req->loc->rewrites == NULL) {
+			return false;
+		}
+	}
+}
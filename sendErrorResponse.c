@@ -1,8 +1,14 @@
 /**
  * Send an HTTP error response to a bad HTTP request
  *
+ * The error pages are rendered when the config file is loaded, the built
+ * in ones for the common status codes and the ones named by `error_page`
+ * directives, which are read into memory. Sending an error is then just
+ * the status line and two header blocks in front of a ready-made body.
+ *
  * (c) Tom Lang 2/2023
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,44 +17,233 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include "serverlist.h"
 #include "server.h"
+#include "parseConfig.h"
 
-void
-sendErrorResponse( _request *req, int code, char *msg, char *path )
-{
-	doDebug(msg);
-	char buffer1[BUFF_SIZE];
-	const char *responseBody = 
+static const char *responseBody =
 "<html>\r\n"
 "<head><title>%d %s</title></head>\r\n"
+"<body>\r\n"
 "<center><h1>%d %s</h1></center>\r\n"
 "</body>\r\n"
 "</html>\r\n";
 
-	int sz1 = snprintf(buffer1, BUFF_SIZE, responseBody, code, msg, code, msg);
+static const struct {
+	int code;
+	const char *reason;
+} reasons[] = {
+	{301, "Moved Permanently"},
+	{302, "Moved Temporarily"},
+	{303, "See Other"},
+	{307, "Temporary Redirect"},
+	{308, "Permanent Redirect"},
+	{400, "Bad Request"},
+	{403, "Forbidden"},
+	{404, "Not Found"},
+	{405, "Method Not Allowed"},
+	{408, "Request Timeout"},
+	{410, "Gone"},
+	{413, "Request Entity Too Large"},
+	{414, "Request-URI Too Large"},
+	{416, "Requested Range Not Satisfiable"},
+	{429, "Too Many Requests"},
+	{500, "Internal Server Error"},
+	{501, "Not Implemented"},
+	{502, "Bad Gateway"},
+	{503, "Service Temporarily Unavailable"},
+	{504, "Gateway Time-out"},
+	{0, NULL}
+};
+
+// the built in pages, one for each of the reasons above, the redirects
+// included
+static _error_page *builtinPages = NULL;
+
+/**
+ * The reason phrase for a status code, or the given text if the code
+ * isn't one of the common ones
+ */
+const char *
+reasonPhrase(int code, const char *msg)
+{
+	for (int i = 0; reasons[i].code; i++) {
+		if (reasons[i].code == code) {
+			return reasons[i].reason;
+		}
+	}
+	return msg;
+}
+
+/**
+ * A reason phrase for the class of a status code, for an `error_page`
+ * that changes the status to one without a phrase of its own
+ */
+static const char *
+classPhrase(int code)
+{
+	switch (code / 100) {
+		case 2:
+			return "OK";
+		case 3:
+			return "Redirection";
+		case 4:
+			return "Client Error";
+		default:
+			return "Server Error";
+	}
+}
+
+static void
+setPageHeaders(_error_page *page, const char *contentType, int len)
+{
+	page->headersLen = asprintf(&page->headers, "%.*sContent-Length: %d\r\n", len, contentType, page->bodyLen);
+}
+
+/**
+ * Read an `error_page` file into memory. The URI is looked up in the
+ * server's locations like a request for it would be.
+ */
+static void
+loadErrorPage(_server *s, _error_page *page)
+{
+	_location *loc = getDocRoot(s, page->uri);
+	if ((loc == NULL) || (loc->root == NULL)) {
+		fprintf(stderr, "%s: ", page->uri);
+		errorExit("error page has no document root\n");
+	}
+	char *path;
+	if (asprintf(&path, "%s%s", loc->root, page->uri) < 0) {
+		errorExit("out of memory\n");
+	}
+	int fd = open(path, O_RDONLY);
+	struct stat sb;
+	if ((fd < 0) || (fstat(fd, &sb) < 0) || !S_ISREG(sb.st_mode)) {
+		fprintf(stderr, "%s: ", path);
+		errorExit("error page can't be read\n");
+	}
+	page->body = malloc(sb.st_size + 1);
+	page->bodyLen = 0;
+	while (page->bodyLen < sb.st_size) {
+		ssize_t n = read(fd, page->body + page->bodyLen, sb.st_size - page->bodyLen);
+		if (n <= 0) {
+			fprintf(stderr, "%s: ", path);
+			errorExit("error page can't be read\n");
+		}
+		page->bodyLen += n;
+	}
+	close(fd);
+	int len;
+	const char *contentType = getContentTypeHeader(path, &len);
+	setPageHeaders(page, contentType, len);
+	free(path);
+}
+
+static _error_page *
+findPage(_error_page *list, int code)
+{
+	for (_error_page *page = list; page != NULL; page = page->next) {
+		if (page->code == code) {
+			return page;
+		}
+	}
+	return NULL;
+}
 
-	char buffer2[64];
-	int sz2 = snprintf(buffer2, 64, "Content-Length: %d\r\n\r\n", sz1);
+/**
+ * The built in page for a status code, used for the body of redirects
+ * Returns: NULL if there is none
+ */
+_error_page *
+getBuiltinPage(int code)
+{
+	return findPage(builtinPages, code);
+}
 
-	char ts[TIME_BUF];
-	getTimestamp((char *)&ts, RESPONSE_FORMAT);
+/**
+ * Render the error pages. Called when the config file and the mime
+ * types have been parsed.
+ */
+void
+buildErrorPages()
+{
+	builtinPages = NULL;
+	_error_page *last = NULL;
+	for (int i = 0; reasons[i].code; i++) {
+		_error_page *page = (_error_page *)calloc(1, sizeof(_error_page));
+		page->code = reasons[i].code;
+		page->status = reasons[i].code;
+		page->bodyLen = asprintf(&page->body, responseBody, page->code, reasons[i].reason, page->code, reasons[i].reason);
+		const char *contentType = "Content-Type: text/html\r\n";
+		setPageHeaders(page, contentType, strlen(contentType));
+		if (last) {
+			last->next = page;
+		} else {
+			builtinPages = page;
+		}
+		last = page;
+	}
 
-	char buffer3[BUFF_SIZE];
-	const char *responseHeaders = 
-"HTTP/1.1 %d %s\r\n"
-"Server: ogws/%s\r\n"
-"Date: %s\r\n"
-"Content-Type: text/html\r\n";
+	for (_server *s = getServerList(); s != NULL; s = s->next) {
+		// the pages from the http section are relative to each server's root
+		for (_error_page *p = getErrorPageList(); p != NULL; p = p->next) {
+			if (findPage(s->errorPages, p->code) == NULL) {
+				_error_page *page = (_error_page *)calloc(1, sizeof(_error_page));
+				page->code = p->code;
+				page->status = p->status;
+				page->uri = p->uri;
+				page->next = s->errorPages;
+				s->errorPages = page;
+			}
+		}
+		for (_error_page *page = s->errorPages; page != NULL; page = page->next) {
+			if (page->body == NULL) {
+				loadErrorPage(s, page);
+			}
+		}
+	}
+}
 
-	int sz3 = snprintf(buffer3, BUFF_SIZE, responseHeaders, code, msg, getVersion(), ts);
+void
+sendErrorResponse( _request *req, int code, char *msg, char *path )
+{
+	doDebug(msg);
+	if (req->server == NULL) {
+		// the request failed before a server was chosen
+		req->server = getServerList();
+	}
+	_error_page *page = findPage(req->server->errorPages, code);
+	if (page == NULL) {
+		page = findPage(builtinPages, code);
+	}
 
-	sendData(req->clientFd, req->ssl, buffer3, sz3);
-	sendData(req->clientFd, req->ssl, buffer2, sz2);
-	sendData(req->clientFd, req->ssl, buffer1, sz1);
+	_response r;
+	char buffer[BUFF_SIZE];
+	int status = page ? page->status : code;
+	// the message is about the original code, not one set by `error_page`
+	startResponse(&r, status, reasonPhrase(status, (status == code) ? msg : classPhrase(status)));
+	addHeaderBlock(&r, req->server->headers, req->server->headersLen);
+	if (page) {
+		addHeaderBlock(&r, page->headers, page->headersLen);
+		setResponseBody(&r, page->body, page->bodyLen);
+	} else {
+		// an unusual status code, render the page now
+		int sz = snprintf(buffer, BUFF_SIZE, responseBody, code, msg, code, msg);
+		addHeader(&r, "Content-Type: text/html\r\nContent-Length: %d\r\n", sz);
+		setResponseBody(&r, buffer, sz);
+	}
+	size_t size = r.bodyLen;
+	if (req->verb && (strcmp(req->verb, "HEAD") == 0)) {
+		setResponseBody(&r, NULL, 0);
+	}
+	sendResponse(req, &r, false);
 
-	errorLog(req->clientFd, req->server, req->verb, code, path, msg);
+	accessLog(req, status, size);
+	if ((code != 404) || isLogNotFound()) {
+		errorLog(req, code, path, msg);
+	}
 	return;
 }
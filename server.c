@@ -20,18 +20,27 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <locale.h>
+#include <time.h>
 #include "serverlist.h"
 #include "server.h"
 
 char buff[BUFF_SIZE];
 char* buffer = (char *)&buff;
 
+static void addClient(int, int, _server *, struct sockaddr_in);
+static void stopAccepting(int, int, _server *);
+static void pollListener(int, int, bool);
+static void freeRequest(_request *);
+static void delayRequest(int, _request *);
+static int resumeRequests(int);
+
+// requests delayed by `limit_req`, the first to resume first
+static _request *delayed = NULL;
+
 void
-server(int portNum, _server *server)
+server(int sockFd, _server *server)
 {
 	int epollFd = epollCreate();
-	const int isTLS = 0;
-	int sockFd = createBindAndListen(isTLS, portNum);
 	struct epoll_event ev;
 	ev.events = EPOLLIN;
 	ev.data.u64 = 0LL;
@@ -43,25 +52,66 @@ server(int portNum, _server *server)
 		cleanup(sockFd);	  
 		exit(1);
 	}
+	workerReady();
 
+	time_t deadline = 0;
+	int connections = getWorkerConnections();
+	struct epoll_event *epoll_events = (struct epoll_event *)malloc((connections+1) * sizeof(struct epoll_event));
+	bool accepting = true;
+	sigset_t waitMask;
+	getWorkerWaitMask(&waitMask);
 	//
 	// Main event loop
 	//
 	while(1) {
+		//
+		// On a graceful shutdown stop accepting connections, then
+		// exit when the connections in progress are done
+		//
+		if (isQuitting() && (sockFd != -1)) {
+			stopAccepting(epollFd, sockFd, server);
+			sockFd = -1;
+			deadline = time(NULL) + getWorkerShutdownTimeout();
+		}
+		//
+		// With `worker_connections` connections open, stop waiting on
+		// the listening socket until one of them is closed. The new
+		// connections wait in the listen queue, or go to another worker.
+		//
+		if (sockFd != -1) {
+			bool full = getClientConnectionCount() >= connections;
+			if (full == accepting) {
+				accepting = !full;
+				pollListener(epollFd, sockFd, accepting);
+			}
+		}
+		if ((sockFd == -1) && ((getClientConnectionCount() == 0) || (time(NULL) >= deadline))) {
+			free(epoll_events);
+			return;
+		}
+		if (isReopenLogs()) {
+			setReopenLogs(false);
+			reopenLogFiles();
+		}
 		doDebug("Starting epoll_wait");
 
 		int rval;
-		int connections = getWorkerConnections();
-		struct epoll_event epoll_events[connections];
-		//
-		// Loop if interrupted by a signal
-		//
-		while ((rval = epoll_wait(epollFd, epoll_events, connections, -1)) < 0) {
-			if ((rval < 0) && (errno != EINTR)) {
+		// wake up once a second to check the deadline while draining,
+		// and to write out log buffers
+		int timeout = (sockFd == -1) ? 1000 : logFlushTimeout();
+		timeout = resumeRequests(timeout);
+		// the worker's signals are only unblocked during the wait, so a
+		// shutdown asked for after the check above ends the wait
+		rval = epoll_pwait(epollFd, epoll_events, connections+1, timeout, &waitMask);
+		flushLogs(false);
+		if (rval < 0) {
+			if (errno != EINTR) {
 				doDebug("epoll_wait failed");
 				cleanup(sockFd);
 				return;
 			}
+			// interrupted by a signal, check for shutdown
+			continue;
 		}
 
 		//
@@ -99,36 +149,23 @@ server(int portNum, _server *server)
 				//
 				if (fd == sockFd) {
 					struct sockaddr_in peerAddr;
-					socklen_t salen = sizeof(peerAddr);
-					while ((clientFd = accept(sockFd, (struct sockaddr *) &peerAddr, &salen)) < 0) {
-						if ((clientFd < 0) && (errno != EINTR)) {
-							fprintf(stderr, "Accept on socket %d failed: %m\n", sockFd);
-							cleanup(sockFd);
-							return;
-						} else {
-							fprintf(stderr, "Resuming interrupted `accept()`\n");
+					while ((clientFd = acceptConnection(sockFd, &peerAddr)) < 0) {
+						if (errno != EINTR) {
+							break;
 						}
+						fprintf(stderr, "Resuming interrupted `accept()`\n");
 					}
-					// The TLS server is multi-threaded, hence can have 
-					// multiple client connections running concurrently.
-					// The non-TLS server (currently) only has one connection
-					// at a time. We queue the connection here, but don't need
-					// to keep track of the returned object since there is
-					// only one.
-					queueClientConnection(clientFd, server, peerAddr, NULL);
-
-					//
-					// Add a new event to listen for
-					//
-					ev.events = EPOLLIN;
-					ev.data.u64 = 0LL;
-					ev.data.fd = clientFd;	
-
-					if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &ev) < 0) {
-						snprintf(buffer, BUFF_SIZE, "Couldn't add client socket %d to epoll set: %m\n", clientFd);
-						doDebug(buffer);
-						cleanup(sockFd);	  
+					if (clientFd >= 0) {
+						addClient(epollFd, clientFd, server, peerAddr);
+					} else if ((errno == EBADF) || (errno == EINVAL) || (errno == ENOTSOCK)) {
+						// the socket itself is unusable
+						fprintf(stderr, "Accept on socket %d failed: %m\n", sockFd);
 						exit(1);
+					} else if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+							&& (errno != EMFILE) && (errno != ENFILE)) {
+						// the connection may have been reset, or taken by
+						// another worker, go on with the others
+						fprintf(stderr, "Accept on socket %d failed: %m\n", sockFd);
 					}
 
 				} else {
@@ -138,16 +175,14 @@ server(int portNum, _server *server)
 					_request *req = (_request *)calloc(1,sizeof(_request));
 					req->server = server;
 					req->clientFd = fd;
+					req->client = getClientConnection(fd);
 					req->ssl = NULL;
 					processInput(req);
-					if (req->path) free(req->path);
-					if (req->fullPath) free(req->fullPath);
-					if (req->queryString) free(req->queryString);
-					if (req->headers) free(req->headers);
-					if (req->verb) free(req->verb);
-					if (req->protocol) free(req->protocol);
-					if (req->host) free(req->host);
-					free(req);
+					if (req->resumeAt.tv_sec) {
+						delayRequest(epollFd, req);
+						continue;
+					}
+					freeRequest(req);
 
 					// not handling "keep alive" yet
 					cleanup(fd);
@@ -157,6 +192,147 @@ server(int portNum, _server *server)
 	} // End, main event loop
 }
 
+static void
+freeRequest(_request *req)
+{
+	if (req->path) free(req->path);
+	if (req->fullPath) free(req->fullPath);
+	if (req->queryString) free(req->queryString);
+	if (req->headers) free(req->headers);
+	if (req->verb) free(req->verb);
+	if (req->protocol) free(req->protocol);
+	if (req->host) free(req->host);
+	free(req);
+}
+
+static bool
+resumesBefore(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) || ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+/**
+ * Hold a request delayed by `limit_req`. Its connection is left out of
+ * the epoll set meanwhile.
+ */
+static void
+delayRequest(int epollFd, _request *req)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, req->clientFd, NULL);
+	_request **p = &delayed;
+	while (*p && !resumesBefore(&req->resumeAt, &(*p)->resumeAt)) {
+		p = &(*p)->next;
+	}
+	req->next = *p;
+	*p = req;
+}
+
+/**
+ * Serve the delayed requests whose time has come
+ * Returns: the epoll timeout, shortened to the next request to resume
+ */
+static int
+resumeRequests(int timeout)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (delayed && !resumesBefore(&now, &delayed->resumeAt)) {
+		_request *req = delayed;
+		delayed = req->next;
+		handleRequest(req);
+		int fd = req->clientFd;
+		freeRequest(req);
+		cleanup(fd);
+	}
+	if (delayed) {
+		long wait = (delayed->resumeAt.tv_sec - now.tv_sec) * 1000
+			+ (delayed->resumeAt.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if ((timeout < 0) || (wait < timeout)) {
+			timeout = wait;
+		}
+	}
+	return timeout;
+}
+
+/**
+ * Queue a new client connection and add it to the epoll set
+ */
+static void
+addClient(int epollFd, int clientFd, _server *server, struct sockaddr_in peerAddr)
+{
+	// The TLS server is multi-threaded, hence can have 
+	// multiple client connections running concurrently.
+	// The non-TLS server (currently) only has one connection
+	// at a time. We queue the connection here, and only keep
+	// the returned object to check the `limit_conn` zones.
+	_clientConnection *client = queueClientConnection(clientFd, server, peerAddr, NULL);
+	if (!limitConnection(client)) {
+		cleanup(clientFd);
+		return;
+	}
+
+	//
+	// Add a new event to listen for
+	//
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0LL;
+	ev.data.fd = clientFd;	
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &ev) < 0) {
+		snprintf(buffer, BUFF_SIZE, "Couldn't add client socket %d to epoll set: %m\n", clientFd);
+		doDebug(buffer);
+		cleanup(clientFd);	  
+		exit(1);
+	}
+}
+
+/**
+ * Stop listening for new connections. The connections already waiting in
+ * the listen queue of this worker's socket are accepted first, otherwise
+ * they would be reset when the socket is closed.
+ *
+ * Note: the socket is only closed, not shut down, since the
+ * master still has a copy of it. It is non-blocking, so `accept`
+ * fails once the queue is empty.
+ */
+static void
+stopAccepting(int epollFd, int sockFd, _server *server)
+{
+	doDebug("Graceful shutdown, no longer accepting connections");
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, sockFd, NULL);
+	while (1) {
+		struct sockaddr_in peerAddr;
+		int clientFd = acceptConnection(sockFd, &peerAddr);
+		if (clientFd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		addClient(epollFd, clientFd, server, peerAddr);
+	}
+	close(sockFd);
+}
+
+/**
+ * Start or stop waiting for new connections on the listening socket. It
+ * stays in the epoll set, with no events to wait for while stopped.
+ */
+static void
+pollListener(int epollFd, int sockFd, bool on)
+{
+	struct epoll_event ev;
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.u64 = 0LL;
+	ev.data.fd = sockFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_MOD, sockFd, &ev) < 0) {
+		fprintf(stderr, "Couldn't change server socket %d in the epoll set: %m\n", sockFd);
+	} else if (isDebug()) {
+		fprintf(stderr, "%s connections on socket %d\n", on ? "Resuming" : "At worker_connections, pausing", sockFd);
+	}
+}
+
 /**
  * Create an epoll file descriptor for waiting on events
  *
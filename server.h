@@ -2,6 +2,7 @@
 #define __SERVER
 #include "clients.h"
 #include <stdbool.h>
+#include <signal.h>
 #include "mimeTypes.h"
 
 void setDebug(bool);
@@ -22,12 +23,48 @@ void setTcpNoPush(bool);
 bool isTcpNoPush();
 void setSendFile(bool);
 bool isSendFile();
+void setLogNotFound(bool);
+bool isLogNotFound();
+void setGzipStatic(bool);
+bool isGzipStatic();
+void setBrotliStatic(bool);
+bool isBrotliStatic();
+void setGzip(bool);
+bool isGzip();
+void setGzipCompLevel(int);
+int getGzipCompLevel();
+void setGzipMinLength(int);
+int getGzipMinLength();
+void setGzipCacheSize(int);
+int getGzipCacheSize();
+void setGzipTypeList(_gzip_type *);
+_gzip_type *getGzipTypeList();
+void setContentCacheSize(int);
+int getContentCacheSize();
+void setContentCacheMaxFile(int);
+int getContentCacheMaxFile();
+void setAutoIndexSort(bool);
+bool isAutoIndexSort();
+void setAutoIndexFormat(int);
+int getAutoIndexFormat();
 void setWorkerConnections(int);
 int getWorkerConnections();
+void setWorkerRlimitNofile(int);
+int getWorkerRlimitNofile();
+void setWorkerShutdownTimeout(int);
+int getWorkerShutdownTimeout();
+void setQuitting(bool);
+bool isQuitting();
+void setReopenLogs(bool);
+bool isReopenLogs();
 void setKeepaliveTimeout(int);
 int getKeepaliveTimeout();
 void setWorkerProcesses(int);
 int getWorkerProcesses();
+void setCpuAffinityAuto(bool);
+bool isCpuAffinityAuto();
+void setCpuMaskList(_cpu_mask *);
+_cpu_mask *getCpuMaskList();
 void setSignalName(char *);
 char *getSignalName();
 void setDefaultPidFile();
@@ -43,13 +80,28 @@ char *getGroup();
 void setServerList(_server *);
 _server *getServerList();
 _server *popServer();
+void setConfigSnapshot(_config_snapshot *);
+_config_snapshot *getConfigSnapshot();
+void buildConfigSnapshot();
+_server *lookupServer(int, const char *, size_t);
 void setClientConnection(_clientConnection *);
 _clientConnection *getClientConnection(int);
 _clientConnection *removeClientConnection(int);
+int getClientConnectionCount();
 void setAccessLog(_log_file *);
 _log_file *getDefaultAccessLog();
 void setErrorLog(_log_file *);
 _log_file *getDefaultErrorLog();
+void setLogFormatList(_log_format *);
+_log_format *getLogFormat(const char *);
+void setErrorPageList(_error_page *);
+_error_page *getErrorPageList();
+void setLimitZoneList(_limit_zone *);
+_limit_zone *getLimitZoneList();
+void setLimitReqList(_limit_req *);
+_limit_req *getLimitReqList();
+void setLimitConnList(_limit_conn *);
+_limit_conn *getLimitConnList();
 void setConfigFile(char *);
 char * getConfigFile();
 void setConfigDir(char *);
@@ -58,38 +110,88 @@ void setMimeTypeList(_mimeTypes *);
 _mimeTypes *getMimeTypeList();
 void setDefaultType(char *);
 char *getDefaultType();
+const char *getDefaultTypeHeader(int *);
 void setUpstreamList(_upstreams *);
 _upstreams *getUpstreamList();
+void resetConfig();
 
 void parseArgs(int, char**);
 void daemonize();
 int epollCreate();
-int createBindAndListen(int, int);
+int createBindAndListen(int);
 void cleanup(int);
+int acceptConnection(int, struct sockaddr_in *);
 void doTrace (char, const char*, int);
 void doDebug (char*);
 #include <openssl/ssl.h>
 void processInput(_request *);
+void routeRequest(_request *);
+void handleRequest(_request *);
 _clientConnection *queueClientConnection(int, _server *, struct sockaddr_in, SSL_CTX*);
 _clientConnection *getClient(int);
 void configureContext(SSL_CTX*, int port);
 SSL_CTX *createContext();
 void ShowCerts(SSL*);
 int sendData(int, SSL*, const char*, int);
+int sendToClient(_request *, const char*, int);
 int recvData(int, char*, int);
-void sendFile(_request *, size_t size);
-void getTimestamp(char*, int);
+void sendFile(_request *, off_t, size_t);
+const char *getTimestamp(int);
+const char *getHttpDate(time_t);
+long microsSince(const struct timespec *);
 void sendErrorResponse(_request *,int, char*, char*);
 void handleGetVerb(_request *);
+const char *getRequestHeader(_request *, const char *, int, int *);
 void parseMimeTypes();
 void parseConfig();
 void checkConfig();
-void accessLog(int, _server*, char*, int, char*, int);
-void errorLog(int, _server*, char*, int, char*, char*);
-void getMimeType(char*, char*);
+void accessLog(_request *, int, size_t);
+void errorLog(_request *, int, char*, char*);
+_log_op *compileTemplate(const char *, const char *);
+_log_op *compileLogFormat(const char *);
+bool isConnectionTemplate(_log_op *);
+int formatLogRecord(_log_op *, _request *, int, size_t, char *, int);
+int expandVariables(_log_op *, _request *, char *, int);
+int expandMatch(_log_op *, _request *, const char *, const regmatch_t *, char *, int);
+void flushLogs(bool);
+int logFlushTimeout();
+void reopenLogFiles();
+_mimeTypes *getMimeTypeEntry(const char *);
+const char *getContentTypeHeader(const char *, int *);
+void buildStaticHeaders();
+void buildErrorPages();
+const char *reasonPhrase(int, const char *);
+_error_page *getBuiltinPage(int);
+_rewrite *compileRewrite(const char *, const char *, const char *);
+_rewrite *compileReturn(const char *, const char *);
+void buildRewrites();
+bool rewriteServer(_request *);
+bool rewriteLocation(_request *);
+void buildLimitZones();
+long limitRequest(_request *);
+void *createConnShm(_limit_zone *);
+bool limitConnection(_clientConnection *);
+void releaseConnection(_clientConnection *);
+void *createHoldTable();
+void setHoldTable(void *);
+void releaseHoldTable(void *);
+void startResponse(_response *, int, const char *);
+void addHeaderBlock(_response *, const char *, int);
+void addHeader(_response *, const char *, ...);
+void setResponseBody(_response *, const char *, size_t);
+void corkClient(_request *, bool);
+int sendChunk(_request *, const char *, size_t, bool);
+int sendResponse(_request *, _response *, bool);
+void addExpires(_response *, _location *, time_t);
 void showDirectoryListing(_request *);
+void startProcesses();
+void setUpgradeArgs(char **);
+void getWorkerWaitMask(sigset_t *);
+void workerReady();
 void server(int, _server *);
-void tlsServer(int, _server *);
+void tlsServer(int, int, _server *);
+void setWorkerCpuAffinity(int);
+void steerConnectionsToWorkerCpus(int, int);
 _location *getDocRoot(_server *, char *);
 void handleProxyPass(_request *);
 void handleFastCGIPass(_request *);
@@ -97,18 +199,62 @@ void handleTryFiles(_request *);
 int getUpstreamServer(_request *);
 int openDefaultIndexFile(_request *);
 int pathExists(_request *, char *);
+void openDocRoots();
+int normalizePath(const char *, char *, size_t);
+int openBeneath(int, const char *, int);
+int openUnderRoot(_location *, const char *, int);
+int reopenFile(int, int);
+const char *relativePath(_request *);
 void serveFile(_request *);
-FILE *expandIncludeFiles(char *);
+void serveFileOrNotModified(_request *);
+bool notModified(_request *);
+void formatETag(const struct stat *, char *, int);
+void addValidators(_response *, const struct stat *);
+bool sendRanges(_request *);
+int openPrecompressed(_request *);
+bool acceptsEncoding(_request *, const char *);
+typedef struct _gzip_stream _gzip_stream;
+bool acceptsGzip(_request *);
+bool isGzipType(const char *, int);
+char *gzipBuffer(const char *, size_t, size_t *);
+_gzip_stream *startGzipStream(_request *, bool);
+void gzipStreamWrite(_gzip_stream *, const char *, size_t);
+size_t finishGzipStream(_gzip_stream *);
+bool sendGzippedFile(_request *);
+_gzip_stream *gzipUpstreamResponse(_request *, const char *, size_t);
+bool sendCachedFile(_request *);
+bool cacheAndSendFile(_request *);
+void addContentEncoding(_response *, _request *);
+void sendNotModified(_request *);
+FILE *openConfigFile();
+void includeFiles(const char *);
+bool endOfConfigFile();
+const char *currentConfigFile();
+int getConfigFileCount();
+void pushConfigBuffer(FILE *);
+void popConfigBuffer();
 void checkParameter(char *, char *);
 
 #define FAIL    -1
+
+// passed from the old to the new master on a binary upgrade
+#define LISTEN_FDS_ENV "OGWS_LISTEN_FDS"
+#define OLD_MASTER_ENV "OGWS_OLD_MASTER"
+#define OLDBIN_SUFFIX ".oldbin"
+
 #define BUFF_SIZE 4096
 #define TIME_BUF 256
+#define DEFAULT_LOG_BUFFER (64*1024)
+#define ERROR_LOG_BUFFER (8*1024)
+#define ERROR_LOG_FLUSH 1
 
 // timestamp formats
 #define RESPONSE_FORMAT 0
 #define LOG_FILE_FORMAT 1
 #define LOG_RECORD_FORMAT 2
+#define LOG_LOCAL_FORMAT 3
+#define LOG_ISO8601_FORMAT 4
+
 
 // global variables
 struct globalVars {
@@ -6,13 +6,18 @@
  * Some of the objects are linked lists of objects, some are single values.
  *
  * Some variables can be changed from their default based on a config file
- * setting but otherwise the server does not support changing its configuration
- * other then killing and restarting the process.
+ * setting. On a reload the master process resets these to their defaults
+ * (see `resetConfig()` below) and parses the config file again. The
+ * settings from the command line are kept.
  */
+#define _GNU_SOURCE
 #include <stdbool.h>
+#include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include "serverlist.h"
 #include "mimeTypes.h"
 #include "clients.h"
@@ -127,6 +132,150 @@ isSendFile() {
 	return useSendFile;
 }
 
+////////////////////////////////////////
+// Enables or disables logging of "file not found" errors in the error log
+static bool logNotFound = true;
+void
+setLogNotFound(const bool l) {
+	logNotFound = l;
+}
+bool
+isLogNotFound() {
+	return logNotFound;
+}
+
+////////////////////////////////////////
+// Serve a `.gz` copy of a static file, if there is one and the client
+// accepts gzip
+static bool gzipStatic = false;
+void
+setGzipStatic(const bool g) {
+	gzipStatic = g;
+}
+bool
+isGzipStatic() {
+	return gzipStatic;
+}
+
+////////////////////////////////////////
+// Serve a `.br` copy of a static file, if there is one and the client
+// accepts brotli
+static bool brotliStatic = false;
+void
+setBrotliStatic(const bool b) {
+	brotliStatic = b;
+}
+bool
+isBrotliStatic() {
+	return brotliStatic;
+}
+
+////////////////////////////////////////
+// Compress responses with gzip on the fly, the `gzip` directive and the
+// ones that tune it
+static bool gzip = false;
+void
+setGzip(const bool g) {
+	gzip = g;
+}
+bool
+isGzip() {
+	return gzip;
+}
+static int gzipCompLevel = 1;
+void
+setGzipCompLevel(const int l) {
+	gzipCompLevel = l;
+}
+int
+getGzipCompLevel() {
+	return gzipCompLevel;
+}
+static int gzipMinLength = 20;
+void
+setGzipMinLength(const int l) {
+	gzipMinLength = l;
+}
+int
+getGzipMinLength() {
+	return gzipMinLength;
+}
+// memory for compressed copies of static files, in each worker
+static int gzipCacheSize = 16*1024*1024;
+void
+setGzipCacheSize(const int s) {
+	gzipCacheSize = s;
+}
+int
+getGzipCacheSize() {
+	return gzipCacheSize;
+}
+// the types compressed besides text/html
+static _gzip_type *gzipTypes = NULL;
+void
+setGzipTypeList(_gzip_type *type) {
+	_gzip_type *t = gzipTypes;
+	if (t) {
+		while (t->next) {
+			t = t->next;
+		}
+		t->next = type;
+	} else {
+		gzipTypes = type;
+	}
+	type->next = NULL;
+}
+_gzip_type *
+getGzipTypeList() {
+	return gzipTypes;
+}
+
+////////////////////////////////////////
+// Memory for the content cache in each worker, 0 when it is off, and the
+// biggest file it holds
+static int contentCacheSize = 0;
+void
+setContentCacheSize(const int s) {
+	contentCacheSize = s;
+}
+int
+getContentCacheSize() {
+	return contentCacheSize;
+}
+static int contentCacheMaxFile = 64*1024;
+void
+setContentCacheMaxFile(const int s) {
+	contentCacheMaxFile = s;
+}
+int
+getContentCacheMaxFile() {
+	return contentCacheMaxFile;
+}
+
+////////////////////////////////////////
+// Sort the entries of a directory listing, directories first
+static bool autoIndexSort = true;
+void
+setAutoIndexSort(const bool s) {
+	autoIndexSort = s;
+}
+bool
+isAutoIndexSort() {
+	return autoIndexSort;
+}
+
+////////////////////////////////////////
+// The format of a directory listing
+static int autoIndexFormat = AUTOINDEX_HTML;
+void
+setAutoIndexFormat(const int f) {
+	autoIndexFormat = f;
+}
+int
+getAutoIndexFormat() {
+	return autoIndexFormat;
+}
+
 ////////////////////////////////////////
 // Keep track of the number of worker connections
 static int workerConnections = 64;
@@ -139,6 +288,18 @@ getWorkerConnections() {
 	return workerConnections;
 }
 
+////////////////////////////////////////
+// The open file limit of a worker, 0 keeps the inherited one
+static int workerRlimitNofile = 0;
+void
+setWorkerRlimitNofile(const int n) {
+	workerRlimitNofile = n;
+}
+int
+getWorkerRlimitNofile() {
+	return workerRlimitNofile;
+}
+
 ////////////////////////////////////////
 // Keep track of the number of worker proccesses
 static int workerProcesses = 1;
@@ -151,6 +312,80 @@ getWorkerProcesses() {
 	return workerProcesses;
 }
 
+////////////////////////////////////////
+// Bind worker processes to CPUs automatically?
+static bool cpuAffinityAuto = false;
+void
+setCpuAffinityAuto(const bool a) {
+	cpuAffinityAuto = a;
+}
+bool
+isCpuAffinityAuto() {
+	return cpuAffinityAuto;
+}
+
+////////////////////////////////////////
+// List of CPU masks for binding worker processes to CPUs.
+// The order matters, the first mask is for the first worker.
+static _cpu_mask *cpuMasks = NULL;
+void
+setCpuMaskList(_cpu_mask *mask) {
+	_cpu_mask *m = cpuMasks;
+	if (m) {
+		while(m->next) {
+			m = m->next;
+		}
+		m->next = mask;
+	} else {
+		cpuMasks = mask;
+	}
+	mask->next = NULL;
+}
+_cpu_mask *
+getCpuMaskList() {
+	return cpuMasks;
+}
+
+////////////////////////////////////////
+// Time allowed for a graceful shutdown of the worker processes,
+// in seconds. Workers still running after this are killed.
+static int workerShutdownTimeout = 30;
+void
+setWorkerShutdownTimeout(const int t) {
+	workerShutdownTimeout = t;
+}
+int
+getWorkerShutdownTimeout() {
+	return workerShutdownTimeout;
+}
+
+////////////////////////////////////////
+// Set from the signal handler of a worker process when a graceful
+// shutdown is requested. The worker stops accepting connections and
+// exits once the connections in progress are done.
+static volatile sig_atomic_t quitting = false;
+void
+setQuitting(const bool q) {
+	quitting = q;
+}
+bool
+isQuitting() {
+	return quitting;
+}
+
+////////////////////////////////////////
+// Set from the signal handler of a worker process when the log files
+// should be reopened, after they have been rotated.
+static volatile sig_atomic_t reopenLogs = false;
+void
+setReopenLogs(const bool r) {
+	reopenLogs = r;
+}
+bool
+isReopenLogs() {
+	return reopenLogs;
+}
+
 ////////////////////////////////////////
 // The keepalive timeout value
 static int keepaliveTimeout = 1;
@@ -287,6 +522,19 @@ popServer() {
 	return servers;
 }
 
+////////////////////////////////////////
+// The lookup indexes of the servers, packed when the config file has
+// been parsed (see configSnapshot.c). Replaced, not reset, on a reload.
+static _config_snapshot *configSnapshot = NULL;
+void
+setConfigSnapshot(_config_snapshot *config) {
+	configSnapshot = config;
+}
+_config_snapshot *
+getConfigSnapshot() {
+	return configSnapshot;
+}
+
 ////////////////////////////////////////
 // Linked list of upstream servers.
 // The order matters so the list is kept first in, last out.
@@ -319,6 +567,7 @@ getUpstreamList() {
 // changes o the data structure.
 //
 static _clientConnection *clients = NULL;
+static int clientCount = 0;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void
@@ -326,6 +575,7 @@ setClientConnection(_clientConnection *client) {
 	pthread_mutex_lock(&mutex);
 	client->next = clients;
 	clients = client;
+	clientCount++;
 	pthread_mutex_unlock(&mutex);
 }
 _clientConnection *
@@ -353,6 +603,7 @@ removeClientConnection(int fd) {
 			} else {
 				clients = c->next;
 			}
+			clientCount--;
 			break;
 		}
 		prev = c;
@@ -361,6 +612,13 @@ removeClientConnection(int fd) {
 	pthread_mutex_unlock(&mutex);
 	return c;
 }
+int
+getClientConnectionCount() {
+	pthread_mutex_lock(&mutex);
+	int count = clientCount;
+	pthread_mutex_unlock(&mutex);
+	return count;
+}
 
 ////////////////////////////////////////
 // List of access log files
@@ -404,6 +662,101 @@ getDefaultErrorLog() {
 	return errorLog;
 }
 
+////////////////////////////////////////
+// List of log formats, from `log_format` directives
+static _log_format *logFormats = NULL;
+void
+setLogFormatList(_log_format *format) {
+	_log_format *f = logFormats;
+	if (f) {
+		while (f->next) {
+			f = f->next;
+		}
+		f->next = format;
+	} else {
+		logFormats = format;
+	}
+	format->next = NULL;
+}
+_log_format *
+getLogFormat(const char *name) {
+	for (_log_format *f = logFormats; f != NULL; f = f->next) {
+		if (strcmp(f->name, name) == 0) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////
+// Error pages from `error_page` directives in the http section, used by
+// the servers that don't define their own
+static _error_page *errorPages = NULL;
+void
+setErrorPageList(_error_page *page) {
+	_error_page *p = errorPages;
+	if (p) {
+		while (p->next) {
+			p = p->next;
+		}
+		p->next = page;
+	} else {
+		errorPages = page;
+	}
+	page->next = NULL;
+}
+_error_page *
+getErrorPageList() {
+	return errorPages;
+}
+
+////////////////////////////////////////
+// Zones from `limit_req_zone` directives
+static _limit_zone *limitZones = NULL;
+void
+setLimitZoneList(_limit_zone *zone) {
+	zone->next = limitZones;
+	limitZones = zone;
+}
+_limit_zone *
+getLimitZoneList() {
+	return limitZones;
+}
+
+////////////////////////////////////////
+// `limit_req` directives in the http section, used by the servers that
+// don't have their own
+static _limit_req *limitReqs = NULL;
+void
+setLimitReqList(_limit_req *lr) {
+	_limit_req **p = &limitReqs;
+	while (*p) {
+		p = &(*p)->next;
+	}
+	*p = lr;
+}
+_limit_req *
+getLimitReqList() {
+	return limitReqs;
+}
+
+////////////////////////////////////////
+// `limit_conn` directives in the http section, used by the servers that
+// don't have their own
+static _limit_conn *limitConns = NULL;
+void
+setLimitConnList(_limit_conn *lc) {
+	_limit_conn **p = &limitConns;
+	while (*p) {
+		p = &(*p)->next;
+	}
+	*p = lc;
+}
+_limit_conn *
+getLimitConnList() {
+	return limitConns;
+}
+
 ////////////////////////////////////////
 // config file path
 static char *configFile = NULL;
@@ -462,14 +815,70 @@ getMimeTypeList() {
 ////////////////////////////////////////
 // Default MIME type for responses
 static char *defaultType = NULL;
+static char *defaultTypeHeader = NULL;
+static int defaultTypeHeaderLen = 0;
 void
 setDefaultType(char *t) {
 	if (defaultType != NULL) {
 		free(defaultType);
+		free(defaultTypeHeader);
+		defaultTypeHeader = NULL;
+		defaultTypeHeaderLen = 0;
 	}
 	defaultType = t;
+	if ((t != NULL) && ((defaultTypeHeaderLen = asprintf(&defaultTypeHeader, "Content-Type: %s\r\n", t)) < 0)) {
+		defaultTypeHeader = NULL;
+		defaultTypeHeaderLen = 0;
+	}
 }
 char *
 getDefaultType() {
 	return defaultType;
 }
+const char *
+getDefaultTypeHeader(int *len) {
+	*len = defaultTypeHeaderLen;
+	return defaultTypeHeader;
+}
+
+////////////////////////////////////////
+// Forget the settings from the config file before it is parsed again.
+// The old objects are not freed, the workers that are draining were
+// forked with them and the master doesn't keep track of what is shared.
+void
+resetConfig() {
+	trace = false;
+	tokens = true;
+	tcpNoPush = false;
+	useSendFile = false;
+	logNotFound = true;
+	gzipStatic = false;
+	brotliStatic = false;
+	gzip = false;
+	gzipCompLevel = 1;
+	gzipMinLength = 20;
+	gzipCacheSize = 16*1024*1024;
+	gzipTypes = NULL;
+	contentCacheSize = 0;
+	contentCacheMaxFile = 64*1024;
+	autoIndexSort = true;
+	autoIndexFormat = AUTOINDEX_HTML;
+	workerConnections = 64;
+	workerRlimitNofile = 0;
+	workerProcesses = 1;
+	cpuAffinityAuto = false;
+	cpuMasks = NULL;
+	workerShutdownTimeout = 30;
+	keepaliveTimeout = 1;
+	servers = NULL;
+	upstreams = NULL;
+	accessLog = NULL;
+	errorLog = NULL;
+	logFormats = NULL;
+	errorPages = NULL;
+	limitZones = NULL;
+	limitReqs = NULL;
+	limitConns = NULL;
+	mimeTypes = NULL;
+	setDefaultType(NULL);
+}
@@ -4,15 +4,50 @@
  * Define the datastructures for maintaining server (virtual host)
  * configurations.
  */
+#include <stdbool.h>
 #include <openssl/ssl.h>
+#include <pthread.h>
+#include <time.h>
+#include <regex.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+// A compiled `log_format`, a list of literal text and variables
+typedef struct _log_op {
+	struct _log_op *next;
+	int var;
+	char *text;		// literal text, or the header name for $http_...
+	int len;
+} _log_op;
+
+typedef struct _log_format {
+	struct _log_format *next;
+	char *name;
+	_log_op *ops;
+} _log_format;
 
 typedef struct _log_file {
 	struct _log_file *next;
 	char *path;
 	int fd;
 	int type;
+	_log_format *format;
+	// buffered writes, from `access_log path buffer=size flush=time`
+	char *buf;
+	size_t bufSize;		// 0 if not buffered
+	size_t used;
+	int flush;			// seconds, 0 to write only when the buffer is full
+	time_t buffered;	// when the buffer was last empty
+	pthread_mutex_t lock;
 } _log_file;
 
+// CPU masks from the `worker_cpu_affinity` directive, one per worker.
+// The mask is a string of 0 and 1, the rightmost character is CPU 0.
+typedef struct _cpu_mask {
+	struct _cpu_mask *next;
+	char *mask;
+} _cpu_mask;
+
 // the type field is a bit mask, mutliple values can be set
 #define TYPE_PROXY_PASS 1
 #define TYPE_DOC_ROOT 2
@@ -24,6 +59,7 @@ typedef struct _log_file {
 #define EQUAL_MATCH 0
 #define REGEX_MATCH 1
 #define PREFIX_MATCH 2
+#define NAMED_MATCH 3
 #define PROTOCOL_UNSET -1
 #define PROTOCOL_HTTP 0
 #define PROTOCOL_HTTPS 1
@@ -31,6 +67,10 @@ typedef struct _log_file {
 typedef struct _try_target {
 	struct _try_target *next;
 	char *target;
+	_log_op *ops;		// the target, compiled
+	bool dir;			// ends with a slash, only a directory matches
+	int code;			// `=code`, the last target only
+	struct _location *named;	// `@name`, the last target only
 } _try_target;
 
 typedef struct _upstream {
@@ -48,17 +88,116 @@ typedef struct _upstreams {
 	_upstream *servers;
 }_upstreams;
 
+// A response header from an `add_header` directive
+typedef struct _header {
+	struct _header *next;
+	char *name;
+	char *value;
+} _header;
+
+// how the `expires` time is counted
+#define EXPIRES_OFF 0
+#define EXPIRES_ACCESS 1
+#define EXPIRES_MODIFIED 2
+#define EXPIRES_EPOCH 3
+#define EXPIRES_MAX 4
+
+// `rewrite` and `return`, see rewrite.c
+#define REWRITE_URI 0
+#define REWRITE_RETURN 1
+// the flag of a `rewrite`
+#define REWRITE_NEXT 0
+#define REWRITE_LAST 1
+#define REWRITE_BREAK 2
+#define REWRITE_REDIRECT 3
+#define REWRITE_PERMANENT 4
+// internal redirects of a request, from `rewrite` and `try_files`
+#define MAX_REDIRECTS 10
+
+typedef struct _rewrite {
+	struct _rewrite *next;
+	int type;			// REWRITE_URI or REWRITE_RETURN
+	regex_t regex;
+	char *prefix;		// literal text the regex is anchored to, or NULL
+	int prefixLen;
+	char *text;			// the replacement, or the text or URL returned
+	_log_op *ops;		// the text, compiled
+	int flag;
+	bool keepArgs;		// the query string is added to the new URI
+	int code;			// of a `return`, or a redirect
+	char *headers;		// a prebuilt response, when the text
+	int headersLen;		// has no variables
+	char *body;
+	int bodyLen;
+} _rewrite;
+
+// the kind of a shared memory zone
+#define LIMIT_ZONE_REQ 0
+#define LIMIT_ZONE_CONN 1
+
+// A `limit_req_zone` or `limit_conn_zone`, its state is shared by the
+// workers, see limitReq.c and limitConn.c
+typedef struct _limit_zone {
+	struct _limit_zone *next;
+	int type;			// LIMIT_ZONE_REQ or LIMIT_ZONE_CONN
+	char *name;
+	char *key;			// the template, and compiled
+	_log_op *ops;
+	size_t size;
+	long rate;			// thousandths of a request per second
+	void *shm;
+} _limit_zone;
+
+// A `limit_req`, the burst and delay are in thousandths of a request
+typedef struct _limit_req {
+	struct _limit_req *next;
+	char *zoneName;
+	_limit_zone *zone;
+	long burst;
+	long delay;			// excess requests passed without a delay
+} _limit_req;
+
+// A `limit_conn`
+typedef struct _limit_conn {
+	struct _limit_conn *next;
+	char *zoneName;
+	_limit_zone *zone;
+	int limit;
+} _limit_conn;
+
+// A connection counted in a `limit_conn` zone, released when it closes
+typedef struct _conn_hold {
+	struct _conn_hold *next;
+	_limit_zone *zone;
+	int slot;
+	int entry;		// in the worker's hold table, -1 if not recorded
+} _conn_hold;
+
+// `autoindex_format`
+#define AUTOINDEX_HTML 0
+#define AUTOINDEX_XML 1
+#define AUTOINDEX_JSON 2
+
 typedef struct _location {
 	struct _location *next;
 	int type;
 	int matchType;
 	char *match;
 	char *root;
+	int rootFd;			// the root directory, opened by each worker
 	int protocol;
 	_try_target *tryTarget;
 	struct sockaddr_in *passTo;		// for proxy_pass locations
 	_upstreams *group;				// for upstream groups
-	int expires;
+	int expiresMode;
+	int expires;		// seconds, may be negative
+	_header *addHeaders;
+	bool addsExpires;		// the Expires and Cache-Control headers
+	bool addsCacheControl;	// from `expires` are replaced by `add_header`
+	char *headers;		// static response headers
+	int headersLen;
+	_rewrite *rewrites;	// `rewrite` and `return`, in order
+	_limit_req *limitReqs;	// NULL to use the server's
 }_location;
 
 #define SERVER_NAME_EXACT 0
@@ -81,6 +220,67 @@ typedef struct _port {
 	int tls;
 }_port;
 
+// A mime type from `gzip_types`
+typedef struct _gzip_type {
+	struct _gzip_type *next;
+	char *type;
+} _gzip_type;
+
+// A pre-rendered error response. From an `error_page` directive, or built
+// in (see sendErrorResponse.c).
+typedef struct _error_page {
+	struct _error_page *next;
+	int code;			// status code it is used for
+	int status;			// status code sent, changed with `=response`
+	char *uri;			// page file, NULL for the built in page
+	char *headers;		// Content-Type and Content-Length
+	int headersLen;
+	char *body;
+	int bodyLen;
+} _error_page;
+
+// A location in the lookup index of a server, see configSnapshot.c
+typedef struct _location_entry {
+	int matchType;
+	int matchLen;
+	const char *match;
+	regex_t *regex;		// compiled once, for a regex match
+	_location *loc;
+} _location_entry;
+
+// An index file name, without leading slashes
+typedef struct _index_entry {
+	int len;
+	const char *name;
+} _index_entry;
+
+// The lookup indexes of a server, in the config snapshot
+typedef struct _server_index {
+	const _location_entry *locations;	// in the order they are matched
+	int locationCount;
+	const _index_entry *indexFiles;
+	int indexFileCount;
+} _server_index;
+
+// A server name and port, the hosts are sorted by port, length and name
+typedef struct _host_entry {
+	int port;
+	int nameLen;
+	const char *name;
+	struct _server *server;
+} _host_entry;
+
+// The parsed configuration packed into one read-only block, see
+// configSnapshot.c
+typedef struct _config_snapshot {
+	void *arena;
+	size_t size;
+	const _host_entry *hosts;
+	int hostCount;
+	const _server_index *servers;	// one for each server, in list order
+	int serverCount;
+} _config_snapshot;
+
 typedef struct _server {
 	struct _server *next;
 	_server_name *serverNames;
@@ -93,6 +293,13 @@ typedef struct _server {
 	char *keyFile;
 	_log_file *accessLog;
 	_log_file *errorLog;
+	char *headers;		// static response headers
+	int headersLen;
+	_error_page *errorPages;
+	_rewrite *rewrites;	// `rewrite` and `return`, before the location is found
+	_limit_req *limitReqs;	// NULL to use the ones of the http section
+	_limit_conn *limitConns;	// NULL to use the ones of the http section
+	const _server_index *index;	// in the config snapshot
 }_server;
 
 typedef struct _request {
@@ -106,8 +313,30 @@ typedef struct _request {
 	int localFd;	// file being served
 	int clientFd;	// socket connection to the client
 	int isDir;
+	struct stat st;	// of the file being served
+	const char *encoding;	// of a precompressed file, NULL if not compressed
+	bool cacheable;		// the file served may be added to the content cache
 	SSL *ssl;
 	_server *server;
 	_location *loc;
+	struct _clientConnection *client;
+	struct timespec start;	// when the request was received (monotonic)
+	long upstreamTime;		// microseconds, -1 if not passed upstream
+	int redirects;			// internal redirects, from `try_files`
+	size_t bytesSent;		// response headers and body
+	bool limited;			// `limit_req` was applied
+	struct timespec resumeAt;	// a request delayed by `limit_req`
+	struct _request *next;		// in the queue of delayed requests
 }_request;
+
+// A response being built, see response.c
+#define RESPONSE_IOV 16
+typedef struct _response {
+	struct iovec iov[RESPONSE_IOV];
+	int iovcnt;
+	char buf[1024];		// headers formatted for this response
+	int used;
+	const char *body;
+	size_t bodyLen;
+}_response;
 #endif
@@ -1,5 +1,5 @@
 /**
- * When a URL is requested which is a directory name and the 
+ * When a URL is requested which is a directory name and the
  * directory does not contain an INDEX file, show a simple HTML
  * page which contains a listing of the files in the directory.
  * Each file name is a clickable link so that the file contents
@@ -9,135 +9,532 @@
  * information that was not inteded. Therefore it is optional to
  * show instead a 404 error.
  *
+ * The directory is read with `getdents64` into one buffer of names, and
+ * each entry is looked at with `fstatat` relative to the directory, so
+ * no paths are built. With `autoindex_sort on` the entries are sorted,
+ * directories first. The page is written into a single growing buffer,
+ * and kept for the next request while the directory's modification time
+ * stays the same. The sizes shown may be out of date until then, as the
+ * directory doesn't change when a file in it does.
+ *
+ * With `autoindex_sort off` nothing has to be kept, and the listing is
+ * sent as the directory is read, in pieces of LISTING_FLUSH bytes, so a
+ * huge directory takes no more memory than a small one. HTTP/1.1 clients
+ * get the pieces as chunks, older clients get a body that ends when the
+ * connection is closed. These listings are not cached.
+ *
+ * `autoindex_format` picks HTML, XML or JSON, in the layout nginx uses.
+ *
  * (c) Tom Lang 2/2023
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include "serverlist.h"
 #include "server.h"
 
-typedef struct _fragment {
-	struct _fragment *next;
-	int len;
-	char *fragment;
-} _fragment;
-_fragment *fragments = NULL;
-void addFragment(char *,char *,char *);
+// listings kept by each worker
+#define LISTING_CACHE_SIZE 16
+// room for the entries returned by one getdents64 call
+#define DENTS_SIZE (64*1024)
+// a streamed listing is sent when this much is rendered
+#define LISTING_FLUSH (16*1024)
+
+static const char *header ="<html><head>"
+					"<title>Directory Listing</title>"
+					"<style type=\"text/css\">body {font-family: system-ui;}"
+					".sz {font-size: 10px;}</style>"
+					"</head>"
+					"<body><h1>Directory Listing</h1><ul>";
+static const char *footer ="</ul></body></html>";
+static const char *xmlHeader = "<?xml version=\"1.0\"?>\n<list>\n";
+static const char *xmlFooter = "</list>\n";
+static const char *jsonHeader = "[\n";
+static const char *jsonFooter = "\n]\n";
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t size;
+} _buffer;
+
+typedef struct {
+	size_t name;	// offset in the buffer of names
+	bool dir;
+	off_t size;
+	time_t mtime;
+} _dir_entry;
+
+// where a streamed listing goes
+typedef struct {
+	_request *req;
+	bool chunked;
+	_gzip_stream *gz;
+	size_t sent;
+	bool failed;
+} _listing_stream;
+
+typedef struct {
+	char *dirPath;
+	char *path;
+	ino_t ino;
+	struct timespec mtime;
+	int format;
+	_buffer page;
+	unsigned long used;		// when it was last used, for replacement
+	int refs;				// requests sending the page
+} _listing;
+
+// shared by the threads of the TLS server
+static pthread_mutex_t listingLock = PTHREAD_MUTEX_INITIALIZER;
+static _listing listings[LISTING_CACHE_SIZE];
+static unsigned long useCount = 0;
+
+static void
+reserve(_buffer *b, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->size == 0) ? 4096 : b->size;
+		while (b->len + len > b->size) {
+			b->size *= 2;
+		}
+		b->data = realloc(b->data, b->size);
+	}
+}
+
+static void
+append(_buffer *b, const char *s, size_t len)
+{
+	reserve(b, len);
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+static void
+appendf(_buffer *b, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	reserve(b, len + 1);
+	va_start(ap, format);
+	vsnprintf(b->data + b->len, len + 1, format, ap);
+	va_end(ap);
+	b->len += len;
+}
 
 /**
- * Show a listing of files in a directory 
+ * A file name as HTML text
  */
-void
-showDirectoryListing(_request *req)
+static void
+appendHtml(_buffer *b, const char *s)
+{
+	for (; *s; s++) {
+		switch (*s) {
+			case '<': append(b, "&lt;", 4); break;
+			case '>': append(b, "&gt;", 4); break;
+			case '&': append(b, "&amp;", 5); break;
+			case '"': append(b, "&quot;", 6); break;
+			default: append(b, s, 1);
+		}
+	}
+}
+
+/**
+ * A path in a URL, the characters that aren't safe are percent encoded
+ */
+static void
+appendUrl(_buffer *b, const char *s)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (isalnum(c) || strchr("/-._~!$'()*+,;=:@", c)) {
+			append(b, (char *)&c, 1);
+		} else {
+			char e[3] = {'%', hex[c >> 4], hex[c & 0xf]};
+			append(b, e, 3);
+		}
+	}
+}
+
+/**
+ * A file name as a JSON string, without the quotes
+ */
+static void
+appendJson(_buffer *b, const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if ((c == '"') || (c == '\\')) {
+			char e[2] = {'\\', c};
+			append(b, e, 2);
+		} else if (c < 0x20) {
+			appendf(b, "\\u%04x", c);
+		} else {
+			append(b, (char *)&c, 1);
+		}
+	}
+}
+
+static void
+appendEntry(_buffer *b, const char *path, const char *name, const _dir_entry *e, bool first)
+{
+	struct tm tm;
+	char date[32];
+	switch (getAutoIndexFormat()) {
+		case AUTOINDEX_XML:
+			// <file mtime="DATE" size="SIZE">NAME</file>
+			gmtime_r(&e->mtime, &tm);
+			strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+			if (e->dir) {
+				appendf(b, "<directory mtime=\"%s\">", date);
+				appendHtml(b, name);
+				append(b, "</directory>\n", 13);
+			} else {
+				appendf(b, "<file mtime=\"%s\" size=\"%ld\">", date, (long)e->size);
+				appendHtml(b, name);
+				append(b, "</file>\n", 8);
+			}
+			return;
+		case AUTOINDEX_JSON:
+			// { "name":"NAME", "type":"file", "mtime":"DATE", "size":SIZE }
+			if (!first) {
+				append(b, ",\n", 2);
+			}
+			append(b, "{ \"name\":\"", 10);
+			appendJson(b, name);
+			appendf(b, "\", \"type\":\"%s\", \"mtime\":\"%s\"", e->dir ? "directory" : "file",
+				getHttpDate(e->mtime));
+			if (!e->dir) {
+				appendf(b, ", \"size\":%ld", (long)e->size);
+			}
+			append(b, " }", 2);
+			return;
+	}
+	// <li><a href="PATH/NAME">NAME</a> SIZE Bytes</li>
+	append(b, "<li><a href=\"", 13);
+	// the request path is still percent encoded, only the name is encoded
+	appendHtml(b, path);
+	if ((*path == '\0') || (path[strlen(path)-1] != '/')) {
+		append(b, "/", 1);
+	}
+	appendUrl(b, name);
+	append(b, "\">", 2);
+	appendHtml(b, name);
+	if (e->dir) {
+		append(b, "</a> Directory</li>", 19);
+	} else {
+		appendf(b, "</a><span  class=\"sz\"> - %'ld Bytes</span></li>", (long)e->size);
+	}
+}
+
+static const char *
+formatHeader()
+{
+	switch (getAutoIndexFormat()) {
+		case AUTOINDEX_XML: return xmlHeader;
+		case AUTOINDEX_JSON: return jsonHeader;
+	}
+	return header;
+}
+
+static const char *
+formatFooter()
+{
+	switch (getAutoIndexFormat()) {
+		case AUTOINDEX_XML: return xmlFooter;
+		case AUTOINDEX_JSON: return jsonFooter;
+	}
+	return footer;
+}
+
+static const char *
+formatContentType()
+{
+	switch (getAutoIndexFormat()) {
+		case AUTOINDEX_XML: return "text/xml";
+		case AUTOINDEX_JSON: return "application/json";
+	}
+	return "text/html";
+}
+
+/**
+ * Send what has been rendered of a streamed listing, and empty the buffer
+ */
+static void
+flushListing(_listing_stream *out, _buffer *page)
+{
+	if (!out->failed && (page->len > 0)) {
+		if (out->gz) {
+			gzipStreamWrite(out->gz, page->data, page->len);
+		} else if (sendChunk(out->req, page->data, page->len, out->chunked) < 0) {
+			out->failed = true;
+		} else {
+			out->sent += page->len;
+		}
+	}
+	page->len = 0;
+}
+
+static int
+compareEntries(const void *a, const void *b, void *names)
+{
+	const _dir_entry *x = a;
+	const _dir_entry *y = b;
+	if (x->dir != y->dir) {
+		return x->dir ? -1 : 1;
+	}
+	return strcmp((char *)names + x->name, (char *)names + y->name);
+}
+
+/**
+ * Read a directory and render its listing. When out is set the listing is
+ * sent as it is rendered, unsorted.
+ * Returns: false if the directory can't be read
+ */
+static bool
+renderListing(int dirFd, const char *path, _buffer *page, _listing_stream *out)
+{
+	_buffer names = {NULL, 0, 0};
+	_buffer entries = {NULL, 0, 0};
+	bool sorted = (out == NULL) && isAutoIndexSort();
+	size_t count = 0;
+	char *dents = malloc(DENTS_SIZE);
+	append(page, formatHeader(), strlen(formatHeader()));
+	ssize_t n;
+	while ((n = getdents64(dirFd, dents, DENTS_SIZE)) > 0) {
+		for (ssize_t off = 0; off < n; ) {
+			struct dirent64 *d = (struct dirent64 *)(dents + off);
+			off += d->d_reclen;
+			if (strcmp(d->d_name, ".") == 0) {
+				continue;	// skip dot entry
+			}
+			if ((strcmp(d->d_name, "..") == 0) && (getAutoIndexFormat() != AUTOINDEX_HTML)) {
+				continue;	// only the HTML page links to the parent
+			}
+			struct stat sb;
+			_dir_entry e = {0, false, 0, 0};
+			if (fstatat(dirFd, d->d_name, &sb, 0) == 0) {
+				e.dir = S_ISDIR(sb.st_mode);
+				e.size = sb.st_size;
+				e.mtime = sb.st_mtime;
+			} else {
+				e.dir = (d->d_type == DT_DIR);
+			}
+			if (sorted) {
+				e.name = names.len;
+				append(&names, d->d_name, strlen(d->d_name) + 1);
+				append(&entries, (char *)&e, sizeof(e));
+			} else {
+				appendEntry(page, path, d->d_name, &e, count++ == 0);
+			}
+		}
+		if (out && (page->len >= LISTING_FLUSH)) {
+			flushListing(out, page);
+		}
+	}
+	free(dents);
+	if (sorted) {
+		count = entries.len / sizeof(_dir_entry);
+		_dir_entry *list = (_dir_entry *)entries.data;
+		qsort_r(list, count, sizeof(_dir_entry), compareEntries, names.data);
+		for (size_t i = 0; i < count; i++) {
+			appendEntry(page, path, names.data + list[i].name, &list[i], i == 0);
+		}
+		free(names.data);
+		free(entries.data);
+	}
+	append(page, formatFooter(), strlen(formatFooter()));
+	return n == 0;
+}
+
+/**
+ * Find the listing of a directory, rendering it if it isn't cached or
+ * the directory has changed. The caller releases the listing.
+ */
+static _listing *
+getListing(_request *req, int dirFd, const struct stat *st)
+{
+	pthread_mutex_lock(&listingLock);
+	_listing *l = NULL;
+	for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+		_listing *c = &listings[i];
+		if (c->dirPath && (strcmp(c->dirPath, req->fullPath) == 0) && (strcmp(c->path, req->path) == 0)
+			&& (c->format == getAutoIndexFormat())
+			&& (c->ino == st->st_ino) && (c->mtime.tv_sec == st->st_mtim.tv_sec)
+			&& (c->mtime.tv_nsec == st->st_mtim.tv_nsec)) {
+			l = c;
+			break;
+		}
+	}
+	if (l) {
+		l->used = ++useCount;
+		l->refs++;
+		pthread_mutex_unlock(&listingLock);
+		return l;
+	}
+	pthread_mutex_unlock(&listingLock);
+
+	_buffer page = {NULL, 0, 0};
+	if (!renderListing(dirFd, req->path, &page, NULL)) {
+		free(page.data);
+		return NULL;
+	}
+
+	// replace the least recently used listing no request is sending
+	pthread_mutex_lock(&listingLock);
+	for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+		_listing *c = &listings[i];
+		if ((c->refs == 0) && ((l == NULL) || (c->used < l->used))) {
+			l = c;
+		}
+	}
+	if (l == NULL) {
+		// all in use, this one isn't kept
+		pthread_mutex_unlock(&listingLock);
+		l = (_listing *)calloc(1, sizeof(_listing));
+		l->page = page;
+		l->refs = -1;
+		return l;
+	}
+	free(l->dirPath);
+	free(l->path);
+	free(l->page.data);
+	l->dirPath = strdup(req->fullPath);
+	l->path = strdup(req->path);
+	l->ino = st->st_ino;
+	l->mtime = st->st_mtim;
+	l->format = getAutoIndexFormat();
+	l->page = page;
+	l->used = ++useCount;
+	l->refs = 1;
+	pthread_mutex_unlock(&listingLock);
+	return l;
+}
+
+static void
+releaseListing(_listing *l)
 {
-	DIR *dp;
-	struct dirent *ep;
-	char buffer[BUFF_SIZE];
-	dp = opendir (req->fullPath);
-	if (dp == NULL) {
-		doDebug("Problem opening a directory, shouldn't happen");
-		sendErrorResponse(req, 404, "Not Found", req->path);
+	if (l->refs < 0) {
+		free(l->page.data);
+		free(l);
 		return;
 	}
-	while ((ep = readdir(dp)) != NULL) {
-		addFragment(req->fullPath, req->path, ep->d_name);
-	}
-	closedir(dp);
-	const char *header ="<html><head>"
-						"<title>Directory Listing</title>"
-						"<style type=\"text/css\">body {font-family: system-ui;}"
-						".sz {font-size: 10px;}</style>"
-						"</head>"
-						"<body><h1>Directory Listing</h1><ul>";
-	const char *footer ="</ul></body></html>";
-	int contentLength = strlen(header) + strlen(footer);
-	_fragment *f = fragments;
-	while(f != NULL) {
-		contentLength += f->len;
-		f = f->next;
-	}
-	char ts[TIME_BUF];
-	getTimestamp((char *)&ts, RESPONSE_FORMAT);
+	pthread_mutex_lock(&listingLock);
+	l->refs--;
+	pthread_mutex_unlock(&listingLock);
+}
+
+/**
+ * Send a listing as the directory is read. The headers go out first, so a
+ * directory that can't be read part way through ends the response early.
+ */
+static void
+streamListing(_request *req, int dirFd)
+{
+	const char *type = formatContentType();
+	_listing_stream out = {req, false, NULL, 0, false};
+	out.chunked = (req->protocol != NULL) && (strcmp(req->protocol, "HTTP/1.1") == 0);
 	int httpCode = 200;
-	const char *responseHeaders = 
-"HTTP/1.1 %d OK\r\n"
-"Server: ogws/0.1\r\n"
-"Date: %s\r\n"
-"Content-Type: text/html\r\n"
-"Content-Length: %d\r\n\r\n";
-
-	int sz = snprintf(buffer, BUFF_SIZE, responseHeaders, httpCode, ts, contentLength);
-	// send the response headers
-	sendData(req->clientFd, req->ssl, (char *)&buffer, sz);
-
-	// send the response body
-	sendData(req->clientFd, req->ssl, header, strlen(header));
-	while(fragments != NULL) {
-		_fragment *f = fragments;
-		fragments = f->next;
-		sendData(req->clientFd, req->ssl, f->fragment, f->len);
-		free(f->fragment);
-		free(f);
-	}
-	sendData(req->clientFd, req->ssl, footer, strlen(footer));
-	accessLog(req->clientFd, req->server, "GET", 200, req->path, contentLength);
-	return;
+	_response r;
+	startResponse(&r, httpCode, "OK");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	addExpires(&r, req->loc, req->st.st_mtime);
+	addHeader(&r, "Content-Type: %s\r\n", type);
+	if (out.chunked) {
+		addHeader(&r, "Transfer-Encoding: chunked\r\n");
+	} else {
+		addHeader(&r, "Connection: close\r\n");
+	}
+	if (acceptsGzip(req) && isGzipType(type, strlen(type))) {
+		req->encoding = "gzip";
+	}
+	addContentEncoding(&r, req);
+	bool head = (strcmp(req->verb, "GET") != 0);
+	if ((sendResponse(req, &r, !head) < 0) || head) {
+		accessLog(req, httpCode, 0);
+		return;
+	}
+
+	if (req->encoding) {
+		out.gz = startGzipStream(req, out.chunked);
+	}
+	_buffer page = {NULL, 0, 0};
+	bool complete = renderListing(dirFd, req->path, &page, &out);
+	flushListing(&out, &page);
+	free(page.data);
+	if (out.gz) {
+		out.sent = finishGzipStream(out.gz);
+	} else if (complete && out.chunked && !out.failed) {
+		sendChunk(req, NULL, 0, true);
+	}
+	accessLog(req, httpCode, out.sent);
 }
 
 /**
- * allocate and chain a new HTML fragment struct
+ * Show a listing of files in a directory. The directory was found with
+ * `O_PATH`, as `req->localFd`, and is closed here.
  */
 void
-addFragment(char *dirPath, char *path, char *fileName)
+showDirectoryListing(_request *req)
 {
-	if (fileName[0] == '.' && fileName[1] == '\0') {
-		return;		// skip dot entry
+	int dirFd = reopenFile(req->localFd, O_RDONLY | O_DIRECTORY);
+	close(req->localFd);
+	req->localFd = -1;
+	if (dirFd == -1) {
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		return;
 	}
-	_fragment *f = malloc(sizeof(_fragment));
-	f->next = NULL;
-	if (fragments == NULL) {
-		fragments = f;
-	} else {
-		_fragment *list = fragments;
-		_fragment *prev;
-		while(list != NULL) {
-			prev = list;
-			list = list->next;
+	if (!isAutoIndexSort()) {
+		streamListing(req, dirFd);
+		close(dirFd);
+		return;
+	}
+	_listing *l = getListing(req, dirFd, &req->st);
+	close(dirFd);
+	if (l == NULL) {
+		sendErrorResponse(req, 500, "Internal Server Error", req->path);
+		return;
+	}
+
+	int httpCode = 200;
+	_response r;
+	startResponse(&r, httpCode, "OK");
+	addHeaderBlock(&r, req->loc->headers, req->loc->headersLen);
+	addExpires(&r, req->loc, req->st.st_mtime);
+	const char *type = formatContentType();
+	const char *body = l->page.data;
+	size_t size = l->page.len;
+	char *compressed = NULL;
+	if ((size >= (size_t)getGzipMinLength()) && acceptsGzip(req) && isGzipType(type, strlen(type))) {
+		compressed = gzipBuffer(body, size, &size);
+		if (compressed) {
+			req->encoding = "gzip";
+			body = compressed;
+		} else {
+			size = l->page.len;
 		}
-		prev->next = f;
-	}
-	//
-	// Get the file size
-	//
-	char buffer[BUFF_SIZE];
-	char *fullPath = (char *)&buffer;
-	strcpy(fullPath, dirPath);
-	strcat(fullPath, "/");
-	strcat(fullPath, fileName);
-	struct stat sb;
-	int fileSize = 0;
-	if (stat(fullPath, &sb) == 0) {
-		fileSize = (int)sb.st_size;
-	}
-	
-	//
-	// fragment structure:
-	// <li><a href="PATH">FILE NAME</a> SIZE Bytes</li>
-	//
-	if (S_ISDIR(sb.st_mode)) {
-		f->len = snprintf(buffer, BUFF_SIZE, "<li><a href=\"%s/%s\">%s</a> Directory</li>", path, fileName, fileName);
-	} else {
-		f->len = snprintf(buffer, BUFF_SIZE, "<li><a href=\"%s/%s\">%s</a><span  class=\"sz\"> - %'d Bytes</span></li>", path, fileName, fileName, fileSize);
 	}
-	f->fragment = (char *)malloc(f->len+1);
-	strcpy(f->fragment, (char *)&buffer);
+	addHeader(&r, "Content-Type: %s\r\nContent-Length: %zu\r\n", type, size);
+	addContentEncoding(&r, req);
+	if (strcmp(req->verb, "GET") == 0) {
+		setResponseBody(&r, body, size);
+	}
+	sendResponse(req, &r, false);
+	free(compressed);
+	releaseListing(l);
+	accessLog(req, httpCode, size);
 	return;
 }
@@ -27,7 +27,7 @@
  * Returns: socket file descriptor
  */
 int
-createBindAndListen(int isTLS, int port)
+createBindAndListen(int port)
 {
 	char buff[BUFF_SIZE];
 	char* buffer = (char *)&buff;
@@ -39,13 +39,12 @@ createBindAndListen(int isTLS, int port)
 	}
 	fprintf(stderr, "New socket created with sockFd %d\n", sockFd);
 
-	// use blocking I/O for TLS until for now
-	if (!isTLS) {
-		if (fcntl(sockFd, F_SETFL, O_NONBLOCK)) {
-			fprintf(stderr, "Could not make the socket non-blocking: %m\n");
-			close(sockFd);
-			exit(1);
-		}
+	// the workers wait for connections with epoll or poll, and accept
+	// them until the queue is empty
+	if (fcntl(sockFd, F_SETFL, O_NONBLOCK)) {
+		fprintf(stderr, "Could not make the socket non-blocking: %m\n");
+		close(sockFd);
+		exit(1);
 	}
 
 	int on = 1;
@@ -81,6 +80,39 @@ createBindAndListen(int isTLS, int port)
 	return sockFd;
 }
 
+// a descriptor kept open to be given up when the process runs out
+static int spareFd = -1;
+
+/**
+ * Accept a connection on a listening socket. When the process is out of
+ * file descriptors the spare one is closed to accept the connection and
+ * close it right away, so the client isn't left waiting in the listen
+ * queue and the listening socket doesn't stay readable.
+ *
+ * Returns: the client socket, or -1 with errno set
+ */
+int
+acceptConnection(int sockFd, struct sockaddr_in *addr)
+{
+	if (spareFd < 0) {
+		spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+	socklen_t len = sizeof(*addr);
+	int clientFd = accept(sockFd, (struct sockaddr *) addr, &len);
+	if ((clientFd < 0) && ((errno == EMFILE) || (errno == ENFILE)) && (spareFd >= 0)) {
+		int e = errno;
+		close(spareFd);
+		int fd = accept(sockFd, NULL, NULL);
+		if (fd >= 0) {
+			close(fd);
+		}
+		spareFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		fprintf(stderr, "Out of file descriptors, connection on socket %d dropped\n", sockFd);
+		errno = e;
+	}
+	return clientFd;
+}
+
 /**
  * Receive data from a socket.
  */
@@ -101,9 +133,7 @@ recvData(int fd, char* ptr, int nbytes)
 			close(fd);
 			return(0);
 		}
-		nbytes -= n;		// reduce buffer size by amount received
-		received += n;	  // increment amount received
-		p += n;			 // advance the buffer pointer past received data
+		// interrupted by a signal, nothing was received
 	}
 	received += n;
 	doTrace( 'R', ptr, received);
@@ -134,8 +164,9 @@ sendData(int fd, SSL *ssl, const char* ptr, int nbytes)
 				nleft -= nsent;
 				ptr   += nsent;
 			}
-			else if (!((int)nsent == -1 && errno != EINTR)) {
+			else if (errno != EINTR) {
 				fprintf(stderr, "Send to socket %d failed: %m\n", fd);
+				return -1;
 			}
 		}
 	}
@@ -143,31 +174,68 @@ sendData(int fd, SSL *ssl, const char* ptr, int nbytes)
 }
 
 /**
- * Copy a file to a socket
+ * Send part of the response to the client of a request, counting the
+ * bytes for the access log
+ */
+int
+sendToClient(_request *req, const char* ptr, int nbytes)
+{
+	int sent = sendData(req->clientFd, req->ssl, ptr, nbytes);
+	if (sent > 0) {
+		req->bytesSent += sent;
+	}
+	return sent;
+}
+
+// the TLS path copies the file through a buffer this big
+#define FILE_CHUNK (64*1024)
+
+/**
+ * Copy part of a file to a socket
  */
 void
-sendFile(_request *req, size_t size)
+sendFile(_request *req, off_t offset, size_t size)
 {
 	if (isDebug()) {
-		fprintf(stderr, "Sending response body: SIZE %d\n", (int)size);
+		fprintf(stderr, "Sending response body: OFFSET %ld SIZE %zu\n", (long)offset, size);
 	}
-	off_t offset = 0;
-	size_t sent;
+	size_t left = size;
 	if (req->ssl) {
-		char *p = malloc(size);
-		read(req->localFd, p, size);
-		if (SSL_write_ex(req->ssl, p, size, &sent) == 0) {
-			if (isDebug()) {
-				ERR_print_errors_fp(stderr);
+		size_t chunk = (size < FILE_CHUNK) ? size : FILE_CHUNK;
+		char *p = malloc(chunk);
+		while (left > 0) {
+			ssize_t n = pread(req->localFd, p, (left < chunk) ? left : chunk, offset);
+			if (n <= 0) {
+				break;
+			}
+			size_t sent;
+			if (SSL_write_ex(req->ssl, p, n, &sent) == 0) {
+				if (isDebug()) {
+					ERR_print_errors_fp(stderr);
+				}
+				break;
 			}
+			req->bytesSent += sent;
+			offset += n;
+			left -= n;
 		}
 		free(p);
 	} else {
-		sent = sendfile(req->clientFd, req->localFd, &offset, size);
+		while (left > 0) {
+			ssize_t n = sendfile(req->clientFd, req->localFd, &offset, left);
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			if (n <= 0) {
+				break;
+			}
+			req->bytesSent += n;
+			left -= n;
+		}
 	}
-	if (sent != size) {
+	if (left != 0) {
 		if (isDebug()) {
-			fprintf(stderr, "Problem sending response body: SIZE %d SENT %d\n", (int)size, (int)sent);
+			fprintf(stderr, "Problem sending response body: SIZE %zu SENT %zu\n", size, size - left);
 		}
 	}
 }
@@ -182,6 +250,7 @@ queueClientConnection(int fd, _server *server, struct sockaddr_in addr, SSL_CTX
 	client->fd = fd;
 	client->server = server;
 	client->ctx = ctx;
+	client->holds = NULL;
 	char ip[INET_ADDRSTRLEN];
 	if (inet_ntop(AF_INET, &addr.sin_addr.s_addr, ip, INET_ADDRSTRLEN) != NULL) {
 		char buffer[BUFF_SIZE];
@@ -204,6 +273,7 @@ cleanup(int fd)
 {
 	_clientConnection *c = removeClientConnection(fd);
 	if (c) {
+		releaseConnection(c);
 		if (c->ctx) {
 			SSL_CTX_free(c->ctx);
 		}
@@ -8,7 +8,7 @@
  *
  * (c) Tom Lang 2/2023
  */
-
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,6 +23,9 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include "serverlist.h"
 #include "server.h"
 
@@ -34,35 +37,146 @@ void *processRequest( void *);
 // thread safe counter
 pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
 int  threadCount = 0;
+// signaled when a thread is done
+pthread_cond_t threadDone = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Thread which writes out the log buffers, and reopens the log
+ * files when asked to. The main thread is blocked waiting for connections.
+ */
+static void *
+logFlusher(void *param)
+{
+	while (1) {
+		sleep(1);
+		if (isReopenLogs()) {
+			setReopenLogs(false);
+			reopenLogFiles();
+		}
+		flushLogs(false);
+	}
+	return param;
+}
+
+/**
+ * Start the thread of a connection, unless it is over a `limit_conn`. Then
+ * it is closed before the handshake, and without a thread.
+ */
+static void
+startThread(int clientFd, _server *server, struct sockaddr_in addr, SSL_CTX *ctx)
+{
+	_clientConnection *client = queueClientConnection(clientFd, server, addr, NULL);
+	if (!limitConnection(client)) {
+		cleanup(clientFd);
+		return;
+	}
+	client->ctx = ctx;
+	pthread_t thread;
+	// counted here rather than in the thread, so a shutdown
+	// can't miss a thread that is just starting
+	pthread_mutex_lock(&mutex1);
+	threadCount++;
+	pthread_mutex_unlock(&mutex1);
+	if (pthread_create(&thread, NULL, processRequest, (void *)client) == 0) {
+		pthread_detach(thread);
+	} else {
+		perror("Can't create request thread");
+		cleanup(clientFd);
+		pthread_mutex_lock(&mutex1);
+		threadCount--;
+		pthread_mutex_unlock(&mutex1);
+	}
+}
 
 /**
  * The SSL server
  */
 void
-tlsServer(int portNum, _server *server)
+tlsServer(int sockFd, int portNum, _server *server)
 {
 	SSL_CTX *ctx = createContext();
 	configureContext(ctx, portNum);
-	const int isTLS = 1;
-	int sockFd = createBindAndListen(isTLS, portNum);
-	while(1) {
+	// The worker's signals are blocked, except while this thread waits
+	// for a connection, so the other threads inherit the mask and
+	// never take them
+	sigset_t waitMask;
+	getWorkerWaitMask(&waitMask);
+	const struct timespec noWait = {0, 0};
+	pthread_t flusher;
+	if (pthread_create(&flusher, NULL, logFlusher, NULL) == 0) {
+		pthread_detach(flusher);
+	}
+	workerReady();
+	int connections = getWorkerConnections();
+	while(!isQuitting()) {
+		// With `worker_connections` threads running, wait for one to
+		// finish before taking another connection off the listen queue
+		pthread_mutex_lock(&mutex1);
+		while ((threadCount >= connections) && !isQuitting()) {
+			// check for a shutdown every second
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			pthread_cond_timedwait(&threadDone, &mutex1, &until);
+			ppoll(NULL, 0, &noWait, &waitMask);
+		}
+		pthread_mutex_unlock(&mutex1);
+		// a signal that came since the check of `isQuitting` ends the wait
+		struct pollfd pfd = {sockFd, POLLIN, 0};
+		if (ppoll(&pfd, 1, NULL, &waitMask) < 0) {
+			if (errno != EINTR) {
+				fprintf(stderr, "Poll on socket %d failed: %m\n", sockFd);
+				break;
+			}
+			continue;
+		}
 		struct sockaddr_in addr;
-		socklen_t len = sizeof(addr);
-		int clientFd;
-		while ((clientFd = accept(sockFd, (struct sockaddr *) &addr, &len)) < 0) {
-			if ((clientFd < 0) && (errno != EINTR)) {
+		int clientFd = acceptConnection(sockFd, &addr);
+		if (clientFd < 0) {
+			if ((errno == EMFILE) || (errno == ENFILE)) {
+				// the connection was dropped, give the threads a moment
+				// to close theirs
+				usleep(10000);
+			} else if ((errno == EBADF) || (errno == EINVAL) || (errno == ENOTSOCK)) {
+				// the socket itself is unusable
+				fprintf(stderr, "Accept on socket %d failed: %m\n", sockFd);
+				break;
+			} else if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
 				fprintf(stderr, "Accept on socket %d failed: %m\n", sockFd);
-				cleanup(sockFd);
-				return;
-			} else {
-				fprintf(stderr, "Resuming interrupted `accept()`\n");
 			}
+			continue;
 		}
-		_clientConnection *client = queueClientConnection(clientFd, server, addr, ctx);
-		pthread_t thread;
-		pthread_create(&thread, NULL, processRequest, (void *)client);
+		startThread(clientFd, server, addr, ctx);
+	}
+
+	// Graceful shutdown, stop accepting connections and wait for the
+	// requests in progress. The connections already in the listen queue
+	// are taken first, they would be reset when it is closed. The socket
+	// is only closed, not shut down, since the master still has a copy
+	// of it.
+	doDebug("Graceful shutdown, no longer accepting connections");
+	while (1) {
+		struct sockaddr_in addr;
+		int clientFd = acceptConnection(sockFd, &addr);
+		if (clientFd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		startThread(clientFd, server, addr, ctx);
+	}
+	close(sockFd);
+	time_t deadline = time(NULL) + getWorkerShutdownTimeout();
+	while (time(NULL) < deadline) {
+		pthread_mutex_lock(&mutex1);
+		int count = threadCount;
+		pthread_mutex_unlock(&mutex1);
+		if (count == 0) {
+			break;
+		}
+		usleep(100000);
 	}
-	cleanup(sockFd);
 }
 
 /**
@@ -73,7 +187,6 @@ processRequest(void *param)
 {
 	printf("Thread started ...\n");
 	pthread_mutex_lock(&mutex1);
-	threadCount++;
 	printf("Thread Count: %d\n", threadCount);
 	pthread_mutex_unlock(&mutex1);
 	_clientConnection *c = (_clientConnection *)param;
@@ -90,6 +203,7 @@ processRequest(void *param)
 		} else {
 			_request *req = (_request *)calloc(1,sizeof(_request));
 			req->clientFd = c->fd;
+			req->client = c;
 			req->server = c->server;
 			req->ssl = ssl;
 			processInput(req);
@@ -108,6 +222,7 @@ processRequest(void *param)
 	pthread_mutex_lock(&mutex1);
 	threadCount--;
 	printf("Thread exiting, count: %d\n", threadCount);
+	pthread_cond_signal(&threadDone);
 	pthread_mutex_unlock(&mutex1);
 	return param;
 }
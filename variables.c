@@ -0,0 +1,466 @@
+/**
+ * Variables in `log_format` templates, `try_files` targets, `limit_req_zone`
+ * keys and the replacements of `rewrite` and `return`.
+ *
+ * A template such as
+ *   '$remote_addr - [$time_local] "$request" $status $request_time'
+ * is compiled once, when the config file is loaded, into a list of
+ * operations. Each operation either copies literal text or appends the
+ * value of one variable, so writing a log record doesn't parse anything.
+ *
+ * (c) Tom Lang 10/2026
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <regex.h>
+#include <arpa/inet.h>
+#include "serverlist.h"
+#include "server.h"
+#include "parseConfig.h"
+
+enum {
+	VAR_LITERAL,
+	VAR_REMOTE_ADDR,
+	VAR_BINARY_REMOTE_ADDR,
+	VAR_REMOTE_USER,
+	VAR_TIME_LOCAL,
+	VAR_TIME_ISO8601,
+	VAR_TIME_RECORD,
+	VAR_MSEC,
+	VAR_REQUEST,
+	VAR_REQUEST_METHOD,
+	VAR_REQUEST_URI,
+	VAR_URI,
+	VAR_ARGS,
+	VAR_SERVER_PROTOCOL,
+	VAR_HOST,
+	VAR_SERVER_NAME,
+	VAR_STATUS,
+	VAR_BYTES_SENT,
+	VAR_BODY_BYTES_SENT,
+	VAR_REQUEST_TIME,
+	VAR_UPSTREAM_RESPONSE_TIME,
+	VAR_PID,
+	VAR_SCHEME,
+	VAR_HTTP_HEADER,
+	VAR_CAPTURE,
+};
+
+static const struct {
+	const char *name;
+	int var;
+} variables[] = {
+	{"remote_addr", VAR_REMOTE_ADDR},
+	{"binary_remote_addr", VAR_BINARY_REMOTE_ADDR},
+	{"remote_user", VAR_REMOTE_USER},
+	{"time_local", VAR_TIME_LOCAL},
+	{"time_iso8601", VAR_TIME_ISO8601},
+	{"time_record", VAR_TIME_RECORD},
+	{"msec", VAR_MSEC},
+	{"request", VAR_REQUEST},
+	{"request_method", VAR_REQUEST_METHOD},
+	{"request_uri", VAR_REQUEST_URI},
+	{"uri", VAR_URI},
+	{"document_uri", VAR_URI},
+	{"args", VAR_ARGS},
+	{"query_string", VAR_ARGS},
+	{"server_protocol", VAR_SERVER_PROTOCOL},
+	{"host", VAR_HOST},
+	{"server_name", VAR_SERVER_NAME},
+	{"status", VAR_STATUS},
+	{"bytes_sent", VAR_BYTES_SENT},
+	{"body_bytes_sent", VAR_BODY_BYTES_SENT},
+	{"request_time", VAR_REQUEST_TIME},
+	{"upstream_response_time", VAR_UPSTREAM_RESPONSE_TIME},
+	{"pid", VAR_PID},
+	{"scheme", VAR_SCHEME},
+	{NULL, 0}
+};
+
+/**
+ * Append an operation to the list being compiled
+ */
+static _log_op *
+addOp(_log_op **list, _log_op *last, int var, const char *text, int len)
+{
+	_log_op *op = (_log_op *)calloc(1, sizeof(_log_op));
+	op->var = var;
+	if (text) {
+		op->text = strndup(text, len);
+		op->len = len;
+	}
+	if (last) {
+		last->next = op;
+	} else {
+		*list = op;
+	}
+	return op;
+}
+
+/**
+ * Compile a template, for the directive named in error messages.
+ *
+ * A variable name is letters, digits and underscores, and may be written
+ * as `${name}` when text follows it directly. `$http_name` is the request
+ * header with that name, the underscores standing for dashes. `$1` to `$9`
+ * are the groups matched by the regex of a `rewrite`.
+ * Returns: list of operations
+ */
+_log_op *
+compileTemplate(const char *template, const char *directive)
+{
+	_log_op *list = NULL;
+	_log_op *last = NULL;
+	const char *p = template;
+	while (*p) {
+		const char *dollar = strchr(p, '$');
+		if (dollar == NULL) {
+			last = addOp(&list, last, VAR_LITERAL, p, strlen(p));
+			break;
+		}
+		if (dollar > p) {
+			last = addOp(&list, last, VAR_LITERAL, p, dollar - p);
+		}
+		const char *name = dollar + 1;
+		bool braced = (*name == '{');
+		if (braced) {
+			name++;
+		}
+		const char *end = name;
+		if (isdigit(*end)) {
+			end++;
+		} else {
+			while (isalnum(*end) || (*end == '_')) {
+				end++;
+			}
+		}
+		int len = end - name;
+		if ((len == 0) || (braced && (*end != '}'))) {
+			fprintf(stderr, "%s: invalid variable in %s\n", template, directive);
+			errorExit("invalid variable\n");
+		}
+		p = braced ? end + 1 : end;
+
+		if (isdigit(*name)) {
+			last = addOp(&list, last, VAR_CAPTURE, NULL, 0);
+			last->len = *name - '0';
+			continue;
+		}
+		if ((len > 5) && (strncmp(name, "http_", 5) == 0)) {
+			last = addOp(&list, last, VAR_HTTP_HEADER, name + 5, len - 5);
+			for (char *c = last->text; *c; c++) {
+				if (*c == '_') {
+					*c = '-';
+				}
+			}
+			continue;
+		}
+		int i;
+		for (i = 0; variables[i].name; i++) {
+			if ((strlen(variables[i].name) == (size_t)len)
+				&& (strncmp(variables[i].name, name, len) == 0)) {
+				break;
+			}
+		}
+		if (variables[i].name == NULL) {
+			fprintf(stderr, "$%.*s: unknown variable in %s\n", len, name, directive);
+			errorExit("unknown variable\n");
+		}
+		last = addOp(&list, last, variables[i].var, NULL, 0);
+	}
+	return list;
+}
+
+/**
+ * Whether a template only has values known when a connection is
+ * accepted, for a `limit_conn_zone` key
+ */
+bool
+isConnectionTemplate(_log_op *ops)
+{
+	for (_log_op *op = ops; op != NULL; op = op->next) {
+		if ((op->var != VAR_LITERAL) && (op->var != VAR_REMOTE_ADDR)
+				&& (op->var != VAR_BINARY_REMOTE_ADDR) && (op->var != VAR_SERVER_NAME)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Compile a `log_format` template
+ * Returns: list of operations
+ */
+_log_op *
+compileLogFormat(const char *template)
+{
+	return compileTemplate(template, "log format");
+}
+
+/**
+ * Output buffer for a record. Text that doesn't fit is dropped.
+ */
+typedef struct {
+	char *p;
+	char *end;
+	bool raw;		// values are copied as they are, not escaped
+	const char *subject;	// matched by a `rewrite` regex, for $1 to $9
+	const regmatch_t *match;
+} _out;
+
+static void
+put(_out *o, const char *s, size_t len)
+{
+	if (len > (size_t)(o->end - o->p)) {
+		len = o->end - o->p;
+	}
+	memcpy(o->p, s, len);
+	o->p += len;
+}
+
+/**
+ * Values that come from the client are escaped like nginx does, so a
+ * record can't be forged with quotes or line breaks.
+ */
+static void
+putEscaped(_out *o, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	if (o->raw) {
+		if (s) {
+			put(o, s, len);
+		}
+		return;
+	}
+	if (s == NULL) {
+		put(o, "-", 1);
+		return;
+	}
+	for (size_t i = 0; (i < len) && (o->p < o->end); i++) {
+		unsigned char c = s[i];
+		if ((c == '"') || (c == '\\') || (c < 0x20) || (c > 0x7e)) {
+			char e[4] = {'\\', 'x', hex[c >> 4], hex[c & 0xf]};
+			put(o, e, 4);
+		} else {
+			*o->p++ = c;
+		}
+	}
+}
+
+static void
+putString(_out *o, const char *s)
+{
+	putEscaped(o, s, s ? strlen(s) : 0);
+}
+
+static void
+putNumber(_out *o, long n)
+{
+	char num[24];
+	char *p = num + sizeof(num);
+	bool negative = (n < 0);
+	unsigned long u = negative ? -n : n;
+	do {
+		*--p = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	if (negative) {
+		*--p = '-';
+	}
+	put(o, p, num + sizeof(num) - p);
+}
+
+// seconds with millisecond resolution, as nginx writes times
+static void
+putMillis(_out *o, long usec)
+{
+	putNumber(o, usec / 1000000);
+	char frac[4];
+	long ms = (usec / 1000) % 1000;
+	frac[0] = '.';
+	frac[1] = '0' + ms / 100;
+	frac[2] = '0' + (ms / 10) % 10;
+	frac[3] = '0' + ms % 10;
+	put(o, frac, 4);
+}
+
+static void
+putTime(_out *o, int format)
+{
+	const char *ts = getTimestamp(format);
+	put(o, ts, strlen(ts));
+}
+
+/**
+ * Append the values of a compiled template to the output
+ */
+static void
+putOps(_out *o, _log_op *ops, _request *req, int status, size_t bodySize)
+{
+	for (_log_op *op = ops; op != NULL; op = op->next) {
+		switch (op->var) {
+			case VAR_LITERAL:
+				put(o, op->text, op->len);
+				break;
+			case VAR_REMOTE_ADDR:
+				putString(o, req->client ? req->client->ip : NULL);
+				break;
+			case VAR_BINARY_REMOTE_ADDR: {
+				// the 4 bytes of the address, a short `limit_req_zone` key
+				struct in_addr addr;
+				if (req->client && (inet_pton(AF_INET, req->client->ip, &addr) == 1)) {
+					putEscaped(o, (const char *)&addr, sizeof(addr));
+				} else {
+					putString(o, NULL);
+				}
+				break;
+			}
+			case VAR_REMOTE_USER:
+				put(o, "-", 1);
+				break;
+			case VAR_TIME_LOCAL:
+				putTime(o, LOG_LOCAL_FORMAT);
+				break;
+			case VAR_TIME_ISO8601:
+				putTime(o, LOG_ISO8601_FORMAT);
+				break;
+			case VAR_TIME_RECORD:
+				putTime(o, LOG_RECORD_FORMAT);
+				break;
+			case VAR_MSEC: {
+				struct timespec now;
+				clock_gettime(CLOCK_REALTIME, &now);
+				putMillis(o, now.tv_sec * 1000000L + now.tv_nsec / 1000);
+				break;
+			}
+			case VAR_REQUEST:
+				putString(o, req->verb);
+				put(o, " ", 1);
+				putString(o, req->path);
+				if (req->queryString) {
+					put(o, "?", 1);
+					putString(o, req->queryString);
+				}
+				put(o, " ", 1);
+				putString(o, req->protocol);
+				break;
+			case VAR_REQUEST_METHOD:
+				putString(o, req->verb);
+				break;
+			case VAR_REQUEST_URI:
+				putString(o, req->path);
+				if (req->queryString) {
+					put(o, "?", 1);
+					putString(o, req->queryString);
+				}
+				break;
+			case VAR_URI:
+				putString(o, req->path);
+				break;
+			case VAR_ARGS:
+				putString(o, req->queryString);
+				break;
+			case VAR_SERVER_PROTOCOL:
+				putString(o, req->protocol);
+				break;
+			case VAR_HOST:
+				// without the port, like nginx
+				if (req->host) {
+					const char *port = strrchr(req->host, ':');
+					if (port && strchr(port, ']')) {
+						port = NULL;	// an IPv6 address without a port
+					}
+					putEscaped(o, req->host, port ? (size_t)(port - req->host) : strlen(req->host));
+				} else {
+					putString(o, NULL);
+				}
+				break;
+			case VAR_SERVER_NAME:
+				putString(o, req->server ? req->server->serverNames->serverName : NULL);
+				break;
+			case VAR_STATUS:
+				putNumber(o, status);
+				break;
+			case VAR_BYTES_SENT:
+				putNumber(o, req->bytesSent);
+				break;
+			case VAR_BODY_BYTES_SENT:
+				putNumber(o, bodySize);
+				break;
+			case VAR_REQUEST_TIME:
+				putMillis(o, microsSince(&req->start));
+				break;
+			case VAR_UPSTREAM_RESPONSE_TIME:
+				if (req->upstreamTime < 0) {
+					put(o, "-", 1);
+				} else {
+					putMillis(o, req->upstreamTime);
+				}
+				break;
+			case VAR_PID:
+				putNumber(o, getpid());
+				break;
+			case VAR_SCHEME:
+				putString(o, req->ssl ? "https" : "http");
+				break;
+			case VAR_CAPTURE:
+				if (o->match && (o->match[op->len].rm_so >= 0)) {
+					putEscaped(o, o->subject + o->match[op->len].rm_so,
+						o->match[op->len].rm_eo - o->match[op->len].rm_so);
+				}
+				break;
+			case VAR_HTTP_HEADER: {
+				int len;
+				const char *v = getRequestHeader(req, op->text, op->len, &len);
+				putEscaped(o, v, v ? len : 0);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Write a log record for a request with a compiled format
+ * Returns: the length of the record, which ends with a newline
+ */
+int
+formatLogRecord(_log_op *ops, _request *req, int status, size_t bodySize, char *buf, int size)
+{
+	_out o = {buf, buf + size - 1, false, NULL, NULL};
+	putOps(&o, ops, req, status, bodySize);
+	// there is always room for the newline
+	*o.p++ = '\n';
+	return o.p - buf;
+}
+
+/**
+ * Expand the variables of a compiled template, such as a `try_files`
+ * target. The values are not escaped.
+ * Returns: the length of the text, -1 if it doesn't fit the buffer
+ */
+int
+expandVariables(_log_op *ops, _request *req, char *buf, int size)
+{
+	return expandMatch(ops, req, NULL, NULL, buf, size);
+}
+
+/**
+ * Expand a template with the groups of a regex match, which has room
+ * for 10 of them
+ * Returns: the length of the text, -1 if it doesn't fit the buffer
+ */
+int
+expandMatch(_log_op *ops, _request *req, const char *subject, const regmatch_t *match, char *buf, int size)
+{
+	_out o = {buf, buf + size - 1, true, subject, match};
+	putOps(&o, ops, req, 0, 0);
+	if (o.p == o.end) {
+		return -1;
+	}
+	*o.p = '\0';
+	return o.p - buf;
+}